@@ -94,6 +94,48 @@ static inline void set_cr3(uint32 value)
 	__asm__ __volatile__ ( "movl %0, %%cr3" : : "a"(value) );
 }
 
+// Reloading CR3 discards every (non-global) TLB entry.
+static inline void flush_tlb(void)
+{
+	set_cr3(get_cr3());
+}
+
+// CR4 bits.
+#define CR4_PSE_MASK	(1 << 4)	// 4M pages.
+#define CR4_PAE_MASK	(1 << 5)	// 64 bit page table entries.
+#define CR4_PGE_MASK	(1 << 7)	// Global pages survive a CR3 reload.
+
+// Extended feature enable register, and its no-execute enable bit.
+#define MSR_EFER	0xc0000080
+#define EFER_NXE_MASK	(1 << 11)
+
+static inline uint32 get_cr4(void)
+{
+	register uint32 r;
+	__asm__ __volatile__ ( "movl %%cr4, %0" : "=r"(r) );
+	return r;
+}
+
+static inline void set_cr4(uint32 value)
+{
+	__asm__ __volatile__ ( "movl %0, %%cr4" : : "r"(value) );
+}
+
+// Discards every TLB entry, global ones included, by toggling CR4.PGE.
+static inline void flush_tlb_all(void)
+{
+	uint32	cr4 = get_cr4();
+
+	if (!(cr4 & CR4_PGE_MASK))
+	{
+		flush_tlb();
+		return;
+	}
+
+	set_cr4(cr4 & ~CR4_PGE_MASK);
+	set_cr4(cr4);
+}
+
 // Returns non-zero if interrupts are enabled, 0 if disabled.
 static inline int are_irqs_enabled(void)
 {
@@ -123,6 +165,37 @@ static inline uint64 read_tsc(void)
 	return tsc;
 }
 
+// Returns index of least significant set bit.  'x' must be non-zero.
+static inline uint32 bit_scan_forward(uint32 x)
+{
+	register uint32 r;
+	__asm__ ( "bsfl %1, %0" : "=r"(r) : "rm"(x) );
+	return r;
+}
+
+// Returns index of most significant set bit.  'x' must be non-zero.
+static inline uint32 bit_scan_reverse(uint32 x)
+{
+	register uint32 r;
+	__asm__ ( "bsrl %1, %0" : "=r"(r) : "rm"(x) );
+	return r;
+}
+
+// If *ptr == old, stores 'new' in it.  Returns what *ptr was.  Atomic.
+static inline uint32 atomic_cmpxchg(volatile uint32 *ptr, uint32 old, uint32 new)
+{
+	register uint32 prev;
+	__asm__ __volatile__ ( "lock; cmpxchgl %2, %1" : "=a"(prev), "+m"(*ptr) : "r"(new), "0"(old) : "memory" );
+	return prev;
+}
+
+// Stores 'value' in *ptr and returns what was there.  Atomic (xchg always locks).
+static inline uint32 atomic_xchg(volatile uint32 *ptr, uint32 value)
+{
+	__asm__ __volatile__ ( "xchgl %0, %1" : "+r"(value), "+m"(*ptr) : : "memory" );
+	return value;
+}
+
 #define DebugBreak()  __asm__ __volatile__ ("int $3")
 #define Halt() __asm__ __volatile__ ("cli;hlt")
 #define Nop() __asm__ __volatile__ ("nop;nop;nop;nop")
@@ -123,6 +123,9 @@ static irq_handler_type irq_handlers[16];
 
 static uint64 interrupt_counter[256];
 
+volatile int	irq_nesting = 0;
+volatile int	preempt_nesting = 0;
+
 void	irq_set_handler(int irq, void (*handler)(struct regs *r))
 {
 	ASSERT(irq >= 0);
@@ -251,7 +254,9 @@ void	interrupt_handler(struct regs *r)
 
 		if (handler)
 		{
+			irq_nesting++;
 			handler(r);
+			irq_nesting--;
 		}
 
 		if (r->int_no >= 40)
@@ -262,7 +267,7 @@ void	interrupt_handler(struct regs *r)
 		outportb(0x20, 0x20);		// Send EOI to master 8159 chip.
 
 // Only invoke scheduler AFTER we send EOI, so we do it outside of the timer irq handler.
-		if (r->int_no == 32)	// IRQ 0 = Timer = Int 32
+		if ((r->int_no == 32) && !preempt_nesting)	// IRQ 0 = Timer = Int 32
 		{
 			schedule();
 		}
@@ -2,3 +2,24 @@
 
 void	irq_set_handler(int irq, void (*handler)(struct regs *r));
 void	intr_install(void);
+
+// Non-zero while an IRQ handler is running.
+extern volatile int	irq_nesting;
+
+static inline int	in_irq(void)
+{
+	return irq_nesting;
+}
+
+// Non-zero while the timer must not switch tasks (see kmap_atomic()).
+extern volatile int	preempt_nesting;
+
+static inline void	preempt_disable(void)
+{
+	preempt_nesting++;
+}
+
+static inline void	preempt_enable(void)
+{
+	preempt_nesting--;
+}
@@ -145,7 +145,7 @@ void	ata_test(void)
 	irq_set_handler(15, ata_irq_handler);
 
 	{
-		void *buffer = kmalloc(512 * 8, 0);
+		void *buffer = kmalloc(512 * 8, HEAP_DRIVERS);
 		int r = ata_read_lba28(ATA_CTRLR_0_BASE, 0, 0, 1, buffer);
 //int	ata_read_lba28(uint16 base_port, int ms, uint32 lba28, uint8 count, void *buffer)
 
@@ -14,7 +14,7 @@ struct dentry*	dentry_alloc (struct dentry *parent, const char *name)
 		goto error;
 	}
 
-	if (NULL == (d = (struct dentry*)kmalloc (sizeof (struct dentry), HEAP_FAILOK))) {
+	if (NULL == (d = (struct dentry*)kmem_cache_alloc (dentry_cache, HEAP_FAILOK))) {
 		goto error;
 	}
 
@@ -40,7 +40,7 @@ struct dentry*	dentry_alloc (struct dentry *parent, const char *name)
 
 error:
 	if (d) {
-		kfree (d);
+		kmem_cache_free (dentry_cache, d);
 	}
 
 	if (name_tmp) {
@@ -57,5 +57,5 @@ void	dentry_free (struct dentry *d)
 // deal w/ ref_count.
 // unlink from tree.
 
-	kfree (d);
+	kmem_cache_free (dentry_cache, d);
 }
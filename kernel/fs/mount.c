@@ -71,7 +71,7 @@ T();	if (0 > (result = vfs_vnode_find(mntpoint, &mnt_vn)))
 	}
 
 #if 0
-T();	if (NULL == (mount = (struct fs_mount*)kmalloc(sizeof(*mount), HEAP_FAILOK)))
+T();	if (NULL == (mount = (struct fs_mount*)kmalloc(sizeof(*mount), HEAP_FAILOK | HEAP_VFS)))
 	{
 		result = -ENOMEM;
 		goto error;
@@ -0,0 +1,611 @@
+/*	kernel/fs/pagecache.c
+
+	Caches file data a page at a time, keyed by (vnode, page index).
+	Each vnode keeps its pages in a radix tree ("struct pc_tree", fan-out
+	of 2^PAGECACHE_RADIX_BITS), and every cached page is on one global LRU
+	list.  Reads are copies out of cached pages; the backing store is
+	only asked for pages that are missing.  File reads reach it through
+	vfs_read(), for both read() style calls and mapped files (vma_fault()).
+
+	Cached pages come from the direct map, so a run of them can be filled
+	by one vnode_ops->read() without any mapping, and copied from without
+	kmap_atomic() (the copy may fault on the caller's buffer).
+
+	Readahead: a miss reads the missing run up to the end of the request
+	plus the vnode's readahead window, in one backing read.  The window
+	starts at PAGECACHE_RA_MIN and doubles (up to PAGECACHE_RA_MAX) while
+	requests keep following on from the previous one.  A seek drops it
+	to zero.
+
+	When free memory drops below the low watermark, pages are evicted
+	from the cold end of the LRU, by "[vmmd]" or by the next fill.
+*/
+
+#include "kernel/kernel/kernel.h"
+
+#define PC_RADIX_SIZE	(1 << PAGECACHE_RADIX_BITS)
+#define PC_RADIX_MASK	(PC_RADIX_SIZE - 1)
+#define PC_MAX_HEIGHT	((32 + PAGECACHE_RADIX_BITS - 1) / PAGECACHE_RADIX_BITS)
+
+struct pc_node
+{
+	void		*slots[PC_RADIX_SIZE];	// Child nodes, or "struct pc_page" at the bottom level.
+	uint32		count;			// Non-NULL slots.
+};
+
+struct pc_page
+{
+	struct vnode	*vnode;		// NULL once dropped from the cache while still in use.
+	uint32		index;
+	uint32		pfn;		// Always below g_direct_map_limit.
+	uint32		valid;		// Bytes of file data, less than PAGE_SIZE at end of file.
+	uint32		refs;		// Readers copying out of it.  Never evicted while non-zero.
+	struct pc_page	*lru_prev;	// Towards more recently used.
+	struct pc_page	*lru_next;
+};
+
+static spinlock			pagecache_lock = INIT_SPINLOCK("pagecache");
+static struct kmem_cache	*pc_node_cache = NULL;
+static struct kmem_cache	*pc_page_cache = NULL;
+
+static struct pc_page		*lru_head = NULL;	// Most recently used.
+static struct pc_page		*lru_tail = NULL;
+
+static uint32			pc_pages = 0;
+static uint32			pc_hits = 0;
+static uint32			pc_misses = 0;
+static uint32			pc_reads = 0;		// Calls to vnode_ops->read().
+static uint32			pc_evictions = 0;
+
+// Non-zero if a tree of 'height' levels can hold 'index'.
+static inline int	pc_fits(uint32 height, uint32 index)
+{
+	return (height * PAGECACHE_RADIX_BITS >= 32) || !(index >> (height * PAGECACHE_RADIX_BITS));
+}
+
+static inline uint32	pc_slot(uint32 index, uint32 level)
+{
+	return (index >> ((level - 1) * PAGECACHE_RADIX_BITS)) & PC_RADIX_MASK;
+}
+
+// Caller holds pagecache_lock.
+static struct pc_page*	__pc_lookup(struct pc_tree *t, uint32 index)
+{
+	struct pc_node	*node = (struct pc_node*)t->root;
+	uint32		level = t->height;
+
+	if (!node || !pc_fits(t->height, index))
+	{
+		return NULL;
+	}
+
+	for (; node && (level > 1); level--)
+	{
+		node = (struct pc_node*)node->slots[pc_slot(index, level)];
+	}
+
+	return node ? (struct pc_page*)node->slots[pc_slot(index, 1)] : NULL;
+}
+
+static struct pc_node*	pc_node_alloc(void)
+{
+	struct pc_node	*node = (struct pc_node*)kmem_cache_alloc(pc_node_cache, HEAP_VFS);
+
+	memset(node, 0, sizeof(*node));
+
+	return node;
+}
+
+// Links 'pg' at pg->index.  The slot must be empty.  Caller holds pagecache_lock.
+static void	__pc_insert(struct pc_tree *t, struct pc_page *pg)
+{
+	struct pc_node	*node = NULL;
+	struct pc_node	*child = NULL;
+	uint32		level = 0;
+	uint32		slot = 0;
+
+// Add levels on top until the index fits.  The old root becomes slot 0.
+	while (!t->root || !pc_fits(t->height, pg->index))
+	{
+		node = pc_node_alloc();
+		if (t->root)
+		{
+			node->slots[0] = t->root;
+			node->count = 1;
+		}
+
+		t->root = node;
+		t->height++;
+	}
+
+	node = (struct pc_node*)t->root;
+	for (level = t->height; level > 1; level--)
+	{
+		slot = pc_slot(pg->index, level);
+		if (NULL == (child = (struct pc_node*)node->slots[slot]))
+		{
+			child = pc_node_alloc();
+			node->slots[slot] = child;
+			node->count++;
+		}
+
+		node = child;
+	}
+
+	slot = pc_slot(pg->index, 1);
+	ASSERT(!node->slots[slot]);
+	node->slots[slot] = pg;
+	node->count++;
+	t->pages++;
+}
+
+// Unlinks the page at 'index', freeing nodes that become empty.  Caller holds pagecache_lock.
+static void	__pc_delete(struct pc_tree *t, uint32 index)
+{
+	struct pc_node	*path[PC_MAX_HEIGHT];
+	struct pc_node	*node = (struct pc_node*)t->root;
+	uint32		level = 0;
+
+	for (level = t->height; level > 1; level--)
+	{
+		path[level - 1] = node;
+		node = (struct pc_node*)node->slots[pc_slot(index, level)];
+		ASSERT(node);
+	}
+
+	path[0] = node;
+	ASSERT(node->slots[pc_slot(index, 1)]);
+
+	for (level = 1; level <= t->height; level++)
+	{
+		node = path[level - 1];
+		node->slots[pc_slot(index, level)] = NULL;
+
+		if (--node->count)
+		{
+			break;
+		}
+
+		kmem_cache_free(pc_node_cache, node);
+		if (level == t->height)
+		{
+			t->root = NULL;
+			t->height = 0;
+		}
+	}
+
+	t->pages--;
+}
+
+// LRU helpers.  Caller holds pagecache_lock.
+static void	__lru_unlink(struct pc_page *pg)
+{
+	if (pg->lru_prev)	pg->lru_prev->lru_next = pg->lru_next;
+	else			lru_head = pg->lru_next;
+
+	if (pg->lru_next)	pg->lru_next->lru_prev = pg->lru_prev;
+	else			lru_tail = pg->lru_prev;
+
+	pg->lru_prev = pg->lru_next = NULL;
+}
+
+static void	__lru_push(struct pc_page *pg)
+{
+	pg->lru_prev = NULL;
+	pg->lru_next = lru_head;
+
+	if (lru_head)	lru_head->lru_prev = pg;
+	else		lru_tail = pg;
+
+	lru_head = pg;
+}
+
+static void	pc_page_free(struct pc_page *pg)
+{
+	pmm_free_page(pg->pfn);
+	kmem_cache_free(pc_page_cache, pg);
+}
+
+// Removes a page from its vnode's tree and the LRU.  Returns 1 if the caller
+// should free it now, 0 if a reader still holds it (the last one frees it).
+static int	__pc_drop(struct pc_page *pg)
+{
+	__pc_delete(&pg->vnode->pc, pg->index);
+	__lru_unlink(pg);
+	pg->vnode = NULL;
+	pc_pages--;
+
+	return !pg->refs;
+}
+
+static void	pc_release(struct pc_page *pg)
+{
+	int	orphan = 0;
+
+	spinlock_acquire(&pagecache_lock);
+	ASSERT(pg->refs);
+	orphan = !--pg->refs && !pg->vnode;
+	spinlock_release(&pagecache_lock);
+
+	if (orphan)
+	{
+		pc_page_free(pg);
+	}
+}
+
+uint32	pagecache_shrink(uint32 pages)
+{
+	struct pc_page	*pg = NULL;
+	struct pc_page	*prev = NULL;
+	uint32		freed = 0;
+
+	spinlock_acquire(&pagecache_lock);
+
+	for (pg = lru_tail; pg && (freed < pages); pg = prev)
+	{
+		prev = pg->lru_prev;
+
+		if (pg->refs)
+		{
+			continue;
+		}
+
+		__pc_drop(pg);
+		pc_page_free(pg);
+		freed++;
+	}
+
+	pc_evictions += freed;
+
+	spinlock_release(&pagecache_lock);
+
+	return freed;
+}
+
+void	pagecache_invalidate(struct vnode *vn, off64_t offset, off64_t count)
+{
+	struct pc_page	*pg = NULL;
+	struct pc_page	*next = NULL;
+	uint32		first = (uint32)(offset >> PAGE_BITS);
+	uint32		last = (uint32)min((offset + count - 1) >> PAGE_BITS, (off64_t)0xffffffff);
+
+	if ((count <= 0) || (offset < 0))
+	{
+		return;
+	}
+
+	spinlock_acquire(&pagecache_lock);
+
+// The LRU is walked, not the tree, so a huge range costs no more than the cache size.
+	for (pg = lru_head; pg && vn->pc.pages; pg = next)
+	{
+		next = pg->lru_next;
+
+		if ((pg->vnode == vn) && (pg->index >= first) && (pg->index <= last) && __pc_drop(pg))
+		{
+			pc_page_free(pg);
+		}
+	}
+
+	spinlock_release(&pagecache_lock);
+}
+
+// Reads up to 'want' missing pages starting at 'index' with one backing read,
+// and caches them.  Returns 0 with '*out' set to the page at 'index' (held), -ENOMEM
+// if no memory could be found for even one page, or the read error.
+static int	pc_fill(struct vnode *vn, uint32 index, uint32 want, struct pc_page **out)
+{
+	struct pc_page	*pages[PAGECACHE_RA_MAX];
+	struct pc_page	*pg = NULL;
+	uint8		*virt = NULL;
+	uint32		pfn = 0;
+	ssize_t		got = 0;
+	uint32		n = 0;
+	uint32		used = 0;
+	uint32		i = 0;
+
+	want = min(want, PAGECACHE_RA_MAX);
+
+// Stop the run at the first page that someone else already has.
+	spinlock_acquire(&pagecache_lock);
+	for (n = 1; (n < want) && (index + n) && !__pc_lookup(&vn->pc, index + n); n++);
+	spinlock_release(&pagecache_lock);
+
+	if (gp_total_free_4k_pages < g_pmm_low_watermark + n)
+	{
+		pagecache_shrink(n);
+	}
+
+// Contiguous and direct mapped, so the backing store sees one buffer.
+	while (!(pfn = pmm_alloc_contig(n, 0, g_direct_map_limit - 1)))
+	{
+		if (n > 1)
+		{
+			n >>= 1;
+		}
+		else if (!pagecache_shrink(1))
+		{
+			return -ENOMEM;
+		}
+	}
+
+	virt = (uint8*)phys_to_virt(PFN_TO_PHYS(pfn));
+	got = vn->vnode_ops->read(vn, virt, n * PAGE_SIZE, (off64_t)index << PAGE_BITS);
+	pc_reads++;
+
+	if (got < 0)
+	{
+		pmm_free_contig(pfn, n);
+		return (int)got;
+	}
+
+	ASSERT((uint32)got <= n * PAGE_SIZE);
+	memset(virt + got, 0, n * PAGE_SIZE - got);
+
+// Pages past end of file are not kept, except the first (so reads at EOF hit too).
+	used = max((got + PAGE_SIZE - 1) >> PAGE_BITS, 1);
+	if (used < n)
+	{
+		pmm_free_contig(pfn + used, n - used);
+	}
+
+	for (i = 0; i < used; i++)
+	{
+		pg = (struct pc_page*)kmem_cache_alloc(pc_page_cache, HEAP_VFS);
+		pg->vnode = vn;
+		pg->index = index + i;
+		pg->pfn = pfn + i;
+		pg->valid = min(max(got - (ssize_t)(i * PAGE_SIZE), 0), PAGE_SIZE);
+		pg->refs = 0;
+		pages[i] = pg;
+	}
+
+	*out = NULL;
+	spinlock_acquire(&pagecache_lock);
+
+	for (i = 0; i < used; i++)
+	{
+// Lost a race for this page.  Keep the one already there.
+		if ((pg = __pc_lookup(&vn->pc, pages[i]->index)))
+		{
+			pc_page_free(pages[i]);
+			pages[i] = pg;
+			continue;
+		}
+
+		__pc_insert(&vn->pc, pages[i]);
+		__lru_push(pages[i]);
+		pc_pages++;
+	}
+
+	*out = pages[0];
+	pages[0]->refs++;
+
+	spinlock_release(&pagecache_lock);
+
+	return 0;
+}
+
+// Updates the vnode's readahead window for a read of pages [first, last].
+// Returns the number of pages to read past 'last' on a miss.
+static uint32	pc_readahead(struct pc_tree *t, uint32 first, uint32 last)
+{
+	uint32	window = 0;
+
+	spinlock_acquire(&pagecache_lock);
+
+// Carrying on from the last read (or starting at the top) is sequential.
+// Only growing into new pages widens the window; re-reading the last page keeps it.
+	if ((first == t->ra_next) || (first + 1 == t->ra_next) || (first == 0))
+	{
+		if (last >= t->ra_next)
+		{
+			t->ra_window = t->ra_window ? min(t->ra_window * 2, PAGECACHE_RA_MAX) : PAGECACHE_RA_MIN;
+		}
+	}
+	else
+	{
+		t->ra_window = 0;
+	}
+
+	t->ra_next = last + 1;
+	window = t->ra_window;
+
+	spinlock_release(&pagecache_lock);
+
+	return window;
+}
+
+ssize_t	pagecache_read(struct vnode *vn, void *buffer, size_t count, off64_t offset)
+{
+	struct pc_page	*pg = NULL;
+	uint8		*dst = (uint8*)buffer;
+	uint32		index = 0;
+	uint32		last = 0;
+	uint32		window = 0;
+	uint32		in_page = 0;
+	uint32		n = 0;
+	ssize_t		done = 0;
+	ssize_t		r = 0;
+	int		eof = 0;
+
+	if (!vn || !vn->vnode_ops || !vn->vnode_ops->read)
+	{
+		return -EINVAL;
+	}
+
+	if (!(vn->vnode_ops->flags & VFS_CACHED))
+	{
+		return vn->vnode_ops->read(vn, buffer, count, offset);
+	}
+
+	if (!count)
+	{
+		return 0;
+	}
+
+	if ((offset < 0) || ((offset + count - 1) >> PAGE_BITS > 0xffffffff))
+	{
+		return -EINVAL;
+	}
+
+	index = (uint32)(offset >> PAGE_BITS);
+	last = (uint32)((offset + count - 1) >> PAGE_BITS);
+	window = pc_readahead(&vn->pc, index, last);
+
+	while (count && !eof)
+	{
+		index = (uint32)(offset >> PAGE_BITS);
+
+		spinlock_acquire(&pagecache_lock);
+		if ((pg = __pc_lookup(&vn->pc, index)))
+		{
+			pg->refs++;
+			__lru_unlink(pg);
+			__lru_push(pg);
+			pc_hits++;
+		}
+		else
+		{
+			pc_misses++;
+		}
+		spinlock_release(&pagecache_lock);
+
+		if (!pg && (0 > (r = pc_fill(vn, index, last - index + 1 + window, &pg))))
+		{
+// No memory to cache into.  Hand the rest to the vnode directly.
+			if (r == -ENOMEM)
+			{
+				r = vn->vnode_ops->read(vn, dst, count, offset);
+			}
+
+			return (r < 0) ? (done ? done : r) : done + r;
+		}
+
+		in_page = (uint32)offset & ~PAGE_MASK;
+		n = (in_page < pg->valid) ? min(count, pg->valid - in_page) : 0;
+		memcpy(dst, (uint8*)phys_to_virt(PFN_TO_PHYS(pg->pfn)) + in_page, n);
+		eof = (pg->valid < PAGE_SIZE);
+
+		pc_release(pg);
+
+		dst += n;
+		count -= n;
+		offset += n;
+		done += n;
+	}
+
+	return done;
+}
+
+ssize_t	pagecache_write(struct vnode *vn, const void *buffer, size_t count, off64_t offset)
+{
+	ssize_t	r = 0;
+
+	if (!vn || !vn->vnode_ops || !vn->vnode_ops->write)
+	{
+		return -EINVAL;
+	}
+
+	r = vn->vnode_ops->write(vn, buffer, count, offset);
+
+// Also drop a short last page the write may have extended.
+	if (r > 0)
+	{
+		pagecache_invalidate(vn, offset, r + PAGE_SIZE);
+	}
+
+	return r;
+}
+
+void	pagecache_dump(void)
+{
+	spinlock_acquire(&pagecache_lock);
+	kdebug(DEBUG_INFO, FAC_GENERAL, "pagecache: %d pages, %d hits, %d misses, %d reads, %d evicted\n",
+		pc_pages, pc_hits, pc_misses, pc_reads, pc_evictions);
+	spinlock_release(&pagecache_lock);
+}
+
+// Test file: PC_TEST_SIZE bytes of a pattern, counting backing reads.
+#define PC_TEST_SIZE	(40 * PAGE_SIZE + 100)
+
+static uint32	pc_test_reads = 0;
+
+static ssize_t	pc_test_read(struct vnode *vn, void *buffer, size_t count, off64_t offset)
+{
+	uint8	*p = (uint8*)buffer;
+	uint32	pos = (uint32)offset;
+
+	(void)vn;
+	pc_test_reads++;
+
+	for (; count && (pos < PC_TEST_SIZE); count--, pos++)
+	{
+		*(p++) = (uint8)(pos * 7 + (pos >> PAGE_BITS));
+	}
+
+	return p - (uint8*)buffer;
+}
+
+// Test: through vfs_read(), a repeated read never reaches the vnode, a
+// sequential scan is batched by readahead, reads stop at end of file, and
+// invalidate and shrink give every page back.  A vnode without VFS_CACHED
+// is read straight through.
+void	test_pagecache(void)
+{
+	static const struct vnode_ops	ops = { .flags = VFS_CACHED, .read = pc_test_read };
+	static const struct vnode_ops	uncached_ops = { .read = pc_test_read };
+	struct vnode	vn;
+	uint8		buf[100];
+	uint32		pos = 0;
+	uint32		i = 0;
+	uint32		reads = 0;
+
+	memset(&vn, 0, sizeof(vn));
+	vn.vnode_ops = &ops;
+	spinlock_init(&vn.v_lock, "test");
+
+	ASSERT(vfs_read(&vn, buf, sizeof(buf), 5) == sizeof(buf));
+	ASSERT(vfs_read(&vn, buf, sizeof(buf), 5) == sizeof(buf));
+	ASSERT(pc_test_reads == 1);
+	ASSERT(buf[99] == (uint8)(104 * 7));
+
+// Random access is not read ahead.
+	pagecache_invalidate(&vn, 0, PC_TEST_SIZE);
+	ASSERT(!vn.pc.pages && !vn.pc.root);
+	ASSERT(vfs_read(&vn, buf, 1, 30 * PAGE_SIZE) == 1);
+	ASSERT(vn.pc.pages == 1);
+
+// Sequential scan, in small reads.
+	for (pos = 0, reads = pc_test_reads; pos < PC_TEST_SIZE; pos += i)
+	{
+		i = vfs_read(&vn, buf, sizeof(buf), pos);
+		ASSERT(i && (buf[i - 1] == (uint8)((pos + i - 1) * 7 + ((pos + i - 1) >> PAGE_BITS))));
+	}
+
+	ASSERT(pos == PC_TEST_SIZE);
+	ASSERT(pc_test_reads - reads < 8);
+	ASSERT(vfs_read(&vn, buf, sizeof(buf), PC_TEST_SIZE) == 0);
+
+	reads = pc_test_reads;
+	ASSERT(vfs_read(&vn, buf, sizeof(buf), PAGE_SIZE - 50) == sizeof(buf));
+	ASSERT(pc_test_reads == reads);
+
+	pagecache_shrink(pc_pages);
+	ASSERT(!vn.pc.pages && !vn.pc.root && !vn.pc.height);
+
+	vn.vnode_ops = &uncached_ops;
+	reads = pc_test_reads;
+	ASSERT(vfs_read(&vn, buf, sizeof(buf), 5) == sizeof(buf));
+	ASSERT(vfs_read(&vn, buf, sizeof(buf), 5) == sizeof(buf));
+	ASSERT(pc_test_reads == reads + 2);
+	ASSERT(!vn.pc.pages);
+}
+
+void	pagecache_init(void)
+{
+	pc_node_cache = kmem_cache_create("pc_node", sizeof(struct pc_node), 0, NULL);
+	pc_page_cache = kmem_cache_create("pc_page", sizeof(struct pc_page), 0, NULL);
+
+	test_pagecache();
+}
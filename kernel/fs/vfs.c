@@ -14,6 +14,16 @@ static struct fs_type	*fs_type_list = NULL;
 // Start of all file-system lookups.
 struct fs_mount	*fs_root = NULL;
 
+struct kmem_cache	*vnode_cache = NULL;
+struct kmem_cache	*dentry_cache = NULL;
+
+// Called once during kernel init, before any file-system is registered.
+void	vfs_init(void)
+{
+	vnode_cache = kmem_cache_create("vnode", sizeof(struct vnode), 0, NULL);
+	dentry_cache = kmem_cache_create("dentry", sizeof(struct dentry), 0, NULL);
+}
+
 // Insert new fs into linked list of file-systems.
 int	vfs_register_fs (
 	const char *name,
@@ -28,7 +38,7 @@ int	vfs_register_fs (
 		return -EINVAL;
 	}
 
-	if (NULL == (fs = (struct fs_type*)kmalloc(sizeof(struct fs_type), HEAP_FAILOK)))
+	if (NULL == (fs = (struct fs_type*)kmalloc(sizeof(struct fs_type), HEAP_FAILOK | HEAP_VFS)))
 	{
 		return -ENOMEM;
 	}
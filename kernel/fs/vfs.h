@@ -22,6 +22,7 @@ typedef unsigned int mode_t;
 
 // Bit-flags for "vfs_ops->flags"
 #define VFS_NEED_DEV	1
+#define VFS_CACHED	2	// read() goes through the page cache (see pagecache.c).
 
 // Max length of a file-system object name.
 #define MAX_FNAME_LEN	255
@@ -88,6 +89,16 @@ typedef struct dentry {
 	struct spinlock		d_lock;
 } dentry;
 
+// Per-vnode page cache state.  Protected by the page cache's lock.
+struct pc_tree
+{
+	void			*root;		// Radix tree of "struct pc_page", by page index.
+	uint32			height;		// 0 if empty.
+	uint32			pages;
+	uint32			ra_next;	// Page index a sequential reader asks for next.
+	uint32			ra_window;	// Current readahead, in pages.
+};
+
 typedef struct vnode
 {
 // If the vnode is the absolute root of the global file-system, then "parent" points to the vnode itself.
@@ -107,6 +118,7 @@ typedef struct vnode
 	const struct vnode_ops	*vnode_ops;	// some file systems (dev) allow each file to have its own ops.
 	struct fs_mount		*mount;
 	void			*private_data;		// per filesystem private data.
+	struct pc_tree		pc;
 
 	struct spinlock		v_lock;
 } vnode;
@@ -139,8 +151,13 @@ typedef struct fs_type
 // Who has "/" mounted.  Start of all filename lookups.
 extern struct fs_mount	*fs_root;
 
+// Object caches for "struct vnode" and "struct dentry".
+extern struct kmem_cache	*vnode_cache;
+extern struct kmem_cache	*dentry_cache;
+
 /////////////////////////////////////////////////////////////////////////
 // vfs.c
+void	vfs_init(void);
 int	vfs_register_fs (
 	const char *name,
 	const struct vnode_ops *vnode_ops,
@@ -177,6 +194,32 @@ int	vfs_mount(const char *type, const char *mntpoint, const char *src, const cha
 // vfs_ops.c
 int	vfs_mkdir(const char *path);
 
+// Reads or writes file data at 'offset', through the page cache.  Returns
+// bytes transferred (short at end of file) or an error code.
+ssize_t	vfs_read(struct vnode *vn, void *buffer, size_t count, off64_t offset);
+ssize_t	vfs_write(struct vnode *vn, const void *buffer, size_t count, off64_t offset);
+
+/////////////////////////////////////////////////////////////////////////
+// pagecache.c
+void	pagecache_init(void);
+
+// Same contract as vnode_ops->read().  Served from cached pages, filling
+// them from the vnode (plus readahead) on a miss.  Vnodes whose ops lack
+// VFS_CACHED are passed straight through.
+ssize_t	pagecache_read(struct vnode *vn, void *buffer, size_t count, off64_t offset);
+
+// Writes through vnode_ops->write(), then drops the cached pages it covered.
+ssize_t	pagecache_write(struct vnode *vn, const void *buffer, size_t count, off64_t offset);
+
+// Drops cached pages of 'vn' that overlap [offset, offset + count).
+void	pagecache_invalidate(struct vnode *vn, off64_t offset, off64_t count);
+
+// Frees up to 'pages' least recently used pages.  Returns # freed.
+uint32	pagecache_shrink(uint32 pages);
+
+// Diagnostic function.
+void	pagecache_dump(void);
+
 // implemented in "ramfs.c"
 void	ramfs_init(void);
 
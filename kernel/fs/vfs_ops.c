@@ -5,6 +5,34 @@
 
 #include "kernel/kernel/kernel.h"
 
+// File data goes through the page cache.  It decides per vnode, by
+// VFS_CACHED, whether to keep the pages or pass the call straight through.
+ssize_t	vfs_read(struct vnode *vn, void *buffer, size_t count, off64_t offset)
+{
+	if (!vn || !buffer || (offset < 0)) {
+		return -EINVAL;
+	}
+
+	if (!vn->vnode_ops->read) {
+		return -ENOTIMPL;
+	}
+
+	return pagecache_read(vn, buffer, count, offset);
+}
+
+ssize_t	vfs_write(struct vnode *vn, const void *buffer, size_t count, off64_t offset)
+{
+	if (!vn || !buffer || (offset < 0)) {
+		return -EINVAL;
+	}
+
+	if (!vn->vnode_ops->write) {
+		return -ENOTIMPL;
+	}
+
+	return pagecache_write(vn, buffer, count, offset);
+}
+
 int	vfs_mkdir(const char *path)
 {
 	if (!path) {
@@ -14,7 +14,7 @@ T();	ASSERT (mount->fs_type);
 T();	ASSERT (mount->fs_type->vnode_ops);
 	// parent may be NULL.
 
-T();	if (NULL == (vn = kmalloc(sizeof(struct vnode), HEAP_FAILOK))) {
+T();	if (NULL == (vn = kmem_cache_alloc(vnode_cache, HEAP_FAILOK))) {
 		return -ENOMEM;
 	}
 
@@ -28,6 +28,7 @@ T();	if (NULL == (vn = kmalloc(sizeof(struct vnode), HEAP_FAILOK))) {
 T();	vn->vnode_ops = mount->fs_type->vnode_ops;
 	vn->mount = mount;
 	vn->private_data = NULL;
+	memset(&vn->pc, 0, sizeof(vn->pc));
 T();	spinlock_init (&(vn->v_lock), "vnode");
 
 T();	*vnode_new = vn;
@@ -110,6 +111,9 @@ int	vfs_vnode_find(const char *name, struct vnode **vn)
 	struct vnode	*tvn1;
 	struct vnode	*tvn2;
 	char		*tname;
+	struct region	scratch;
+	struct region_mark	mark;
+	uint8		scratch_buf[128];
 
 	if (!name || !vn || !*name)
 	{
@@ -138,11 +142,16 @@ int	vfs_vnode_find(const char *name, struct vnode **vn)
 	tvn1 = fs_root->v_root;
 	tvn2 = NULL;
 
+// Path components are copied into 'scratch'.  Short paths never touch the heap.
+	region_init_buf(&scratch, scratch_buf, sizeof(scratch_buf), 256, HEAP_FAILOK | HEAP_VFS);
+	region_mark(&scratch, &mark);
+
 	do
 	{
 // Assume current vnode is a directory.
 T();		if (!(tvn1->mode & S_IFDIR))
 		{
+			region_free(&scratch);
 			return -ENOENT;
 		}
 
@@ -152,35 +161,36 @@ T();		while (*name == '/') { name++; }
 // Scan forward and find next seperator or NULL.
 		for (i = 0; name[i] && name[i] != '/'; i++);
 
-T();		if (NULL == (tname = kmalloc(i, HEAP_FAILOK)))
+T();		if (NULL == (tname = region_strndup(&scratch, name, i)))
 		{
+			region_free(&scratch);
 			return -ENOMEM;
 		}
 
-		memcpy(tname, name, i);
-		tname[i] = 0;
-
 printf("name = '%s'\n", tname);
 
 // Scan vnode for this file.
 T();		if (NULL == tvn1->mount->fs_type->vnode_ops->find)
 		{
+			region_free(&scratch);
 			return -ENOTIMPL;
 		}
 
 T();		if (0 >= (i = tvn1->mount->fs_type->vnode_ops->find(tvn1, tname, &tvn2)))
 		{
 //			vfs_vnode_free(tvn1); // ???
+			region_free(&scratch);
 			return i;
 		}
 
 		tvn1 = tvn2;	tvn2 = NULL;
-		kfree(tname);	tname = NULL;
+		region_rollback(&scratch, &mark);	tname = NULL;
 
 		name += i;
 T();
 	} while (*name);
 
+	region_free(&scratch);
 	*vn = tvn1;
 
 	return 0;
@@ -16,9 +16,33 @@
 
 #define DEBUG_INT_DISABLE	0
 
-// Memory manager needs a cache of available virtual addresses for making temporary mappings.
-// This array is guarded by a spinlock and has a small number of entries.
-#define VMM_TEMP_PAGES		16
+// kmap_atomic() slots per nesting level (task, IRQ), for memory above the direct map.
+#define KMAP_DEPTH		8
+
+// vmm_map_pages() and vmm_release_pages() get and free physical pages this many at a time.
+#define VMM_MAP_BATCH		32
+
+// "[vmmd]" keeps this many cleared physical pages ready for pmm_get_page(),
+// clearing at most PMM_ZERO_REFILL_PAGES of them each time it runs.
+#define PMM_ZERO_POOL_PAGES	64
+#define PMM_ZERO_REFILL_PAGES	8
+
+// Use 4M pages (PSE), if the CPU has them, for the direct map, module
+// mappings and fully populated 4M ranges of the heap.
+#define VMM_USE_PSE		1
+
+// Mark kernel mappings global (PGE), if the CPU can, so that they stay in
+// the TLB when %cr3 changes.
+#define VMM_USE_PGE		1
+
+// Build for PAE paging: 64 bit page table entries, 2M large pages instead
+// of 4M, and no-execute (NX) on writable kernel mappings if the CPU has it.
+// Needs a CPU with PAE.  RAM above 4G is used too, as far as the page frame
+// database window in "kernel-elf.lds" goes, and reached through kmap_atomic().
+#define VMM_USE_PAE		0
+
+// Flushing more than this many pages flushes the whole TLB instead of doing an invlpg per page.
+#define VMM_FLUSH_ALL_PAGES	32
 
 // All heap allocations will be rounded up to the nearest multiple of this:
 #define HEAP_ALLOC_GRANULARITY	8
@@ -29,13 +53,67 @@
 // Should the heap keep track of who allocated each block (16 bytes overhead per-kmalloc).
 #define HEAP_TRACK		1
 
+// With HEAP_TRACK, kmalloc() also totals live bytes per call site (file:line)
+// in a table this big (a power of 2) in each arena, for the core-debugger's
+// "heapsites" report.  Zero disables it.
+#define HEAP_PROFILE_SITES	256
+
 // Causes the kmalloc/kfree to emit the data necessary to "replay" the allocation sequence.
 #define HEAP_REPLAY		0
 
+// Also link allocated blocks into "alloc_list" (debugging aid only, the heap
+// does not need it).  Lets the core-debugger dump allocations without walking the heap.
+#define HEAP_ALLOC_LIST		0
+
+// Fill every allocation with MALLOC_FILL, write rear guards, and poison
+// freed blocks.  This costs time on every kmalloc/kfree.  Use sampled
+// guarded allocations ("heapguard=N" on the command line) instead.
+#define HEAP_CHECK_ALL		0
+
+// Default for "heapguard=N": one in N kmallocs gets a guard-page slot.  Zero is off.
+#define HEAP_GUARD_RATE		0
+
+// kmalloc() requests larger than this are served by vmalloc() instead of the heap.
+#define VMALLOC_THRESHOLD	(2 * PAGE_SIZE)
+
+// vfree()d pages are not unmapped until this many have piled up (one TLB flush for all).
+#define VMALLOC_LAZY_PAGES	64
+
+// When fewer than this many physical pages are free, "[vmmd]" unmaps free heap pages.
+#define VMM_LOW_WATERMARK	256
+
+// Size of each heap arena (vfs, tasks, ...).  The "general" arena gets the
+// rest of the heap.  Arenas that fill up spill into "general".
+#define HEAP_ARENA_SIZE		(8 * 1024 * 1024)
+
+// "[vmmd]" keeps this many pages mapped past the heap's high-water mark,
+// so kmalloc() rarely has to fault pages in.  Zero disables it.
+#define HEAP_PREFAULT_PAGES	16
+
+// "[vmmd]" remaps heap ranges whose frames are scattered with a 4M page by
+// copying them, 4M with interrupts off.  It does that at most once per this
+// many timer ticks.  Ranges that need no copy are not limited.
+#define HEAP_PROMOTE_COPY_TICKS	1000
+
 // Grow the heap by this many pages everytime it needs to grow.
 // MUST be a power of 2!
 #define HEAP_GROW_PAGES		8
 
+// Do extra integrity checks (double-free detection) in the slab allocator.
+#define DEBUG_SLAB		1
+
+// Number of empty slabs that each object cache keeps around before
+// returning pages to the physical allocator.
+#define SLAB_MAX_EMPTY		1
+
+// Fan-out of the page cache's radix trees, as a power of 2.
+#define PAGECACHE_RADIX_BITS	6
+
+// Sequential readahead starts at PAGECACHE_RA_MIN pages and doubles while a
+// file keeps being read in order, up to PAGECACHE_RA_MAX (one backing read).
+#define PAGECACHE_RA_MIN	4
+#define PAGECACHE_RA_MAX	32
+
 // Number of keystrokes to buffer in keyboard driver.
 #define KBD_BUFFER_SIZE		128
 
@@ -16,12 +16,16 @@ struct	corehelp
 	uint32		magic2;
 
 	uint32		cr3;			// kernel's CR3 value.
+	uint32		cr4;			// kernel's CR4 value (CR4_PAE_MASK: cr3 points at a PDPT).
 	uint32		task_list_ptr_ptr;	// pointer to task_list
 	uint32		task_current_ptr_ptr;	// pointer to current
-	uint32		heap_free_list_ptr;	// &free_list
-	uint32		heap_alloc_list_ptr;	// &alloc_list
+	uint32		heap_start;		// first block_t in the heap.
+	uint32		heap_end;		// end of heap's virtual range.
+	uint32		heap_alloc_list_ptr;	// &alloc_list (zero if HEAP_ALLOC_LIST is off)
 	uint32		obj_array_ptr_ptr;	// pointer to _handle_array
 	uint32		obj_array_size_ptr;	// pointer to _handle_array_size
+	uint32		heap_sites_ptr;		// &heap_sites[0] (zero if not profiling)
+	uint32		heap_sites_count;	// HEAP_ARENA_COUNT * HEAP_PROFILE_SITES (one table per arena)
 };
 
 #if defined (BUILDING_KERNEL)
@@ -57,7 +57,11 @@ typedef struct _handle* handle;
 #include "kernel/kernel/corehelp.h"
 #include "kernel/ktasks/ktasks.h"
 #include "kernel/vmm/vmm.h"
+#include "kernel/vmm/slab.h"
+#include "kernel/vmm/vmalloc.h"
+#include "kernel/vmm/vma.h"
 #include "kernel/vmm/heap.h"
+#include "kernel/vmm/region.h"
 #include "kernel/fs/vfs.h"
 #include "kernel/fs/devfs.h"
 #include "kernel/drivers/vmware.h"
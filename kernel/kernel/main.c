@@ -23,6 +23,7 @@ void	init_corehelp(void)
 	corehelp.size = sizeof(corehelp);
 	corehelp.magic2 = CORE_HELP_MAGIC2;
 	corehelp.cr3 = get_cr3();
+	corehelp.cr4 = get_cr4();
 
 //	printf("corehelp = %p\n", &corehelp);
 
@@ -37,6 +38,8 @@ int	kmain (const struct phys_multiboot_info *mbi)
 	char *p = NULL;
 	int r = 0;
 	int do_fs_init = 0;
+	int do_heap_bench = 0;
+	uint32 heap_guard = HEAP_GUARD_RATE;
 
 	init_corehelp();
 	outportb(0x3f2, 0);	// shut off the floppy disk motor.
@@ -67,6 +70,12 @@ int	kmain (const struct phys_multiboot_info *mbi)
 	}
 
 	do_fs_init = NULL != k_getArg(g_kcmdline, temp, sizeof(temp), "fsinit");
+	do_heap_bench = NULL != k_getArg(g_kcmdline, temp, sizeof(temp), "heapbench");
+
+	if (NULL != (p = k_getArg(g_kcmdline, temp, sizeof(temp), "heapguard")))
+	{
+		heap_guard = max(atoi(p), 0);
+	}
 
 	con_init(video_mode);
 	test_spinlocks();
@@ -79,12 +88,24 @@ int	kmain (const struct phys_multiboot_info *mbi)
 //	dump_mboot_info(mbi);
 	vmm_init(mbi);
 	heap_init();
+	heap_guard_init(heap_guard);
+	slab_init();
+	vmalloc_init();
+	vma_init();
 	relocate_mbi(mbi);	// Now that we have a heap we can do this.
 	vmm_init_cleanup();	// Reclaim BIOS memory, .setup sections.
 
 	obj_init();
 	test_snprintf();
+	test_region();
+
+	if (do_heap_bench)
+	{
+		bench_heap();
+	}
 
+	vfs_init();
+	pagecache_init();
 	ramfs_init();
 	devfs_init();
 
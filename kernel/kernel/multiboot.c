@@ -59,23 +59,28 @@ void	dump_mboot_info(const struct phys_multiboot_info *mbi)
 
 struct multiboot	*gp_MultiBootInfo = NULL;
 
+// Everything relocate_mbi() copies is kept forever, so it is packed into a region.
+static struct region	mbi_region;
+
 void	relocate_mbi(const struct phys_multiboot_info *mbi)
 {
 	int	i;
 	uint32	next_mod_addr = (uint32)&_kernel_mod_map_start;
 
-	gp_MultiBootInfo = (struct multiboot*)kmalloc(sizeof(struct multiboot), 0);
+	region_init(&mbi_region, PAGE_SIZE / 2, 0);
+
+	gp_MultiBootInfo = (struct multiboot*)region_alloc(&mbi_region, sizeof(struct multiboot));
 
 // Basic stuff.
 	gp_MultiBootInfo->flags = mbi->flags;
 	gp_MultiBootInfo->mem_lower = mbi->mem_lower;
 	gp_MultiBootInfo->mem_upper = mbi->mem_upper;
 	gp_MultiBootInfo->boot_device = mbi->boot_device;
-	gp_MultiBootInfo->cmdline = strdup((const char*)mbi->cmdline);
+	gp_MultiBootInfo->cmdline = region_strdup(&mbi_region, (const char*)mbi->cmdline);
 
 // Modules.
 	gp_MultiBootInfo->mods_count = mbi->mods_count;
-	gp_MultiBootInfo->mods_array = (struct mb_module*)kmalloc(mbi->mods_count * sizeof(struct mb_module), 0);
+	gp_MultiBootInfo->mods_array = (struct mb_module*)region_alloc(&mbi_region, mbi->mods_count * sizeof(struct mb_module));
 
 	if (mbi->flags & (1 << 3))
 	{
@@ -86,7 +91,7 @@ void	relocate_mbi(const struct phys_multiboot_info *mbi)
 
 			mod->start_phys = (void*)(src->mod_start);
 			mod->size = src->mod_end - src->mod_start;
-			mod->string = strdup((char*)(src->string));
+			mod->string = region_strdup(&mbi_region, (char*)(src->string));
 			mod->start_virt = NULL;
 
 			FIXME(); // this logic is not fool proof.  An insanely huge mod would wrap the address space.
@@ -96,7 +101,7 @@ void	relocate_mbi(const struct phys_multiboot_info *mbi)
 
 				mod->start_virt = (void*)next_mod_addr;
 				next_mod_addr += pages * PAGE_SIZE;
-				vmm_map_pages(mod->start_virt, mod->start_phys, pages, (PTE_RO | PTE_PRESENT | PTE_SUPERVISOR | VMM_PHYS_REAL));
+				vma_map_phys(&kernel_vm_space, mod->start_virt, (uint32)mod->start_phys, pages, PTE_KCODE, mod->string);
 
 				if (!strncmp(mod->start_virt, "VAST", 4))
 				{
@@ -117,6 +122,6 @@ void	relocate_mbi(const struct phys_multiboot_info *mbi)
 // BIOS memory map.
 	gp_MultiBootInfo->e820_count = mbi->mmap_length / sizeof(struct e820_memory_map);
 	i = gp_MultiBootInfo->e820_count * sizeof(struct e820_memory_map);
-	gp_MultiBootInfo->e820_table = (struct e820_memory_map*)kmalloc(i, 0);
+	gp_MultiBootInfo->e820_table = (struct e820_memory_map*)region_alloc(&mbi_region, i);
 	memcpy(gp_MultiBootInfo->e820_table, mbi->mmap_addr, i);
 }
@@ -14,6 +14,9 @@ int		_handle_array_used = 0;
 int		_handle_array_next_free = 0;
 spinlock	_handle_array_lock = INIT_SPINLOCK("handle_array");
 
+struct kmem_cache	*_hnode_cache = NULL;
+struct kmem_cache	*_wait_node_cache = NULL;
+
 // Valid objects are non-null pointers with LSB cleared.
 static inline int IS_VALID_HNODE(struct hnode *hnode)
 {
@@ -33,10 +36,13 @@ void	obj_init(void)
 	corehelp.obj_array_ptr_ptr = (uint32)&_handle_array;
 	corehelp.obj_array_size_ptr = (uint32)&_handle_array_size;
 
+	_hnode_cache = kmem_cache_create("hnode", sizeof(struct hnode), 0, NULL);
+	_wait_node_cache = kmem_cache_create("wait_node", sizeof(struct wait_node), 0, NULL);
+
 	_handle_array_size = INITIAL_OBJECT_ARRAY_SIZE;
 	bytes = _handle_array_size * sizeof(struct hnode*);
 
-	_handle_array = (struct hnode**)kmalloc(bytes, 0);
+	_handle_array = (struct hnode**)kmalloc(bytes, HEAP_OBJECTS);
 	_handle_array_used = 0;
 	_handle_array_next_free = 0;
 
@@ -117,14 +123,14 @@ handle	_obj_dup_internal(handle h, struct task *task)
 	ASSERT(spinlock_is_locked(&_handle_array_lock));
 	ASSERT(IS_VALID_HANDLE(h));
 
-	if (NULL == (hnode = (struct hnode*)kmalloc(sizeof (struct hnode), HEAP_FAILOK)))
+	if (NULL == (hnode = (struct hnode*)kmem_cache_alloc(_hnode_cache, HEAP_FAILOK)))
 	{
 		return (handle)-ENOMEM;
 	}
 
 	if (0 > (int)(h_new = _handle_alloc()))
 	{
-		kfree(hnode);
+		kmem_cache_free(_hnode_cache, hnode);
 		return (handle)-ENOMEM;
 	}
 
@@ -237,7 +243,7 @@ handle	_obj_open(const char *name, uint32 flags, const struct onode_ops *ops, in
 		return (handle)-ENOMEM;
 	}
 
-	if (NULL == (hnode = (struct hnode*)kmalloc(sizeof(*hnode), HEAP_FAILOK)))
+	if (NULL == (hnode = (struct hnode*)kmem_cache_alloc(_hnode_cache, HEAP_FAILOK)))
 	{
 		_handle_free(h);
 		spinlock_release(&_handle_array_lock);
@@ -245,10 +251,10 @@ handle	_obj_open(const char *name, uint32 flags, const struct onode_ops *ops, in
 	}
 
 	onode_size = sizeof(*onode) - sizeof(onode->extra) + extra_bytes;
-	if (NULL == (onode = (struct onode*)kmalloc(onode_size, HEAP_FAILOK)))
+	if (NULL == (onode = (struct onode*)kmalloc(onode_size, HEAP_FAILOK | HEAP_OBJECTS)))
 	{
 		_handle_free(h);
-		kfree(hnode);
+		kmem_cache_free(_hnode_cache, hnode);
 		spinlock_release(&_handle_array_lock);
 		return (handle)-ENOMEM;
 	}
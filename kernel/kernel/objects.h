@@ -138,6 +138,10 @@ extern int		_handle_array_next_free;
 // a handle slot.  Generally not needed when just using an object.
 extern spinlock		_handle_array_lock;
 
+// Object caches for "struct hnode" and "struct wait_node".
+extern struct kmem_cache	*_hnode_cache;
+extern struct kmem_cache	*_wait_node_cache;
+
 
 // Internal functions.
 
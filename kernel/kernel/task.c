@@ -10,6 +10,7 @@ struct task		*task_list = NULL;
 
 struct task		*current = NULL;
 static struct task	*idle_task = NULL;
+static struct kmem_cache	*task_cache = NULL;
 
 taskid_t		reaper_taskid = 0;
 
@@ -89,12 +90,12 @@ taskid_t	task_create(int (*entry_point)(void *arg), void *arg, const char *name,
 		return -EINVAL;
 	}
 
-	if (NULL == (task = (struct task*)kmalloc(sizeof(struct task), HEAP_FAILOK)))
+	if (NULL == (task = (struct task*)kmem_cache_alloc(task_cache, HEAP_FAILOK)))
 	{
 		return -ENOMEM;
 	}
 
-	if (NULL == (kstack = (uint32*)kmalloc(TASK_KSTACK_SIZE, HEAP_FAILOK)))
+	if (NULL == (kstack = (uint32*)kmalloc(TASK_KSTACK_SIZE, HEAP_FAILOK | HEAP_TASKS)))
 	{
 		ret = -ENOMEM;
 		goto error;
@@ -151,7 +152,7 @@ taskid_t	task_create(int (*entry_point)(void *arg), void *arg, const char *name,
 
 error:
 	if (task->kstack) kfree(task->kstack);
-	if (task) kfree(task);
+	if (task) kmem_cache_free(task_cache, task);
 	return ret;
 }
 
@@ -167,7 +168,9 @@ void	scheduler_init(void)
 	corehelp.task_list_ptr_ptr = (uint32)&task_list;
 	corehelp.task_current_ptr_ptr = (uint32)&current;
 
-	task = (struct task*)kmalloc(sizeof(struct task), 0);
+	task_cache = kmem_cache_create("task", sizeof(struct task), 0, NULL);
+
+	task = (struct task*)kmem_cache_alloc(task_cache, 0);
 	task->state = RUNNING;
 	task->taskid = gen_taskid();
 	task->exit_code = 0;
@@ -125,7 +125,7 @@ int	_obj_wake(struct hnode *hnode, int count)
 			{
 				struct wait_node *temp = wn->task->wait_list;
 				_obj_wn_detach(temp);
-				kfree(temp);
+				kmem_cache_free(_wait_node_cache, temp);
 			}
 //printf("while loop of death is done.\n");
 
@@ -133,7 +133,7 @@ int	_obj_wake(struct hnode *hnode, int count)
 		}
 
 		spinlock_release(&wn->task->lock);
-		kfree(wn);
+		kmem_cache_free(_wait_node_cache, wn);
 
 		if (count != -1)
 		{
@@ -218,7 +218,7 @@ int	obj_wait(handle h)
 	ASSERT(!current->wait_list);
 	ASSERT(!current->wait_count);
 
-	if (NULL == (wn = (struct wait_node *)kmalloc(sizeof(*wn), HEAP_FAILOK)))
+	if (NULL == (wn = (struct wait_node *)kmem_cache_alloc(_wait_node_cache, HEAP_FAILOK)))
 	{
 		return -ENOMEM;
 	}
@@ -242,7 +242,7 @@ int	obj_wait(handle h)
 			hnode->onode->ops->unsignal(hnode, current);
 		}
 
-		kfree(wn);
+		kmem_cache_free(_wait_node_cache, wn);
 		spinlock_release(&current->lock);
 		_obj_release(hnode);
 
@@ -9,5 +9,8 @@ extern int	ktask_hud_entry(void *arg);
 // reaper.c
 extern int	ktask_reaper_entry(void *arg);
 
+// vmmd.c
+extern int	ktask_vmmd_entry(void *arg);
+
 // startup.c
 extern int	ktask_startup_entry(void *arg);
@@ -10,6 +10,8 @@ int	ktask_startup_entry(void *ptr)
 
 	reaper_taskid = task_create(ktask_reaper_entry, NULL, "[reaper]", RUNNABLE);
 
+	task_create(ktask_vmmd_entry, NULL, "[vmmd]", RUNNABLE);
+
 	create_demo_threads(8);
 
 	return 0;
@@ -0,0 +1,49 @@
+/*	kernel/ktasks/vmmd.c
+
+	Implements the 'vmmd' task, which does memory housekeeping in the
+	background.  When free physical pages drop below the low watermark
+	(see "struct vmm_stats"), it evicts cold pages from the page cache,
+	then trims unused pages out of the heap.
+	Otherwise, it maps pages ahead of the heap's high-water mark, tops
+	up the pool of zeroed physical pages, and remaps full 4M ranges of
+	the heap with 4M pages.  It also finishes off
+	kfree()s that were deferred by IRQ handlers.
+*/
+
+#include "kernel/kernel/kernel.h"
+
+int	ktask_vmmd_entry(void *arg)
+{
+	struct vmm_stats	stats;
+	uint32			short_pages = 0;
+
+	current->ticks_left = 1;
+	current->ticks_reload = 1;
+
+	while (1)
+	{
+		heap_drain_deferred();
+		vmm_get_stats(&stats);
+
+		if (stats.pmm_free_pages < stats.pmm_low_watermark)
+		{
+			short_pages = stats.pmm_low_watermark - stats.pmm_free_pages;
+			short_pages -= pagecache_shrink(short_pages);
+
+			if (short_pages)
+			{
+				heap_trim(short_pages);
+			}
+		}
+		else
+		{
+			heap_prefault();
+			pmm_zero_refill(PMM_ZERO_REFILL_PAGES);
+			heap_promote();
+		}
+
+		yield();
+	}
+
+	return 0;	// this task should never exit.
+}
@@ -19,7 +19,13 @@ static uint8* ATTR_SETUP_DATA next_free_page_addr = NULL;
 static uint8* ATTR_SETUP_DATA first_free_page_addr = NULL;
 
 // Physical address of kernel page dir and various page tables.
-static uint32* ATTR_SETUP_DATA kernel_pdir = NULL;
+static pte_t* ATTR_SETUP_DATA kernel_pdir = NULL;
+
+#if (VMM_USE_PAE)
+// Physical address of the page directory pointer table, what %cr3 holds.
+// Its four entries point at the four pages of 'kernel_pdir'.
+static uint64* ATTR_SETUP_DATA kernel_pdpt = NULL;
+#endif
 
 // We update this after we turn on paging.
 extern uint16* ATTR_SETUP_DATA _setup_vga_base;
@@ -27,6 +33,12 @@ extern uint16* ATTR_SETUP_DATA _setup_vga_base;
 // For internal use only.
 static int	ATTR_SETUP_DATA paging_enabled = 0;
 
+// Set by _setup_enable_cpu_features() if _setup_map_pages() may use 4M pages,
+// and if it should mark kernel mappings global.
+static int	ATTR_SETUP_DATA pse_enabled = 0;
+static int	ATTR_SETUP_DATA pge_enabled = 0;
+static int	ATTR_SETUP_DATA nx_enabled = 0;
+
 
 #if (DEBUG_SETUP_PAGING)
 
@@ -65,7 +77,7 @@ static inline void ATTR_SETUP_TEXT clear_pages(void *addr, int count)
 
 // For the purposes of ".setup", and memory below "&_kernel_virtual" is
 // identity mapped, even if those mappings are not fully created.
-static inline const void* ATTR_SETUP_TEXT virt_to_phys(const void *virt)
+static inline const void* ATTR_SETUP_TEXT _setup_virt_to_phys(const void *virt)
 {
 	return ((void*)virt > (void*)&_kernel_virtual) ?
 		(uint8*)virt - (uint32)&_kernel_virtual :
@@ -98,6 +110,17 @@ static void*	ATTR_SETUP_TEXT _setup_alloc_pages(int count)
 	return ret;
 }
 
+// Low 32 bits of the TSC, for the boot phase timings.  read_tsc() lives in
+// .text, which we can't call before paging is on.
+static uint32	ATTR_SETUP_TEXT _setup_rdtsc(void)
+{
+	uint32	low;
+
+	__asm__ __volatile__ ("rdtsc" : "=a"(low) : : "%edx");
+
+	return low;
+}
+
 
 /****************************************************************************
 
@@ -115,7 +138,8 @@ static void	ATTR_SETUP_TEXT _setup_map_pages(uint32 virtual, uint32 physical, ui
 {
 	uint32	pde_slot = 0;
 	uint32	pte_slot = 0;
-	uint32 *pte_table = 0;
+	pte_t	*pte_table = 0;
+	pte_t	pte_flags = flags;
 
 #if (DEBUG_SETUP_PAGING)
 	_setup_log("map_pages: virt:%p, phys:%p, count:%d, flags:%p\n", virtual, physical, count, flags);
@@ -154,11 +178,41 @@ static void	ATTR_SETUP_TEXT _setup_map_pages(uint32 virtual, uint32 physical, ui
 		Halt();
 	}
 
+// The kernel's own mappings (not the low identity maps) are global, and
+// can't be executed if writable.  .setup runs from a writable low mapping.
+	if (pge_enabled && (virtual >= (uint32)&_kernel_direct_map_start))
+	{
+		pte_flags |= PTE_GLOBAL;
+	}
+
+	if (nx_enabled && (flags & PTE_RW) && (virtual >= (uint32)&_kernel_direct_map_start))
+	{
+		pte_flags |= PTE_NX;
+	}
+
 	while (count)
 	{
 		pde_slot = ADDR_TO_PDE_SLOT(virtual);
 		pte_slot = ADDR_TO_PTE_SLOT(virtual);
 
+// Whole, aligned 4M runs get a 4M page and no page table.
+		if (pse_enabled && !kernel_pdir[pde_slot] && (count >= PTE_SIZE) &&
+			IS_PDIR_ALIGNED(virtual) && IS_PDIR_ALIGNED(physical))
+		{
+			kernel_pdir[pde_slot] = physical | pte_flags | PTE_4M_PAGE;
+
+			count -= PTE_SIZE;
+			virtual += PDIR_SIZE;
+			physical += PDIR_SIZE;
+			continue;
+		}
+
+		if (kernel_pdir[pde_slot] & PTE_4M_PAGE)
+		{
+			_setup_log("page %p already mapped by a 4M page!\n", virtual);
+			Halt();
+		}
+
 		if (!kernel_pdir[pde_slot])
 		{
 			uint32 ptbl = (uint32)_setup_alloc_pages(1);
@@ -168,16 +222,16 @@ static void	ATTR_SETUP_TEXT _setup_map_pages(uint32 virtual, uint32 physical, ui
 #endif
 		}
 
-		pte_table = (uint32*)(kernel_pdir[pde_slot] & PTE_MEM_MASK);
+		pte_table = (pte_t*)(uint32)PTE_ADDR(kernel_pdir[pde_slot]);
 
 		if (pte_table[pte_slot])
 		{
 			_setup_log("page %p already mapped to %p (physical %p)!\n",
-				virtual, pte_table[pte_slot], pte_table[pte_slot] & ~PTE_MEM_MASK);
+				virtual, (uint32)pte_table[pte_slot], (uint32)PTE_ADDR(pte_table[pte_slot]));
 			Halt();
 		}
 
-		pte_table[pte_slot] = physical | flags;
+		pte_table[pte_slot] = physical | pte_flags;
 
 		count--;
 		virtual += PAGE_SIZE;
@@ -185,175 +239,281 @@ static void	ATTR_SETUP_TEXT _setup_map_pages(uint32 virtual, uint32 physical, ui
 	}
 }
 
-#define SPINNER_SIZE 4
-static const char ATTR_SETUP_DATA *spinner_str = "-/|\\";
-
-// Low-level function to add pages to our linked list of free pages.
-static void	ATTR_SETUP_TEXT	_setup_add_pages(uint32 base, uint32 pages)
+// Turns on 4M pages (CR4.PSE) and global pages (CR4.PGE), if the CPU has
+// them.  PAE builds also need CR4.PAE, and get no-execute if the CPU has
+// it.  Must be called before paging is enabled.
+static void	ATTR_SETUP_TEXT _setup_enable_cpu_features(void)
 {
-// We'll hijack the very last 4K page of real-mode memory.   We do this because we know
-// that it is already mapped, so its page table entries won't need to be allocated.
-	pmm_list_hdr *node = (pmm_list_hdr *)&_kernel_vmm_setup;
-	uint32	pde_slot = ADDR_TO_PDE_SLOT((uint32)node);
-	uint32	pte_slot = ADDR_TO_PTE_SLOT((uint32)node);
-	uint32	*ptbl_phys = NULL;
-	uint32	*ptbl_virt = NULL;
-	uint32	*clr_ptr = NULL;
-	uint32	spinner = 0;
-
-#if (DEBUG_SETUP_PAGING)
-	_setup_log("_setup_add_pages(%d, %p, %d)\n", e820_index, base, pages);
+	uint32	eax = 1;
+	uint32	edx = 0;
+	uint32	cr4 = 0;
+#if (VMM_USE_PAE)
+	uint32	ext = 0;
+	uint32	ext_edx = 0;
 #endif
 
-	if (!gp_kernel_page_dir)
+	__asm__ __volatile__ ("cpuid" : "+a"(eax), "=d"(edx) : : "%ebx", "%ecx");
+
+#if (VMM_USE_PAE)
+	if (!(edx & CPUID_PAE_MASK))
 	{
-		_setup_log("PANIC: _setup_add_pages internal error #0.\n");
+		_setup_log("PANIC: kernel built for PAE, but the CPU does not have it.\n");
 		Halt();
 	}
 
-	if (!gp_kernel_page_dir[pde_slot])
+	cr4 |= CR4_PAE_MASK;
+	pse_enabled = 1;	// 2M pages come with PAE.
+
+	ext = 0x80000000;
+	__asm__ __volatile__ ("cpuid" : "+a"(ext) : : "%ebx", "%ecx", "%edx");
+
+	if (ext >= 0x80000001)
 	{
-		_setup_log("PANIC: _setup_add_pages internal error #1 (%x, %x).\n", pde_slot, pte_slot);
-		Halt();
+		ext = 0x80000001;
+		__asm__ __volatile__ ("cpuid" : "+a"(ext), "=d"(ext_edx) : : "%ebx", "%ecx");
+		nx_enabled = !!(ext_edx & CPUID_NX_MASK);
 	}
 
-	ptbl_phys = (uint32*)(gp_kernel_page_dir[pde_slot] & PTE_MEM_MASK);
-	ptbl_virt = (uint32*)((uint32)&_kernel_ptbl_start + (uint32)(pde_slot << 12));
+	if (nx_enabled)
+	{
+		__asm__ __volatile__
+		(
+			"rdmsr\n"
+			"orl	%1, %%eax\n"
+			"wrmsr\n"
+			: /* outputs */
+			: /* inputs */		"c" (MSR_EFER), "i" (EFER_NXE_MASK)
+			: /* clobbers */	"%eax", "%edx"
+		);
+	}
+	else
+	{
+		_setup_log("setup: CPU lacks no-execute pages.\n");
+	}
+#endif
 
-	if ((base & PAGE_MASK) != base)
+	if (VMM_USE_PSE && (edx & CPUID_PSE_MASK))
 	{
-		_setup_log("PANIC: %p is not page-aligned!\n", base);
-		Halt();
+		cr4 |= CR4_PSE_MASK;
+		pse_enabled = 1;
 	}
 
-	_setup_log("Scanning memory at %p, %d  ", base, pages);
+	if (VMM_USE_PGE && (edx & CPUID_PGE_MASK))
+	{
+		cr4 |= CR4_PGE_MASK;
+		pge_enabled = 1;
+	}
 
-	for (; pages; base += PAGE_SIZE, pages--)
+	if (!pse_enabled || !pge_enabled)
 	{
-		if (pages % 4096 == 0) _setup_putchar('.');	// 1 per 16 meg.
+		_setup_log("setup: CPU lacks 4M pages (%d) or global pages (%d).\n", !pse_enabled, !pge_enabled);
+	}
 
-		*_setup_calc_vram_cursor() = (uint16)(0x0700 | spinner_str[spinner++ % SPINNER_SIZE]);
+	__asm__ __volatile__
+	(
+		"movl	%%cr4, %%eax\n"
+		"orl	%0, %%eax\n"
+		"movl	%%eax, %%cr4\n"
+		: /* outputs */
+		: /* inputs */		"m" (cr4)
+		: /* clobbers */	"%eax"
+	);
+}
 
-// If the page is in the range of what we already have loaded or mapped, skip it.
-		if (base < (uint32)next_free_page_addr)
-		{
-#if (DEBUG_SETUP_PAGING)
-//			_setup_log("skipping %p\n", base);
+// Trims an e820 entry to the whole pages that we can use, as a first frame
+// and a count.  Returns 0 if none of it is usable.
+static int	ATTR_SETUP_TEXT _setup_e820_usable(const struct e820_memory_map *e820, uint32 *pfn, uint32 *pages)
+{
+	uint64 base_64 = *(uint64*)&(e820->base_addr_low);      // HACK ALERT!
+	uint64 len_64 = *(uint64*)&(e820->length_low);          // HACK ALERT!
+
+	if (e820->type != E820_AVAIL) return 0;
+
+// base and len should be page aligned...
+	if (base_64 & (PAGE_SIZE - 1))
+	{
+		// Round length down to next page and base up.
+		len_64 -= (base_64 & (PAGE_SIZE - 1));
+		base_64 = (base_64 & ~(PAGE_SIZE - 1)) + PAGE_SIZE;
+	}
+
+// If length is a partial page, truncate to end block at previous page.
+	if (len_64 & (PAGE_SIZE -1))
+	{
+		len_64 &= ~(PAGE_SIZE - 1);
+	}
+
+// Without PAE, page table entries can't reach memory above 4G.
+#if (!VMM_USE_PAE)
+	if (base_64 >= (1LL << 32))
+	{
+		_setup_log("Warning: memory above 4G not used.\n");
+		return 0;
+	}
 #endif
-			continue;
+
+// If we start below 1M, and don't extend above it, skip it.  We won't allocate physical pages
+// from < 1M.
+	if (base_64 < 0x100000)
+	{
+		if (base_64 + len_64 > 0x100000)
+		{
+			_setup_log("Warning: memory spans 1M boundry.  Skipping.\n");
 		}
+		return 0;
+	}
 
-// Map this page at our special virtual address.
-		ptbl_virt[pte_slot] = base | PTE_KDATA;
+#if (!VMM_USE_PAE)
+// If base starts below 4G but spans across it, truncate it.
+	if ((base_64 + len_64) >= (1LL << 32))
+	{
+		_setup_log("Warning: memory above 4G not used.\n");
+		len_64 = (1LL << 32) - base_64;
+	}
+#endif
 
-// Flush the page tables (this kills performance??)
-		InvalidatePage(node);
+	*pfn = (uint32)(base_64 >> PAGE_BITS);
+	*pages = (uint32)(len_64 >> PAGE_BITS);
 
-		// zero fill memory page.
-		for (clr_ptr = (uint32*)node; clr_ptr < (uint32*)((uint8*)node + PAGE_SIZE); *(clr_ptr++) = 0);
+	return (*pages != 0);
+}
 
-		node->next = gp_next_free_4k_page;
-		node->size = PAGE_SIZE;
+// Number of entries in the page frame database, and its physical address.
+// Only valid in .setup (the kernel copies live in "pmm_pages" and "pmm_page_count").
+static uint32	ATTR_SETUP_DATA page_db_count = 0;
+static struct page* ATTR_SETUP_DATA page_db_phys = NULL;
+
+// Allocates (zeroed) and maps one "struct page" per physical page, up to the
+// highest usable page in the e820 map (above 4G too, with PAE).  A zeroed
+// entry means "in use", so everything that is not explicitly freed later
+// stays allocated.  Must be called before paging is enabled.
+static void	ATTR_SETUP_TEXT _setup_alloc_page_db(const struct phys_multiboot_info *mbi)
+{
+	const struct e820_memory_map	*e820 = (const struct e820_memory_map*) mbi->mmap_addr;
+	int		e820_count = mbi->mmap_length / sizeof(struct e820_memory_map);
+	uint32		max_count = ((uint32)&_kernel_page_db_end - (uint32)&_kernel_page_db_start) / sizeof(struct page);
+	uint32		pfn = 0;
+	uint32		pages = 0;
+	uint32		db_pages = 0;
+	int		i = 0;
+
+	for (i = 0; i < e820_count; i++, e820++)
+	{
+		if (!_setup_e820_usable(e820, &pfn, &pages)) continue;
 
-		gp_next_free_4k_page = (void*)base;
-		gp_total_free_4k_pages++;
+		page_db_count = max(page_db_count, pfn + pages);
 	}
 
-	_setup_log("\n");
+// The window in "kernel-elf.lds" limits how much RAM we can describe.
+	if (page_db_count > max_count)
+	{
+		_setup_log("Warning: memory above %dM not used.\n", max_count >> (20 - PAGE_BITS));
+		page_db_count = max_count;
+	}
+
+	db_pages = PAGE_AFTER(page_db_count * sizeof(struct page));
+	page_db_phys = (struct page*)_setup_alloc_pages(db_pages);
+	_setup_map_pages((uint32)&_kernel_page_db_start, (uint32)page_db_phys, db_pages, PTE_KDATA);
+
+#if (DEBUG_SETUP_PAGING)
+	_setup_log("page_db: %d entries, %d pages at %p\n", page_db_count, db_pages, page_db_phys);
+#endif
 }
 
-static void	ATTR_SETUP_TEXT	_setup_build_free_page_list (const struct phys_multiboot_info *mbi)
+// Pages of physical memory mapped at _kernel_direct_map_start, from address zero.
+static uint32	ATTR_SETUP_DATA direct_map_pages = 0;
+
+// Maps physical memory 1:1 at _kernel_direct_map_start, as far as the window
+// (or RAM) goes.  All but the last partial 4M of it uses 4M pages, with PSE.  Must be called after _setup_alloc_page_db().
+static void	ATTR_SETUP_TEXT _setup_map_direct(void)
 {
-	const struct e820_memory_map	*e820 = (const struct e820_memory_map*) mbi->mmap_addr;
-	int                     e820_count = mbi->mmap_length / sizeof(struct e820_memory_map);
-	int			i = 0;
+	direct_map_pages = ((uint32)&_kernel_direct_map_end - (uint32)&_kernel_direct_map_start) >> PAGE_BITS;
+	direct_map_pages = min(direct_map_pages, page_db_count);
+
+	_setup_map_pages((uint32)&_kernel_direct_map_start, 0, direct_map_pages, PTE_KDATA);
 
 #if (DEBUG_SETUP_PAGING)
-	_setup_log("inside: _setup_build_free_page_list(mbi = %p)\n", mbi);
+	_setup_log("direct map: %d pages at %p\n", direct_map_pages, &_kernel_direct_map_start);
 #endif
+}
+
+// Places a free block of 2^order pages on its buddy free list.
+static void	ATTR_SETUP_TEXT	_setup_free_block(uint32 pfn, uint32 order)
+{
+	struct page		*pg = &pmm_pages[pfn];
+	struct pmm_zone		*zone = &pmm_zones[PFN_TO_ZONE(pfn)];
+	struct pmm_free_area	*area = &zone->free_area[order];
 
-	gp_next_free_4k_page = next_free_page_addr;
+	pg->flags = PG_BUDDY;
+	pg->order = order;
+	pg->prev = NULL;
+	pg->next = area->head;
 
-	for (i = 0; i < e820_count; i++, e820++)
+	if (area->head)
 	{
-		uint64 base_64 = *(uint64*)&(e820->base_addr_low);      // HACK ALERT!
-		uint64 len_64 = *(uint64*)&(e820->length_low);          // HACK ALERT!
+		area->head->prev = pg;
+	}
 
-		if (e820->type != E820_AVAIL) continue;
+	area->head = pg;
+	area->blocks++;
 
-// base and len should be page aligned...
-		if (base_64 & (PAGE_SIZE - 1))
-		{
-			// Round length down to next page and base up.
-			len_64 -= (base_64 & (PAGE_SIZE - 1));
-			base_64 = (base_64 & ~(PAGE_SIZE - 1)) + PAGE_SIZE;
-		}
+	zone->free_pages += 1 << order;
+	gp_total_free_4k_pages += 1 << order;
+}
 
-// If length is a partial page, truncate to end block at previous page.
-		if (len_64 & (PAGE_SIZE -1))
-		{
-			len_64 &= ~(PAGE_SIZE - 1);
-		}
+// Adds a range of free pages to the buddy allocator, as the largest
+// naturally aligned blocks that fit.  Only the page frame database is
+// written; the pages themselves are never touched.
+static void	ATTR_SETUP_TEXT	_setup_add_pages(uint32 pfn, uint32 pages)
+{
+	uint32	end = pfn + pages;
+	uint32	order = 0;
 
-// We can't handle any memory above 4G yet.
-		if (base_64 >= (1LL << 32))
-		{
-			_setup_log("Warning: memory above 4G not used.\n");
-			continue;
-		}
+// Skip anything that we already have loaded or allocated.
+	pfn = max(pfn, PAGE_OF(next_free_page_addr));
+	end = min(end, page_db_count);
 
-// If we start below 1M, and don't extend above it, skip it.  We won't allocate physical pages
-// from < 1M.
-		if (base_64 < 0x100000)
-		{
-			if (base_64 + len_64 > 0x100000)
-			{
-				_setup_log("Warning: memory spans 1M boundry.  Skipping.\n");
-			}
-			continue;
-		}
+// Frame numbers, as the address may not fit in 32 bits.
+	_setup_log("Adding memory at page %x, %d pages\n", pfn, (end > pfn) ? end - pfn : 0);
 
-// If base starts below 4G but spans across it, truncate it.
-		if ((base_64 + len_64) >= (1LL << 32))
+	while (pfn < end)
+	{
+		for (order = PMM_MAX_ORDER; order; order--)
 		{
-			_setup_log("Warning: memory above 4G not used.\n");
-			len_64 -= (base_64 & ~((1LL << 32) - 1));
+			if (!(pfn & ((1 << order) - 1)) && (pfn + (1 << order) <= end)) break;
 		}
 
-// _setup_log("phys_mem: %08x to %08x (%d K)\n", (uint32)base_64, (uint32)(base_64 + len_64), (uint32)(len_64 / 1024));
+		_setup_free_block(pfn, order);
+		pfn += 1 << order;
+	}
+}
 
-// Break memory chunk on 4M boundaries, and submit each chunk seperately.
-#if 0
-		_setup_log("e820(%d): start = %p, pages = %p\n", i, (uint32)base_64, (uint32)len_64 / PAGE_SIZE);
+// Builds the buddy free lists from the multiboot memory map.  Called
+// after paging is on, as the page frame database is only mapped high.
+static void	ATTR_SETUP_TEXT	_setup_build_free_page_list (const struct phys_multiboot_info *mbi)
+{
+	const struct e820_memory_map	*e820 = (const struct e820_memory_map*) mbi->mmap_addr;
+	int                     e820_count = mbi->mmap_length / sizeof(struct e820_memory_map);
+	int			i = 0;
+	uint32			pfn = 0;
+	uint32			pages = 0;
 
-		{
-			uint32 start = (uint32)base_64;
-			uint32 pages_left = (uint32)(len_64 / PAGE_SIZE);
-			uint32 pages_this = 0;
-			uint32 end = 0;
+#if (DEBUG_SETUP_PAGING)
+	_setup_log("inside: _setup_build_free_page_list(mbi = %p)\n", mbi);
+#endif
 
-			while (pages_left)
-			{
-// Round "start" up to next 4M bounary.
-				end = (start + (1 << 22)) & ~((1 << 22) - 1);
+	pmm_pages = (struct page*)&_kernel_page_db_start;
+	pmm_page_count = page_db_count;
+	pmm_zones[PMM_ZONE_HIGH].start_pfn = direct_map_pages;
 
-// How many pages can we do right now so that "start + pages_this" is on a 4M boundry?
-				pages_this = min((end - start) >> 12, pages_left);
+	for (i = 0; i < e820_count; i++, e820++)
+	{
+		if (!_setup_e820_usable(e820, &pfn, &pages)) continue;
 
-_setup_log("start = %p, end = %p, pages = %p, left = %p\n", start, end, pages_this, pages_left);
-//Halt();
-				_setup_add_pages(start, pages_this);
-				start += pages_this * PAGE_SIZE;
-				pages_left -= pages_this;
-			}
-		}
-#else
-		_setup_add_pages((uint32)base_64, (uint32)len_64 / PAGE_SIZE);
-#endif
+		_setup_add_pages(pfn, pages);
 	}
 
 #if (DEBUG_SETUP_PAGING)
-	_setup_log("gp_next_free_4k_page = %p\n", gp_next_free_4k_page);
 	_setup_log("gp_total_free_4k_pages = %d (%d K, %d M)\n", gp_total_free_4k_pages, gp_total_free_4k_pages * 4, gp_total_free_4k_pages /256);
 #endif
 }
@@ -368,12 +528,6 @@ static void	ATTR_SETUP_TEXT prealloc_page_table(const void *virtual)
 	int	pde_slot = ADDR_TO_PDE_SLOT(virtual);
 	void	*page = NULL;
 
-	if (!IS_PDIR_ALIGNED(virtual))
-	{
-		_setup_log("PANIC: alloc_page_table(%p) failed.  Not alligned to 4M page.\n", virtual);
-		Halt();
-	}
-
 	if (!kernel_pdir)
 	{
 		_setup_log("PANIC: alloc_page_table(%p) internal error.  kernel_pdir == NULL.\n", virtual);
@@ -385,13 +539,13 @@ static void	ATTR_SETUP_TEXT prealloc_page_table(const void *virtual)
 		page = _setup_alloc_pages(1);
 		kernel_pdir[pde_slot] = (uint32)page | PTE_KDATA;
 #if (DEBUG_SETUP_PAGING)
-		_setup_log("AFTER:  prealloc(%p) = [%x] %p\n", virtual, pde_slot, kernel_pdir[pde_slot]);
+		_setup_log("AFTER:  prealloc(%p) = [%x] %p\n", virtual, pde_slot, (uint32)kernel_pdir[pde_slot]);
 #endif
 	}
 	else
 	{
 #if (DEBUG_SETUP_PAGING)
-		_setup_log("BEFORE: prealloc(%p) = [%x] %p\n", virtual, pde_slot, kernel_pdir[pde_slot]);
+		_setup_log("BEFORE: prealloc(%p) = [%x] %p\n", virtual, pde_slot, (uint32)kernel_pdir[pde_slot]);
 #endif
 	}
 }
@@ -441,6 +595,10 @@ void	ATTR_SETUP_TEXT _setup_init_paging(const struct phys_multiboot_info *mbi)
 	uint32		modules_end = 0;
 	uint32		module_pages = 0;
 	struct phys_mb_module	*mod = NULL;
+	uint32		tsc_start = _setup_rdtsc();
+	uint32		tsc_page_db = 0;
+	uint32		tsc_paging = 0;
+	uint32		tsc_free_list = 0;
 
 // Compute physical address of first available physical memory page.
 	if (mbi->mods_count)
@@ -459,48 +617,62 @@ void	ATTR_SETUP_TEXT _setup_init_paging(const struct phys_multiboot_info *mbi)
 		mod = NULL;
 		modules_start = modules_end = module_pages = 0;
 
-		next_free_page_addr = (uint8*)(PAGE_AFTER(virt_to_phys(&_bss_end)) << PAGE_BITS);
+		next_free_page_addr = (uint8*)(PAGE_AFTER(_setup_virt_to_phys(&_bss_end)) << PAGE_BITS);
 		first_free_page_addr = next_free_page_addr;
 	}
 
 #if (DEBUG_SETUP_PAGING)
 	_setup_log(str_dump_sec, str_setup, &_setup_start, &_setup_end,
-		virt_to_phys(&_setup_start), virt_to_phys(&_setup_end));
+		_setup_virt_to_phys(&_setup_start), _setup_virt_to_phys(&_setup_end));
 
 	_setup_log(str_dump_sec, str_text, &_text_start, &_text_end,
-		virt_to_phys(&_text_start), virt_to_phys(&_text_end));
+		_setup_virt_to_phys(&_text_start), _setup_virt_to_phys(&_text_end));
 
 	_setup_log(str_dump_sec, str_data, &_data_start, &_data_end,
-		virt_to_phys(&_data_start), virt_to_phys(&_data_end));
+		_setup_virt_to_phys(&_data_start), _setup_virt_to_phys(&_data_end));
 
 	_setup_log(str_dump_sec, str_bss, &_bss_start, &_bss_end,
-		virt_to_phys(&_bss_start), virt_to_phys(&_bss_end));
+		_setup_virt_to_phys(&_bss_start), _setup_virt_to_phys(&_bss_end));
 
 	_setup_log(str_dump_sec, str_mods, modules_start, modules_end,
-		virt_to_phys((void*)modules_start), virt_to_phys((void*)modules_end));
+		_setup_virt_to_phys((void*)modules_start), _setup_virt_to_phys((void*)modules_end));
 #endif
 
-	kernel_pdir = (uint32*)_setup_alloc_pages(1);
+	_setup_enable_cpu_features();
+
+	kernel_pdir = (pte_t*)_setup_alloc_pages(PDIR_PAGES);
 #if (DEBUG_SETUP_PAGING)
 	_setup_log("kernel_page_dir = %p\n", kernel_pdir);
 #endif
 
-// Map the page directory to itself as if it were also a page table.
-// This makes all page dir entries appear as page tables at 0xfffff000.
-// See code at bottom of this function that sets "gp_kernel_page_dir".
-	pde_slot = ADDR_TO_PDE_SLOT((uint32)&_kernel_ptbl_start);
-	if (pde_slot != 1023)
+#if (VMM_USE_PAE)
+	kernel_pdpt = (uint64*)_setup_alloc_pages(1);
+
+	for (pde_slot = 0; pde_slot < PDIR_PAGES; pde_slot++)
+	{
+		kernel_pdpt[pde_slot] = ((uint32)kernel_pdir + (pde_slot << PAGE_BITS)) | PTE_PRESENT;
+	}
+#endif
+
+// Map the page directory to itself as if it were also a page table (or four
+// of them, with PAE).  This makes all page dir entries appear as page tables
+// at PTBL_WINDOW, and the page dir at the top of it.  See code at bottom of
+// this function that sets "gp_kernel_page_dir".
+	if ((uint32)&_kernel_ptbl_start > PTBL_WINDOW)
 	{
 		_setup_log("PANIC: kernel not configured for page dir virt addr: %p\n", &_kernel_ptbl_start);
 		Halt();
 	}
-	kernel_pdir[pde_slot] = (uint32)kernel_pdir | PTE_KDATA;
+
+	for (pde_slot = 0; pde_slot < PDIR_PAGES; pde_slot++)
+	{
+		kernel_pdir[PDE_COUNT - PDIR_PAGES + pde_slot] = ((uint32)kernel_pdir + (pde_slot << PAGE_BITS)) | PTE_KDATA;
+	}
 
 // Need a blank page table for a few things that won't get mapped until later.
 	prealloc_page_table(&_kernel_console_start);
 	prealloc_page_table(&_kernel_stack_start);
 	prealloc_page_table(&_kernel_temp_vpages_start);
-	prealloc_page_table(&_kernel_vmm_setup);
 
 // Map the .setup section (make it read/write, as it contains code + data).
 // Need to retain it mapped low.  We will still be executing out of it after loading
@@ -549,6 +721,12 @@ void	ATTR_SETUP_TEXT _setup_init_paging(const struct phys_multiboot_info *mbi)
 	physical = PAGE_SIZE;
 	_setup_map_pages(virtual, physical, pages, PTE_KDATA);
 
+// Allocate the page frame database while we can still map pages here.
+	tsc_page_db = _setup_rdtsc();
+	_setup_alloc_page_db(mbi);
+	_setup_map_direct();
+	tsc_paging = _setup_rdtsc();
+
 // we should not need this.  Page tables should be self-mapped via cr3[1023] = &pde[0];
 // Map any newly allocated pages (page tables mostly).
 //	pages = PAGE_AFTER(next_free_page_addr) - PAGE_OF(first_free_page_addr);
@@ -557,7 +735,11 @@ void	ATTR_SETUP_TEXT _setup_init_paging(const struct phys_multiboot_info *mbi)
 //	_setup_map_pages(virtual, physical, pages, PTE_KDATA);
 
 // Turn on paging.
+#if (VMM_USE_PAE)
+	_setup_log("setup: Enabling PAE paging, setting %%cr3 = %p\n", kernel_pdpt);
+#else
 	_setup_log("setup: Enabling paging, setting %%cr3 = %p\n", kernel_pdir);
+#endif
 
 	__asm__ __volatile__
 	(
@@ -567,7 +749,11 @@ void	ATTR_SETUP_TEXT _setup_init_paging(const struct phys_multiboot_info *mbi)
 		"orl	%1, %%eax\n"
 		"movl	%%eax, %%cr0\n"
 		: /* outputs */
+#if (VMM_USE_PAE)
+		: /* inputs */		"m" (kernel_pdpt), "i" (CR0_PG_MASK | CR0_WP_MASK)
+#else
 		: /* inputs */		"m" (kernel_pdir), "i" (CR0_PG_MASK | CR0_WP_MASK)
+#endif
 		: /* clobbers */	"%eax"
 	);
 
@@ -623,9 +809,9 @@ void	ATTR_SETUP_TEXT _setup_init_paging(const struct phys_multiboot_info *mbi)
 // gp_kernel_page_dir is the new VIRTUAL address of the kernel's page directory.
 // "kernel_pdir" (private to this source file) is ".setup"'s virtual and physical
 // address of the same (same as the value in %cr3".
-	gp_kernel_page_dir = (uint32*)((uint32)&_kernel_ptbl_start + 0x003ff000);
+	gp_kernel_page_dir = PTBL_VIRT(PDE_COUNT - PDIR_PAGES);
 
-	if (gp_kernel_page_dir != (uint32*)0xfffff000)
+	if ((uint32)gp_kernel_page_dir + PDIR_PAGES * PAGE_SIZE != 0)
 	{
 		// If we get here, then the linker file "kernel-elf.lds" has been modifed
 		// out of sync with this C code.
@@ -639,11 +825,11 @@ void	ATTR_SETUP_TEXT _setup_init_paging(const struct phys_multiboot_info *mbi)
 		int	pde;
 
 		_setup_log("Page directory entries initialized:\n");
-		for (pde = 0; pde < 1024; pde++)
+		for (pde = 0; pde < PDE_COUNT; pde++)
 		{
 			if (gp_kernel_page_dir[pde] & PTE_PRESENT)
 			{
-				_setup_log("\tpde: [%p] = %p\n", pde << (PTE_BITS + PAGE_BITS), gp_kernel_page_dir[pde] & PDIR_MASK);
+				_setup_log("\tpde: [%p] = %p\n", pde << (PTE_BITS + PAGE_BITS), (uint32)PDE_ADDR_4M(gp_kernel_page_dir[pde]));
 			}
 		}
 	}
@@ -661,17 +847,20 @@ void	ATTR_SETUP_TEXT _setup_init_paging(const struct phys_multiboot_info *mbi)
 	g_modules_start = modules_start;
 	g_module_pages = module_pages;
 
-// Using the Multi-boot memory map, add all of the available physical memory pages
-// into a linked list.  This involves temporarily mapping and unmapping all of the pages.
-	{
-		uint64 start = read_tsc();
+	g_direct_map_limit = direct_map_pages << PAGE_BITS;
+	g_pse_enabled = pse_enabled;
+	g_pge_enabled = pge_enabled;
+	g_nx_enabled = nx_enabled;
 
+// Using the Multi-boot memory map, add all of the available physical memory pages
+// to the buddy allocator.  Only the page frame database is written.
+	tsc_free_list = _setup_rdtsc();
 	_setup_build_free_page_list(mbi);
 
-		uint64 diff = read_tsc() - start;
-		// setup printf() can't do 64 bit args.
-		_setup_log("setup time = %p,%p\n", (uint32)(diff >> 32), (uint32)diff);
-	}
+// Boot phase timings, in TSC cycles (32 bits, as _setup_log() can't print 64).
+	_setup_log("setup: cycles: map kernel %d, page db + direct map %d, paging %d, free list %d\n",
+		tsc_page_db - tsc_start, tsc_paging - tsc_page_db,
+		tsc_free_list - tsc_paging, _setup_rdtsc() - tsc_free_list);
 
 	TRACE();
 }
@@ -0,0 +1,91 @@
+/*	kernel/test/t-heapbench.c
+
+	Measures kmalloc() latency as the heap fills up and fragments.
+	Enabled with "heapbench=1" on the kernel command line.
+
+	Each round adds BENCH_ROUND_LIVE blocks to a long lived set, frees
+	every other one (leaving holes of mixed sizes), then times
+	BENCH_SAMPLES allocations.  With a first-fit heap the average
+	grows with every round.  It should stay flat with size classes.
+*/
+
+#include "kernel/kernel.h"
+
+#define BENCH_ROUNDS		8
+#define BENCH_ROUND_LIVE	512
+#define BENCH_SAMPLES		128
+#define BENCH_MIN_SIZE		16
+#define BENCH_MAX_SIZE		1024
+
+static void	*bench_live[BENCH_ROUNDS * BENCH_ROUND_LIVE];
+static void	*bench_sample[BENCH_SAMPLES];
+static uint32	bench_seed = 12345;
+
+// Cheap LCG, good enough to spread sizes across classes.
+static uint32	bench_rand_size(void)
+{
+	bench_seed = bench_seed * 1103515245 + 12345;
+	return BENCH_MIN_SIZE + ((bench_seed >> 8) % (BENCH_MAX_SIZE - BENCH_MIN_SIZE));
+}
+
+void	bench_heap(void)
+{
+	uint32	round = 0;
+	uint32	live = 0;
+	uint32	i = 0;
+	uint32	start = 0;
+	uint32	cycles = 0;
+	uint32	total = 0;
+	uint32	worst = 0;
+
+	printf("heapbench: %d rounds, %d samples/round\n", BENCH_ROUNDS, BENCH_SAMPLES);
+
+	for (round = 0; round < BENCH_ROUNDS; round++)
+	{
+		for (i = 0; i < BENCH_ROUND_LIVE; i++)
+		{
+			bench_live[live + i] = kmalloc(bench_rand_size(), 0);
+		}
+
+		for (i = 1; i < BENCH_ROUND_LIVE; i += 2)
+		{
+			kfree(bench_live[live + i]);
+			bench_live[live + i] = NULL;
+		}
+
+		live += BENCH_ROUND_LIVE;
+		total = 0;
+		worst = 0;
+
+		for (i = 0; i < BENCH_SAMPLES; i++)
+		{
+			uint32	size = bench_rand_size();
+
+			start = (uint32)read_tsc();
+			bench_sample[i] = kmalloc(size, 0);
+			cycles = (uint32)read_tsc() - start;
+
+			total += cycles;
+			worst = max(worst, cycles);
+		}
+
+		for (i = 0; i < BENCH_SAMPLES; i++)
+		{
+			kfree(bench_sample[i]);
+		}
+
+		printf("heapbench: round %d, live blocks %5d, avg %6u cycles, worst %8u\n",
+			round, live / 2, total / BENCH_SAMPLES, worst);
+		kdebug(DEBUG_INFO, FAC_HEAP, "heapbench: round %d, live blocks %d, avg %u cycles, worst %u\n",
+			round, live / 2, total / BENCH_SAMPLES, worst);
+	}
+
+	for (i = 0; i < live; i++)
+	{
+		if (bench_live[i])
+		{
+			kfree(bench_live[i]);
+			bench_live[i] = NULL;
+		}
+	}
+}
@@ -0,0 +1,69 @@
+/*	kernel/test/t-region.c
+
+	Routines to test the region (bump) allocator.
+*/
+
+#include "kernel/kernel.h"
+
+// Allocations are aligned and packed, and a stack buffer is used before the heap.
+void	test_region_1 (void)
+{
+	struct region	r;
+	uint8	buf[64];
+	uint8	*a = NULL;
+	uint8	*b = NULL;
+
+	region_init_buf (&r, buf, sizeof(buf), 128, 0);
+
+	a = region_alloc (&r, 3);
+	b = region_alloc (&r, 8);
+
+	ASSERT ((uint32)a % HEAP_ALLOC_GRANULARITY == 0);
+	ASSERT (b == a + HEAP_ALLOC_GRANULARITY);
+	ASSERT ((a >= buf) && (b + 8 <= buf + sizeof(buf)));
+
+// Too big for what is left of 'buf', so it comes from a new chunk.
+	a = region_alloc (&r, 100);
+	ASSERT ((a < buf) || (a >= buf + sizeof(buf)));
+
+	region_free (&r);
+	ASSERT (r.chunk && (r.chunk->used == 0) && !r.chunk->next);
+}
+
+// Rollback frees the chunks added since the mark, and rewinds the marked one.
+void	test_region_2 (void)
+{
+	struct region	r;
+	struct region_mark	m;
+	char	*s = NULL;
+	char	*t = NULL;
+	int	i;
+
+	region_init (&r, 64, 0);
+
+	s = region_strdup (&r, "keep");
+	region_mark (&r, &m);
+
+	for (i = 0; i < 20; i++)
+	{
+		region_strndup (&r, "scratch scratch", 7);
+	}
+
+	ASSERT (r.chunk != m.chunk);
+
+	region_rollback (&r, &m);
+	ASSERT (r.chunk == m.chunk);
+
+	t = region_strdup (&r, "next");
+	ASSERT (!strcmp (s, "keep"));
+	ASSERT (t == s + ROUND_UP(5, HEAP_ALLOC_GRANULARITY));
+
+	region_free (&r);
+	ASSERT (!r.chunk);
+}
+
+void	test_region (void)
+{
+	test_region_1 ();
+	test_region_2 ();
+}
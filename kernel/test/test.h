@@ -1,3 +1,7 @@
 //	kernel/test/test.h
 
 void	test_snprintf (void);
+
+void	bench_heap (void);
+
+void	test_region (void);
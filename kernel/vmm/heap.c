@@ -4,10 +4,51 @@
 	Physical pages are not pre-allocated. They are allocated in
 	chunks during page not-found page faults.
 
-	Uses the horrible "first fit" placement method.
-
-	This heap is designed as a place holder.  Hopefully it will be
-	rewritten someday.
+	Every block starts with a boundary tag (struct block_t) holding its
+	size and BLOCK_FREE / BLOCK_PREV_FREE flags.  Free blocks also end
+	with a footer (their size), so a block being freed can find both of
+	its physical neighbours and coalesce in constant time.
+
+	Free blocks are kept in segregated size-class bins.  Each power of
+	two is split into HEAP_SL_COUNT sub-classes, and a two level bitmap
+	records which bins are non-empty, so finding a block that fits is
+	two bit scans instead of a list walk.
+
+	When HEAP_ALLOC_LIST is set, allocated blocks are also linked into
+	"alloc_list", purely as a debugging aid.  With HEAP_TRACK, live
+	bytes are also totalled per call site in "heap_sites" (see
+	HEAP_PROFILE_SITES), which the core-debugger can report on.  Each
+	arena has its own site table, kept under the arena's lock, so
+	tracking doesn't serialize allocations from different arenas.
+
+	The heap's virtual range is split into arenas (HEAP_ARENA_xxx), one
+	per subsystem, each with its own bins, lock and usage counters, so
+	long lived objects from one subsystem aren't interleaved with
+	another's short lived ones.  kmalloc() picks the arena from its
+	flags (HEAP_VFS, etc).  Every arena but "general" is HEAP_ARENA_SIZE
+	bytes, and spills over into "general" when it fills up.
+
+	Requests over VMALLOC_THRESHOLD bytes are passed on to vmalloc().
+
+	Pages are mapped by heap_grow() (on a fault), or ahead of time by
+	heap_prefault().  heap_trim() gives them back: it unmaps the whole
+	pages inside large free blocks (never the header, or footer).  If a
+	block is reused later, its pages simply fault back in.
+
+	heap_prefault() keeps HEAP_PREFAULT_PAGES mapped past each arena's
+	high-water mark (the end of the highest block ever handed out), so
+	allocations that push an arena upwards don't take a page fault while
+	holding its lock.  It is called from "[vmmd]", not from kmalloc().
+	heap_trim() leaves everything above the high-water mark alone.
+
+	kfree() from an IRQ handler does not take any locks.  The block is
+	pushed onto "heap_deferred" (a LIFO, linked through the first word
+	of each block's data) with lock cmpxchg, and really freed by the
+	next kmalloc() or kfree() outside of an IRQ, or by "[vmmd]".
+
+	Filling and rear-guarding every block (HEAP_CHECK_ALL) is off by
+	default.  Instead, a sample of allocations is sent to guard-page
+	slots (see heap_guard.c), which catch over-runs when they happen.
 */
 
 #include "kernel/kernel.h"
@@ -18,45 +59,648 @@
 static void *heap_start = (void*)&_kernel_heap_start;
 static void *heap_end = (void*)&_kernel_heap_end;
 
-static struct block_t	*free_list = NULL;
+#if (HEAP_ALLOC_LIST)
 static struct block_t	*alloc_list = NULL;
+#endif
+
+// Highest address that heap_grow() has mapped.  heap_trim() does not look above it.
+static void	*heap_top = NULL;
+
+uint32		heap_mapped_pages = 0;
+uint32		heap_trimmed_pages = 0;
+uint32		heap_prefaulted_pages = 0;
+uint32		heap_promoted_4m = 0;
+
+// Next 4M range that heap_promote() will look at.
+static void	*heap_promote_next = NULL;
+
+// Timer tick of the last promotion that was allowed to copy (see heap_promote()).
+static uint32	heap_promote_copy_tick = 0;
 
-static spinlock		heap_lock = INIT_SPINLOCK("heap");
+// Serializes heap_grow() and heap_prefault(), which both map pages
+// without holding an arena lock.
+static spinlock		heap_map_lock = INIT_SPINLOCK("heap_map");
+
+// Blocks kfree()d at interrupt time, waiting for heap_drain_deferred().
+static void * volatile	heap_deferred = NULL;
+
+#if (HEAP_ALLOC_LIST)
+// Protects alloc_list, which is shared by all arenas.
+static spinlock		heap_debug_lock = INIT_SPINLOCK("heap_debug");
+#endif
 
 #if (HEAP_TRACK)
-static uint32		alloc_seq_id = 0;
+// Shared by all arenas, so it is bumped with lock cmpxchg rather than under a lock.
+static volatile uint32	alloc_seq_id = 0;
+#endif
+
+#define HEAP_PROFILE	(HEAP_TRACK && HEAP_PROFILE_SITES)
+
+#if (HEAP_PROFILE)
+// One open addressed hash table per arena, keyed by file + line, and
+// protected by the arena's lock.  Entries are never removed.
+static struct heap_site	heap_sites[HEAP_ARENA_COUNT][HEAP_PROFILE_SITES];
 #endif
 
 #define MIN_BLOCK_SIZE	(sizeof(struct block_t) + sizeof(uint32))
 
+// Size classes.  First level is the power of two (bit index of the size),
+// second level splits each power of two into HEAP_SL_COUNT linear steps.
+#define HEAP_SL_BITS	2
+#define HEAP_SL_COUNT	(1 << HEAP_SL_BITS)
+#define HEAP_FL_COUNT	32
+
+struct heap_arena
+{
+	const char	*name;
+	void		*start;		// First block.
+	void		*end;
+	void		*hwm;		// End of the highest block ever allocated here.  Only goes up.
+	void		*prefault_top;	// heap_prefault() has mapped from 'hwm' up to here.
+	spinlock	lock;
+
+	uint32		fl_bitmap;
+	uint32		sl_bitmap[HEAP_FL_COUNT];
+	struct block_t	*bins[HEAP_FL_COUNT][HEAP_SL_COUNT];
+
+// Live allocated blocks (bytes include headers), and allocations since boot.
+	uint32		alloc_blocks;
+	uint32		alloc_bytes;
+	uint32		total_allocs;
+	uint32		spills;		// Allocations that went to "general" because this arena was full.
+};
+
+// Indexed by HEAP_ARENA_xxx.  Laid out in this order, back to back, from heap_start.
+static struct heap_arena	heap_arenas[HEAP_ARENA_COUNT] =
+{
+	{ .name = "general" },
+	{ .name = "objects" },
+	{ .name = "vfs" },
+	{ .name = "tasks" },
+	{ .name = "drivers" },
+};
+
+// Returns the arena that 'ptr' belongs to.  'ptr' must be in the heap's range.
+static inline struct heap_arena*	ptr_to_arena(const void *ptr)
+{
+	struct heap_arena	*a = &heap_arenas[HEAP_ARENA_COUNT - 1];
+
+	for (; ptr < a->start; a--);
+
+	return a;
+}
+
+// Converts a block size into its (fl, sl) size class, rounding down.
+// Used when filing a free block.
+static inline void	size_to_class(uint32 size, uint32 *fl, uint32 *sl)
+{
+	*fl = bit_scan_reverse(size);
+	*sl = (size >> (*fl - HEAP_SL_BITS)) & (HEAP_SL_COUNT - 1);
+}
+
+// Converts a request size into the first size class whose blocks are all
+// big enough to hold it (ie, rounds up to the next class boundary).
+static inline void	size_to_search_class(uint32 size, uint32 *fl, uint32 *sl)
+{
+	uint32	fl_tmp = bit_scan_reverse(size);
+
+	size += (1 << (fl_tmp - HEAP_SL_BITS)) - 1;
+	size_to_class(size, fl, sl);
+}
+
+static void	bin_insert(struct heap_arena *a, struct block_t *block)
+{
+	uint32	fl, sl;
+
+	size_to_class(BLOCK_SIZE(block), &fl, &sl);
+
+	block->prev = NULL;
+	block->next = a->bins[fl][sl];
+
+	if (block->next)
+	{
+		block->next->prev = block;
+	}
+
+	a->bins[fl][sl] = block;
+	a->sl_bitmap[fl] |= (1 << sl);
+	a->fl_bitmap |= (1 << fl);
+}
+
+static void	bin_remove(struct heap_arena *a, struct block_t *block)
+{
+	uint32	fl, sl;
+
+	size_to_class(BLOCK_SIZE(block), &fl, &sl);
+
+	if (block->prev)
+	{
+		block->prev->next = block->next;
+	}
+	else
+	{
+		ASSERT(a->bins[fl][sl] == block);
+		a->bins[fl][sl] = block->next;
+	}
+
+	if (block->next)
+	{
+		block->next->prev = block->prev;
+	}
+
+	if (!a->bins[fl][sl])
+	{
+		a->sl_bitmap[fl] &= ~(1 << sl);
+
+		if (!a->sl_bitmap[fl])
+		{
+			a->fl_bitmap &= ~(1 << fl);
+		}
+	}
+
+	block->next = block->prev = NULL;
+}
+
+// Returns a free block with at least 'size' bytes, or NULL.  Does not unlink it.
+static struct block_t*	bin_find(struct heap_arena *a, uint32 size)
+{
+	uint32	fl, sl;
+	uint32	sl_map, fl_map;
+
+	size_to_search_class(size, &fl, &sl);
+
+	if (fl >= HEAP_FL_COUNT)
+	{
+		return NULL;
+	}
+
+	sl_map = a->sl_bitmap[fl] & (~0UL << sl);
+
+	if (!sl_map)
+	{
+		fl_map = (fl + 1 < HEAP_FL_COUNT) ? a->fl_bitmap & (~0UL << (fl + 1)) : 0;
+
+		if (!fl_map)
+		{
+			return NULL;
+		}
+
+		fl = bit_scan_forward(fl_map);
+		sl_map = a->sl_bitmap[fl];
+	}
+
+	sl = bit_scan_forward(sl_map);
+
+	return a->bins[fl][sl];
+}
+
+// Returns the block physically after 'block', or NULL if 'block' is the last one in arena 'a'.
+static inline struct block_t*	block_after(const struct heap_arena *a, const struct block_t *block)
+{
+	void	*next = (uint8*)block + BLOCK_SIZE(block);
+
+	return (next < a->end) ? (struct block_t*)next : NULL;
+}
+
+// Returns the (free) block physically before 'block'.  Only valid if BLOCK_PREV_FREE is set.
+static inline struct block_t*	block_before(const struct block_t *block)
+{
+	ASSERT(block->size & BLOCK_PREV_FREE);
+	return (struct block_t*)((uint8*)block - *((uint32*)block - 1));
+}
+
+// Marks 'block' as free with the given size, writes its footer, and tells the block after it.
+static inline void	block_set_free(struct heap_arena *a, struct block_t *block, uint32 size)
+{
+	struct block_t	*next = NULL;
+
+	block->size = size | BLOCK_FREE;
+
+	if (NULL != (next = block_after(a, block)))
+	{
+		*block_footer_ptr(block) = size;
+		next->size |= BLOCK_PREV_FREE;
+	}
+}
+
 // Given a block pointer, return the rear_guard pointer.
 // The rear-gaurd is HEAP_ALLOC_GRANULARITY bytes large, but
 // is always a multiple of sizeof(uint32) (ie, 4).
 static inline uint32*	rear_guard_ptr(const struct block_t *block)
 {
-	return (uint32*)((uint8*)block + block->size - HEAP_ALLOC_GRANULARITY);
+	return (uint32*)((uint8*)block + BLOCK_SIZE(block) - HEAP_ALLOC_GRANULARITY);
 }
 
-void	walk_list(struct block_t *hdr, const char *name)
+#if (HEAP_ALLOC_LIST)
+static inline void	alloc_list_add(struct block_t *block)
 {
-	int	i = 0;
+	block->prev = NULL;
+	block->next = alloc_list;
+
+	if (alloc_list)
+	{
+		alloc_list->prev = block;
+	}
+
+	alloc_list = block;
+}
+
+static inline void	alloc_list_del(struct block_t *block)
+{
+	if (block->prev)
+	{
+		block->prev->next = block->next;
+	}
+	else
+	{
+		ASSERT(alloc_list == block);
+		alloc_list = block->next;
+	}
+
+	if (block->next)
+	{
+		block->next->prev = block->prev;
+	}
+
+	block->next = block->prev = NULL;
+}
+#endif
+
+#if (HEAP_TRACK)
+static inline uint32	heap_next_seq_id(void)
+{
+	uint32	id = 0;
+
+	do
+	{
+		id = alloc_seq_id;
+	} while (atomic_cmpxchg(&alloc_seq_id, id, id + 1) != id);
+
+	return id;
+}
+#endif
+
+#if (HEAP_PROFILE)
+// Returns arena 'a's table entry for call site 'file':'line', or NULL.  If 'func'
+// is not NULL, a new entry is made for it.  Caller holds a->lock.
+static struct heap_site*	heap_site_find(struct heap_arena *a, const char *file, int line, const char *func)
+{
+	uint32	i = (((uint32)file >> 2) ^ ((uint32)line * 0x9e3779b1)) & (HEAP_PROFILE_SITES - 1);
+	uint32	probes = 0;
+	struct heap_site	*site = NULL;
+
+	for (; probes < HEAP_PROFILE_SITES; probes++, i = (i + 1) & (HEAP_PROFILE_SITES - 1))
+	{
+		site = &heap_sites[a - heap_arenas][i];
+
+		if ((site->file == file) && (site->line == line))
+		{
+			return site;
+		}
+
+		if (!site->file)
+		{
+			break;
+		}
+	}
+
+// Not there, or the table is full (then the site just isn't counted).
+	if (!func || (probes == HEAP_PROFILE_SITES))
+	{
+		return NULL;
+	}
+
+	site->file = file;
+	site->line = line;
+	site->func = func;
+
+	return site;
+}
+
+// Adds (or with 'count' of -1, removes) a block of 'bytes' to its call site's totals
+// in arena 'a'.  Caller holds a->lock.
+static void	heap_site_account(struct heap_arena *a, const char *file, int line, const char *func, uint32 bytes, int count)
+{
+	struct heap_site	*site = heap_site_find(a, file, line, func);
+
+	if (!site)
+	{
+		return;
+	}
+
+	if (count > 0)
+	{
+		site->live_bytes += bytes;
+		site->live_count++;
+		site->total_allocs++;
+		site->peak_bytes = max(site->peak_bytes, site->live_bytes);
+	}
+	else
+	{
+		site->live_bytes -= bytes;
+		site->live_count--;
+	}
+}
+#endif
+
+// Walks arena 'a' in address order and counts free and allocated blocks.
+// Panics if the boundary tags are inconsistent.
+static void	heap_walk_arena(struct heap_arena *a, uint32 *free_count, uint32 *alloc_count)
+{
+	struct block_t	*block = (struct block_t*)a->start;
+	int		prev_free = 0;
 
-	for (i = 0; hdr && (i < 5); hdr = hdr->next, i++)
+	spinlock_acquire(&a->lock);
+
+	for (; block; block = block_after(a, block))
 	{
-		kdebug (DEBUG_INFO, FAC_HEAP, "heap_dump: %5s: hdr=%p: size=%p, next=%p, prev=%p\n", name, hdr, hdr->size, hdr->next, hdr->prev);
+		if (!BLOCK_SIZE(block) || (BLOCK_SIZE(block) % HEAP_ALLOC_GRANULARITY))
+		{
+			PANIC3("heap_walk: block %p has bad size %08x\n", block, block->size);
+		}
 
-		if (hdr == hdr->next)
+		if (prev_free != !!(block->size & BLOCK_PREV_FREE))
 		{
-			kdebug(DEBUG_FATAL, FAC_HEAP, "heap_dump: ERROR!  hdr = hdr->next\n");
-			Halt();
+			PANIC2("heap_walk: block %p has wrong BLOCK_PREV_FREE\n", block);
 		}
+
+		if (block->size & BLOCK_FREE)
+		{
+			if (prev_free)
+			{
+				PANIC2("heap_walk: block %p was not coalesced\n", block);
+			}
+
+			(*free_count)++;
+		}
+		else
+		{
+			(*alloc_count)++;
+		}
+
+		prev_free = !!(block->size & BLOCK_FREE);
+	}
+
+	spinlock_release(&a->lock);
+}
+
+void	heap_walk(uint32 *free_count, uint32 *alloc_count)
+{
+	int	i;
+
+	*free_count = *alloc_count = 0;
+
+	for (i = 0; i < HEAP_ARENA_COUNT; i++)
+	{
+		heap_walk_arena(&heap_arenas[i], free_count, alloc_count);
 	}
 }
 
 void	heap_dump(void)
 {
-	walk_list(free_list, "free");
-	walk_list(alloc_list, "alloc");
+	struct heap_arena	*a = NULL;
+	struct block_t	*block = NULL;
+	int		i = 0;
+
+	for (a = heap_arenas; a < heap_arenas + HEAP_ARENA_COUNT; a++)
+	{
+		kdebug (DEBUG_INFO, FAC_HEAP, "heap_dump: arena %s: %p - %p\n", a->name, a->start, a->end);
+
+		for (block = (struct block_t*)a->start, i = 0; block && (i < 10); block = block_after(a, block), i++)
+		{
+			kdebug (DEBUG_INFO, FAC_HEAP, "heap_dump: %5s: hdr=%p: size=%p, next=%p, prev=%p\n",
+				(block->size & BLOCK_FREE) ? "free" : "alloc", block, block->size, block->next, block->prev);
+		}
+	}
+}
+
+void	heap_arena_get_stats(uint32 arena, struct heap_arena_stats *stats)
+{
+	struct heap_arena	*a = &heap_arenas[arena];
+	struct block_t	*block = NULL;
+	int	fl, sl;
+
+	ASSERT(arena < HEAP_ARENA_COUNT);
+
+	spinlock_acquire(&a->lock);
+
+	stats->name = a->name;
+	stats->region_bytes = (uint32)a->end - (uint32)a->start;
+	stats->hwm_bytes = (uint32)a->hwm - (uint32)a->start;
+	stats->alloc_blocks = a->alloc_blocks;
+	stats->alloc_bytes = a->alloc_bytes;
+	stats->total_allocs = a->total_allocs;
+	stats->spills = a->spills;
+	stats->free_blocks = 0;
+
+	for (fl = 0; fl < HEAP_FL_COUNT; fl++)
+	{
+		for (sl = 0; sl < HEAP_SL_COUNT; sl++)
+		{
+			for (block = a->bins[fl][sl]; block; block = block->next)
+			{
+				stats->free_blocks++;
+			}
+		}
+	}
+
+	spinlock_release(&a->lock);
+}
+
+void	heap_get_stats(struct heap_stats *stats)
+{
+	struct heap_arena_stats	as;
+	int	i;
+
+	memset(stats, 0, sizeof(*stats));
+
+	for (i = 0; i < HEAP_ARENA_COUNT; i++)
+	{
+		heap_arena_get_stats(i, &as);
+		stats->alloc_blocks += as.alloc_blocks;
+		stats->alloc_bytes += as.alloc_bytes;
+		stats->total_allocs += as.total_allocs;
+		stats->free_blocks += as.free_blocks;
+	}
+
+	stats->mapped_pages = heap_mapped_pages;
+	stats->trimmed_pages = heap_trimmed_pages;
+	stats->prefaulted_pages = heap_prefaulted_pages;
+	stats->promoted_4m = heap_promoted_4m;
+}
+
+// Unmaps up to 'max_pages' of the whole pages inside free block 'block' of arena 'a'.
+// Returns # of pages released.  Caller holds a->lock.
+static uint32	heap_trim_block(struct heap_arena *a, struct block_t *block, uint32 max_pages)
+{
+	uint32	lo = ROUND_UP((uint32)block + sizeof(struct block_t), PAGE_SIZE);
+	uint32	hi = block_after(a, block) ? PAGE_BASE(block_footer_ptr(block)) : (uint32)a->end;
+	uint32	count = 0;
+	paddr_t	phys = 0;
+
+	hi = min(hi, (uint32)heap_top);
+	hi = min(hi, PAGE_BASE(a->hwm));	// The prefault reserve.
+
+	for (; (lo < hi) && (count < max_pages); lo += PAGE_SIZE)
+	{
+// Trimming runs when memory is short, so a promoted range that can't get a
+// page table back is skipped rather than panicking.
+		if (!vmm_demote_4m((void*)lo))
+		{
+			lo = ROUND_UP(lo + 1, PDIR_SIZE) - PAGE_SIZE;
+			continue;
+		}
+
+		if (0 != (phys = vmm_lookup_phys((void*)lo)))
+		{
+			vmm_unmap_pages((void*)lo, 1);
+			pmm_free_page(PHYS_TO_PFN(phys));
+			count++;
+		}
+	}
+
+	return count;
+}
+
+// Trims arena 'a'.  Returns # of pages released.
+static uint32	heap_trim_arena(struct heap_arena *a, uint32 max_pages)
+{
+	struct block_t	*block = NULL;
+	uint32	count = 0;
+	int	fl, sl;
+
+	spinlock_acquire(&a->lock);
+
+// Biggest blocks first.  Anything under two pages can't hold a whole page past its header.
+	for (fl = HEAP_FL_COUNT - 1; (fl > PAGE_BITS) && (count < max_pages); fl--)
+	{
+		for (sl = HEAP_SL_COUNT - 1; sl >= 0; sl--)
+		{
+			for (block = a->bins[fl][sl]; block && (count < max_pages); block = block->next)
+			{
+				count += heap_trim_block(a, block, max_pages - count);
+			}
+		}
+	}
+
+	spinlock_release(&a->lock);
+
+	return count;
+}
+
+uint32	heap_trim(uint32 max_pages)
+{
+	uint32	count = 0;
+	int	i;
+
+	for (i = 0; (i < HEAP_ARENA_COUNT) && (count < max_pages); i++)
+	{
+		count += heap_trim_arena(&heap_arenas[i], max_pages - count);
+	}
+
+	spinlock_acquire(&heap_map_lock);
+	heap_mapped_pages -= count;
+	heap_trimmed_pages += count;
+	spinlock_release(&heap_map_lock);
+
+	if (count)
+	{
+		kdebug(DEBUG_INFO, FAC_HEAP, "heap: trimmed %d pages, %d still mapped.\n", count, heap_mapped_pages);
+	}
+
+	return count;
+}
+
+// Looks at the next 4M range of the heap, round robin, and maps it with a
+// 4M page if it is inside one arena, below its high-water mark, and fully
+// populated.  Returns 1 if the range was promoted.
+//
+// The arena lock does NOT keep writers off the range: owners write to their
+// blocks without it.  The copy in vmm_promote_4m() is only safe because
+// spinlock_acquire() disables interrupts, and this kernel is uniprocessor,
+// so nothing else runs until it is done.  A copy is 1024 pages (4M) with
+// interrupts off, so copying promotions are limited to one every
+// HEAP_PROMOTE_COPY_TICKS.  Ranges whose frames are already one aligned
+// block are remapped in place, which is cheap, and are not limited.
+uint32	heap_promote(void)
+{
+	struct heap_arena	*a = NULL;
+	void	*range = heap_promote_next;
+	uint32	count = 0;
+	uint32	now = 0;
+	int	may_copy = 0;
+
+	if (!g_pse_enabled)
+	{
+		return 0;
+	}
+
+	if ((range < heap_start) || ((uint8*)range + PDIR_SIZE > (uint8*)heap_top))
+	{
+		range = (void*)ROUND_UP((uint32)heap_start, PDIR_SIZE);
+	}
+
+	heap_promote_next = (uint8*)range + PDIR_SIZE;
+
+	if ((uint8*)range + PDIR_SIZE > (uint8*)heap_top)
+	{
+		return 0;
+	}
+
+	a = ptr_to_arena(range);
+	now = timer_getcount();
+	may_copy = (now - heap_promote_copy_tick >= HEAP_PROMOTE_COPY_TICKS);
+
+	spinlock_acquire(&a->lock);
+
+	if ((uint8*)range + PDIR_SIZE <= (uint8*)PAGE_BASE(a->hwm))
+	{
+		spinlock_acquire(&heap_map_lock);
+		count = vmm_promote_4m(range, may_copy);
+		heap_promoted_4m += (count != 0);
+		spinlock_release(&heap_map_lock);
+	}
+
+	spinlock_release(&a->lock);
+
+	if (count == 2)
+	{
+		heap_promote_copy_tick = now;
+	}
+
+	return (count != 0);
+}
+
+// Pushes 'ptr' onto heap_deferred, without taking any lock.  For kfree() in IRQ handlers.
+static void	heap_defer_free(void *ptr)
+{
+	void	*head = NULL;
+
+	do
+	{
+		head = heap_deferred;
+		*(void**)ptr = head;
+	} while (atomic_cmpxchg((volatile uint32*)&heap_deferred, (uint32)head, (uint32)ptr) != (uint32)head);
+}
+
+// Frees everything that IRQ handlers have kfree()d.  Not for use in an IRQ handler.
+void	heap_drain_deferred(void)
+{
+	void	*ptr = NULL;
+	void	*next = NULL;
+
+	if (!heap_deferred)
+	{
+		return;
+	}
+
+	ASSERT(!in_irq());
+
+	for (ptr = (void*)atomic_xchg((volatile uint32*)&heap_deferred, 0); ptr; ptr = next)
+	{
+		next = *(void**)ptr;
+		kfree(ptr);
+	}
 }
 
 #if (HEAP_TRACK)
@@ -65,13 +709,45 @@ void	*__kmalloc(uint32 bytes, uint32 flags, const char *file, int line, const ch
 void	*__kmalloc(uint32 bytes, uint32 flags)
 #endif
 {
+	struct heap_arena *a = NULL;	// Arena we allocate from.
 	struct block_t *block = NULL;	// The block that we allocate (with header + footer).
 	struct block_t *next = NULL;	// Block after ours, if we split a larger free-block.
 	void *result = NULL;		// What we return to the caller.
-	uint32	*rear_guard = NULL;	// Where we put our guard magic value (to detect over-runs).
 	uint32	req_bytes = 0;		// How many bytes for user + rear guard.
 	uint32	total_bytes = 0;	// How much we need to carve out of free-space.
+	uint32	block_bytes = 0;	// Size of the free block we found.
+#if (HEAP_CHECK_ALL)
+	uint32	*rear_guard = NULL;	// Where we put our guard magic value (to detect over-runs).
 	int	i = 0;			// Generic loop variable.
+#endif
+
+	if (heap_deferred && !in_irq())
+	{
+		heap_drain_deferred();
+	}
+
+// Is this one sampled for a guard-page slot?
+	if (heap_guard_rate)
+	{
+#if (HEAP_TRACK)
+		result = heap_guard_alloc(bytes, file, line, func);
+#else
+		result = heap_guard_alloc(bytes);
+#endif
+		if (result)
+		{
+			return result;
+		}
+	}
+
+// Big requests get their own pages, so they don't fragment the heap.
+	if (bytes > VMALLOC_THRESHOLD)
+	{
+		if (NULL != (result = vmalloc(bytes, flags | HEAP_FAILOK)))
+		{
+			return result;
+		}
+	}
 
 T();	req_bytes = ROUND_UP(bytes, HEAP_ALLOC_GRANULARITY);
 
@@ -83,26 +759,40 @@ T();	req_bytes = ROUND_UP(bytes, HEAP_ALLOC_GRANULARITY);
 	con_set_attr(attr); }
 #endif
 
-T();	spinlock_acquire(&heap_lock);
-
-// Walk free list looking for block big enough.
-T();	if (free_list)
+	if (HEAP_ARENA_OF(flags) >= HEAP_ARENA_COUNT)
 	{
-		for (block = free_list; block->next && (total_bytes > block->size); block = block->next);
+		PANIC3("heap: malloc(%d) bad arena in flags %p.\n", bytes, flags);
 	}
 
+	a = &heap_arenas[HEAP_ARENA_OF(flags)];
+
+retry:
+T();	spinlock_acquire(&a->lock);
+
+// Find the smallest size class with a block that fits.
+T();	block = bin_find(a, total_bytes);
+
 T();	if ((uint32)block % HEAP_ALLOC_GRANULARITY)
 	{
 		kdebug(DEBUG_DEBUG, FAC_HEAP, "heap: block(%p) is not properly aligned.\n", block);
 		ASSERT((uint32)block % HEAP_ALLOC_GRANULARITY == 0);
 	}
 
+// Arena full?  Spill over into the general arena.
+	if (!block && (a != &heap_arenas[HEAP_ARENA_GENERAL]))
+	{
+		a->spills++;
+		spinlock_release(&a->lock);
+		a = &heap_arenas[HEAP_ARENA_GENERAL];
+		goto retry;
+	}
+
 // Are we out of heap space?
 T();	if (!block)
 	{
 T();		if (flags & HEAP_FAILOK)
 		{
-T();			spinlock_release(&heap_lock);
+T();			spinlock_release(&a->lock);
 			kdebug(DEBUG_WARN, FAC_HEAP, "heap: malloc(%d) failed.  Returning NULL\n", bytes);
 			return NULL;
 		}
@@ -110,146 +800,108 @@ T();			spinlock_release(&heap_lock);
 		PANIC2("heap: malloc(%d) failed.", bytes);
 	}
 
-// Did we find a block bigger than what we needed?  If so, split it.
-T();	if (block->size > total_bytes)
-	{
-#if (DEBUG_HEAP)
-		kdebug(DEBUG_DEBUG, FAC_HEAP, "heap: found block of %d at %p for request of %d bytes\n", block->size, block, total_bytes);
-#endif
+	block_bytes = BLOCK_SIZE(block);
+	ASSERT(block->size & BLOCK_FREE);
+	ASSERT(!(block->size & BLOCK_PREV_FREE));	// Free blocks are always coalesced.
+	ASSERT(block_bytes >= total_bytes);
+	bin_remove(a, block);
 
+// Did we find a block bigger than what we needed?  If so, split it.
 // Do we have enough space left over for future allocation?
-T();		if (block->size - total_bytes > MIN_BLOCK_SIZE)
-		{
+T();	if (block_bytes - total_bytes > MIN_BLOCK_SIZE)
+	{
 #if (DEBUG_HEAP)
-			kdebug(DEBUG_DEBUG, FAC_HEAP, "Splitting block %p for %d bytes\n", block, total_bytes);
+		kdebug(DEBUG_DEBUG, FAC_HEAP, "Splitting block %p (%d) for %d bytes\n", block, block_bytes, total_bytes);
 #endif
 
-T();			next = (struct block_t*)((uint8*)block + total_bytes);
-			next->size = block->size - total_bytes;
-			next->next = block->next;
-			next->prev = block->prev;
-			next->guard = MALLOC_GUARD_MAGIC;
+T();		block->size = total_bytes;
 
-			block->next = next;
-			block->size = total_bytes;
-		}
+		next = (struct block_t*)((uint8*)block + total_bytes);
+		next->guard = MALLOC_GUARD_MAGIC;
+		block_set_free(a, next, block_bytes - total_bytes);
+		bin_insert(a, next);
 	}
-
-// At this point we know that we are operating on "block".  We've already split (if possible) a free block.
-T();	if (free_list == block)
+	else
 	{
-T();		free_list = block->next;
-		ASSERT_HEAP(free_list);
+// Using the whole block.  The block after it no longer follows a free block.
+		block->size = block_bytes;
+
+		if (NULL != (next = block_after(a, block)))
+		{
+			next->size &= ~BLOCK_PREV_FREE;
+		}
 	}
 
 T();	result = (void*)((uint8*)block + sizeof(struct block_t));
 	ASSERT((uint32)result % HEAP_ALLOC_GRANULARITY == 0);
 
+	a->hwm = max(a->hwm, (void*)((uint8*)block + BLOCK_SIZE(block)));
+
+#if (HEAP_CHECK_ALL)
 // Fill user memory.
 	memset(result, MALLOC_FILL, req_bytes);
 
 // FIll our guard bytes (so we can detect over-run / under-run later).
-T();	rear_guard = rear_guard_ptr(block);
-	for (i = HEAP_ALLOC_GRANULARITY; i; *rear_guard = MALLOC_GUARD_MAGIC, rear_guard++, i -= 4);
-	block->guard = MALLOC_GUARD_MAGIC;
-
-// Place "block" into the alloc list.
-	if (!alloc_list)
-	{
-T();		block->next = NULL;
-		block->prev = NULL;
-		alloc_list = block;
-	}
-	else
-	{
-T();		struct block_t *node;
-
-		// Stop when we found the alloc'd item that is just past our current one.
-		for (node = alloc_list; node->next; node = node->next)
-		{
-			if ((node < block) && (node->next > block))
-			{
-T();				break;
-			}
-		}
-
-T();		if (node)
-		{
-T();			block->next = node->next;
-			block->prev = node;
-
-			node->next = block;
+T();	rear_guard = rear_guard_ptr(block);
+	for (i = HEAP_ALLOC_GRANULARITY; i; *rear_guard = MALLOC_GUARD_MAGIC, rear_guard++, i -= 4);
+#endif
+	block->guard = MALLOC_GUARD_MAGIC;
 
-			if (block->next)
-			{
-				block->next->prev = block;
-			}
-		}
-		else
-		{
-			PANIC1("kmalloc(): internal error, can't insert into alloc-list.");
-		}
-	}
+	a->alloc_blocks++;
+	a->alloc_bytes += BLOCK_SIZE(block);
+	a->total_allocs++;
 
 #if (HEAP_TRACK)
-	block->seq_id = alloc_seq_id++;
+	block->seq_id = heap_next_seq_id();
 	block->file = file;
 	block->line = line;
 	block->func = func;
 #endif
 
-#if (HEAP_REPLAY)
-	kdebug(DEBUG_DEBUG, FAC_HEAP, "heap-replay: replay_list[%d] = kmalloc(%d,%d);\n", block->seq_id, bytes, flags);
+#if (HEAP_PROFILE)
+	heap_site_account(a, file, line, func, BLOCK_SIZE(block), 1);
 #endif
 
-T();	spinlock_release(&heap_lock);
-
-	return result;
-}
+T();	spinlock_release(&a->lock);
 
-// If possible, merge 'a' and 'b'.  Assume 'a<b'.  Returns 'a' if they merge,
-// return 'b' if not.
-struct block_t *	heap_merge(struct block_t *a, struct block_t *b)
-{
-#if (DEBUG_HEAP)
-	kdebug(DEBUG_DEBUG, FAC_HEAP, "heap: heap_merge(%p, %p) - trying.\n", a, b);
+#if (HEAP_ALLOC_LIST)
+	spinlock_acquire(&heap_debug_lock);
+	alloc_list_add(block);
+	spinlock_release(&heap_debug_lock);
+#else
+	block->next = block->prev = NULL;
 #endif
 
-	ASSERT(a);
-	ASSERT(b);
-	ASSERT(a < b);
-
-// Are the nodes candidates to merge?
-	if ((a->next == b) && (b->prev == a) && ((uint8*)a + a->size == (uint8*)b))
-	{
-#if (DEBUG_HEAP)
-		kdebug (DEBUG_DEBUG, FAC_HEAP, "heap: merging %p and %p\n", a, b);
+#if (HEAP_REPLAY)
+	kdebug(DEBUG_DEBUG, FAC_HEAP, "heap-replay: replay_list[%d] = kmalloc(%d,%d);\n", block->seq_id, bytes, flags);
 #endif
 
-		a->size += b->size;
-		a->next = b->next;
-		if (a->next)
-		{
-			a->next->prev = a;
-		}
-
-		return a;
-	}
-
-	return b;
+	return result;
 }
 
-
 #if (HEAP_TRACK)
 void	__kfree(void *ptr, const char *file, int line, const char *func)
 #else
 void	__kfree(void *ptr)
 #endif
 {
+	struct heap_arena *a = NULL;
 	struct block_t *hdr = NULL;
 	struct block_t *tmp = NULL;
+	uint32		size = 0;
+#if (HEAP_CHECK_ALL)
 	uint32		*rear_guard = NULL;
 	int		i = 0;
+#endif
+
+// In an IRQ handler?  Leave it for later, rather than take locks here.
+	if (in_irq())
+	{
+		heap_defer_free(ptr);
+		return;
+	}
+
+	heap_drain_deferred();
 
 #if (DEBUG_HEAP)
 	{ uint8 attr = con_set_attr(0x0f);
@@ -257,6 +909,18 @@ void	__kfree(void *ptr)
 	con_set_attr(attr); }
 #endif
 
+	if (is_heap_guard_ptr(ptr))
+	{
+		heap_guard_free(ptr);
+		return;
+	}
+
+	if (is_vmalloc_ptr(ptr))
+	{
+		vfree(ptr);
+		return;
+	}
+
 // Do some sanity checks.
 	if ((ptr < heap_start) || (ptr > heap_end))
 	{
@@ -280,6 +944,12 @@ void	__kfree(void *ptr)
 		PANIC3("kfree(%p) block header(%p) corrupt!\n", ptr, hdr);
 	}
 
+	if (hdr->size & BLOCK_FREE)
+	{
+		PANIC3("kfree(%p) block header(%p) already free!\n", ptr, hdr);
+	}
+
+#if (HEAP_CHECK_ALL)
 	rear_guard = rear_guard_ptr(hdr);
 	for (i = HEAP_ALLOC_GRANULARITY; i; i -= 4, rear_guard++)
 	{
@@ -289,102 +959,265 @@ void	__kfree(void *ptr)
 			PANIC2("kfree(%p) user-chunk was over-run.\n", ptr);
 		}
 	}
+#endif
+
+	size = BLOCK_SIZE(hdr);
 
 #if (DEBUG_HEAP)
-	kdebug (DEBUG_DEBUG, FAC_HEAP, "kfree(%p) size was %d\n", ptr, hdr->size);
+	kdebug (DEBUG_DEBUG, FAC_HEAP, "kfree(%p) size was %d\n", ptr, size);
 #endif
 
 #if (HEAP_REPLAY)
 	kdebug (DEBUG_DEBUG, FAC_HEAP, "heap-replay: kfree(replay_list[%d]); replay_list[%d] = NULL;\n", hdr->seq_id, hdr->seq_id);
 #endif
 
-	memset(ptr, 0xce, hdr->size - sizeof(struct block_t));
+#if (HEAP_CHECK_ALL)
+	memset(ptr, 0xce, size - sizeof(struct block_t));
+#endif
+
+#if (HEAP_ALLOC_LIST)
+	spinlock_acquire(&heap_debug_lock);
+	alloc_list_del(hdr);
+	spinlock_release(&heap_debug_lock);
+#endif
+
+	a = ptr_to_arena(hdr);
+	spinlock_acquire(&a->lock);
+
+#if (HEAP_PROFILE)
+	heap_site_account(a, hdr->file, hdr->line, NULL, size, -1);
+#endif
 
-// Remove from alloc list.
-	for (tmp = alloc_list; tmp && (tmp != hdr); tmp = tmp->next);
+	a->alloc_blocks--;
+	a->alloc_bytes -= size;
 
-	if (alloc_list == tmp)
+// Merge with the block after us, if it is free.
+	if ((NULL != (tmp = block_after(a, hdr))) && (tmp->size & BLOCK_FREE))
 	{
-		alloc_list = tmp->next;
+#if (DEBUG_HEAP)
+		kdebug (DEBUG_DEBUG, FAC_HEAP, "heap: merging %p and %p\n", hdr, tmp);
+#endif
+		bin_remove(a, tmp);
+		size += BLOCK_SIZE(tmp);
 	}
-	else
+
+// Merge with the block before us, if it is free.
+	if (hdr->size & BLOCK_PREV_FREE)
+	{
+		tmp = block_before(hdr);
+#if (DEBUG_HEAP)
+		kdebug (DEBUG_DEBUG, FAC_HEAP, "heap: merging %p and %p\n", tmp, hdr);
+#endif
+		ASSERT(tmp->size & BLOCK_FREE);
+		bin_remove(a, tmp);
+		size += BLOCK_SIZE(tmp);
+		hdr = tmp;
+	}
+
+	block_set_free(a, hdr, size);
+	bin_insert(a, hdr);
+
+	spinlock_release(&a->lock);
+
+#if (DEBUG_HEAP)
+	kdebug (DEBUG_DEBUG, FAC_HEAP, "kfree(%p) done.\n", ptr);
+#endif
+}
+
+// Bytes the caller may use in an allocated block (everything up to the rear guard).
+static inline uint32	block_user_bytes(const struct block_t *block)
+{
+	return BLOCK_SIZE(block) - sizeof(struct block_t) - HEAP_ALLOC_GRANULARITY;
+}
+
+// Resizes allocated block 'block' (in arena 'a') to 'total_bytes' without moving
+// it, if it can.  Returns non-zero on success.  Caller holds a->lock.
+static int	heap_resize_in_place(struct heap_arena *a, struct block_t *block, uint32 total_bytes)
+{
+	struct block_t	*next = block_after(a, block);
+	struct block_t	*tail = NULL;
+	uint32	size = BLOCK_SIZE(block);
+
+// Growing: we need a free block right after us, and it has to be big enough.
+	if (total_bytes > size)
 	{
-		ASSERT (tmp->prev);	// every node on a list MUST have a 'prev' node if it is not the head node.
+		if (!next || !(next->size & BLOCK_FREE) || (size + BLOCK_SIZE(next) < total_bytes))
+		{
+			return 0;
+		}
+
+		bin_remove(a, next);
+		size += BLOCK_SIZE(next);
+
+		next = (struct block_t*)((uint8*)block + size);
+
+		if ((void*)next < a->end)
+		{
+			next->size &= ~BLOCK_PREV_FREE;
+		}
+	}
 
-		tmp->prev->next = tmp->next;
+// Anything left over past 'total_bytes' becomes a free block (merged with a free neighbour).
+	if (size - total_bytes > MIN_BLOCK_SIZE)
+	{
+		tail = (struct block_t*)((uint8*)block + total_bytes);
+		next = (struct block_t*)((uint8*)block + size);
 
-		if (tmp->next)
+		if (((void*)next < a->end) && (next->size & BLOCK_FREE))
 		{
-			tmp->next->prev = tmp->prev;
+			bin_remove(a, next);
+			size += BLOCK_SIZE(next);
 		}
+
+		tail->guard = MALLOC_GUARD_MAGIC;
+		block_set_free(a, tail, size - total_bytes);
+		bin_insert(a, tail);
+		size = total_bytes;
 	}
 
-// Add node back into free-list.
+	a->alloc_bytes += size - BLOCK_SIZE(block);
+	block->size = size | (block->size & BLOCK_PREV_FREE);
+	a->hwm = max(a->hwm, (void*)((uint8*)block + size));
+
+	return 1;
+}
+
+#if (HEAP_TRACK)
+void	*__krealloc(void *ptr, uint32 bytes, uint32 flags, const char *file, int line, const char *func)
+#else
+void	*__krealloc(void *ptr, uint32 bytes, uint32 flags)
+#endif
+{
+	struct heap_arena	*a = NULL;
+	struct block_t	*hdr = (struct block_t*)ptr - 1;
+	void	*result = NULL;
+	uint32	old_bytes = 0;
+#if (HEAP_PROFILE)
+	uint32	old_size = 0;
+#endif
+	uint32	req_bytes = ROUND_UP(bytes, HEAP_ALLOC_GRANULARITY);
+	uint32	total_bytes = ROUND_UP(sizeof(struct block_t) + req_bytes + sizeof(uint32), HEAP_ALLOC_GRANULARITY);
+#if (HEAP_CHECK_ALL)
+	uint32	*rear_guard = NULL;
+	int	i = 0;
+#endif
+
+	if (!ptr)
+	{
+#if (HEAP_TRACK)
+		return __kmalloc(bytes, flags, file, line, func);
+#else
+		return __kmalloc(bytes, flags);
+#endif
+	}
 
-	if ((hdr < free_list) || !free_list)
+	if (!bytes)
 	{
-// Insert at beginning of list.
-		hdr->next = free_list;
-		hdr->prev = NULL;
-		free_list = hdr;
-		tmp = hdr;
+#if (HEAP_TRACK)
+		__kfree(ptr, file, line, func);
+#else
+		__kfree(ptr);
+#endif
+		return NULL;
+	}
 
-		ASSERT_HEAP(free_list);
+	if (is_heap_guard_ptr(ptr))
+	{
+		old_bytes = heap_guard_size(ptr);
+	}
+	else if (is_vmalloc_ptr(ptr))
+	{
+		old_bytes = vmalloc_size(ptr);
 
-		if (hdr->next)
+// Still big, and still fits in the pages we have?
+		if ((bytes > VMALLOC_THRESHOLD) && (bytes <= old_bytes))
 		{
-			hdr->next->prev = hdr;
+			return ptr;
 		}
 	}
 	else
 	{
-// Insert in middle of end of list.
-		for (tmp = free_list; tmp; tmp = tmp->next)
+		if ((ptr < heap_start) || (ptr >= heap_end) || ((uint32)ptr % HEAP_ALLOC_GRANULARITY))
 		{
-			if ((tmp < hdr) && ((tmp->next > hdr) || !tmp->next))
-			{
-				hdr->next = tmp->next;
-				hdr->prev = tmp;
+			PANIC2("krealloc(%p) not a valid heap pointer!\n", ptr);
+		}
+
+		if ((hdr->guard != MALLOC_GUARD_MAGIC) || (hdr->size & BLOCK_FREE))
+		{
+			PANIC3("krealloc(%p) block header(%p) corrupt or free!\n", ptr, hdr);
+		}
 
-				if (tmp->next)
+		old_bytes = block_user_bytes(hdr);
+
+// If it has to move, it stays in the same arena.
+		a = ptr_to_arena(hdr);
+		flags = (flags & ~HEAP_ARENA_MASK) | HEAP_ARENA(a - heap_arenas);
+
+// Big enough to belong in vmalloc now?  Then it has to move.
+		if (bytes <= VMALLOC_THRESHOLD)
+		{
+			spinlock_acquire(&a->lock);
+
+#if (HEAP_PROFILE)
+			old_size = BLOCK_SIZE(hdr);
+#endif
+
+			if (heap_resize_in_place(a, hdr, total_bytes))
+			{
+#if (HEAP_CHECK_ALL)
+				if (req_bytes > old_bytes)
 				{
-					tmp->next->prev = hdr;
+					memset((uint8*)ptr + old_bytes, MALLOC_FILL, req_bytes - old_bytes);
 				}
-				tmp->next = hdr;
 
-				break;
+				rear_guard = rear_guard_ptr(hdr);
+				for (i = HEAP_ALLOC_GRANULARITY; i; *rear_guard = MALLOC_GUARD_MAGIC, rear_guard++, i -= 4);
+#endif
+
+#if (HEAP_PROFILE)
+				heap_site_account(a, hdr->file, hdr->line, NULL, old_size, -1);
+				heap_site_account(a, file, line, func, BLOCK_SIZE(hdr), 1);
+#endif
+
+#if (HEAP_TRACK)
+				hdr->file = file;
+				hdr->line = line;
+				hdr->func = func;
+#endif
+
+#if (HEAP_REPLAY)
+				kdebug(DEBUG_DEBUG, FAC_HEAP, "heap-replay: krealloc(replay_list[%d],%d,%d);\n", hdr->seq_id, bytes, flags);
+#endif
+
+				spinlock_release(&a->lock);
+				return ptr;
 			}
+
+			spinlock_release(&a->lock);
 		}
 	}
 
-// Try to merge "hdr->prev" and "hdr", if they are contiguous.
-	if (hdr->prev)
-	{
-		hdr = heap_merge(hdr->prev, hdr);
-	}
+// Have to move it.
+#if (HEAP_TRACK)
+	result = __kmalloc(bytes, flags, file, line, func);
+#else
+	result = __kmalloc(bytes, flags);
+#endif
 
-	if (hdr->next)
+	if (!result)
 	{
-		heap_merge(hdr, hdr->next);
+		return NULL;
 	}
 
-#if (DEBUG_HEAP)
-	kdebug (DEBUG_DEBUG, FAC_HEAP, "kfree(%p) done.\n", ptr);
-#endif
-}
+	memcpy(result, ptr, min(old_bytes, bytes));
 
-int	heap_count_nodes(struct block_t *list)
-{
-	int	count = 0;
+#if (HEAP_TRACK)
+	__kfree(ptr, file, line, func);
+#else
+	__kfree(ptr);
+#endif
 
-	for (; list; list = list->next, count++)
-	{
-		if (list == list->next)
-		{
-			PANIC2("circular heap list: %p\n", list);
-		}
-	}
-	return count;
+	return result;
 }
 
 // Test: That we can allocate a block, free it, allocate a new one of
@@ -452,16 +1285,19 @@ void	test_heap_3(void)
 }
 
 // test re-use of a block big enough for the current allocation, bu not big enough to split.
+// The freed block is sized to start a size class exactly, so the search finds it
+// whatever sizeof(struct block_t) is (the host tools build this file too).
 void	test_heap_4(void)
 {
-	void *array[4];
+	void	*array[4];
+	uint32	fit = 256 - ROUND_UP(sizeof(struct block_t) + sizeof(uint32), HEAP_ALLOC_GRANULARITY);
 
-	array[0] = kmalloc(68, 0);
-	array[1] = kmalloc(68, 0);
-	array[2] = kmalloc(68, 0);
+	array[0] = kmalloc(fit, 0);
+	array[1] = kmalloc(fit, 0);
+	array[2] = kmalloc(fit, 0);
 
 	kfree(array[1]);
-	array[3] = kmalloc(64, 0);
+	array[3] = kmalloc(fit - HEAP_ALLOC_GRANULARITY, 0);
 
 	ASSERT(array[1] == array[3]);
 
@@ -471,6 +1307,170 @@ void	test_heap_4(void)
 	kfree(array[3]);
 }
 
+// Test: Pages in a big free block can be trimmed, and fault back in on reuse.
+void	test_heap_5(void)
+{
+	uint8	*a = NULL;
+	uint32	bytes = 16 * PAGE_SIZE;
+	uint32	trimmed = 0;
+	uint32	i;
+
+	a = kmalloc(bytes, 0);
+	memset(a, 0x5a, bytes);
+	kfree(a);
+
+	trimmed = heap_trim(~0);
+	ASSERT(trimmed >= 16 - 2);
+
+	a = kmalloc(bytes, 0);
+	memset(a, 0xa5, bytes);
+
+	for (i = 0; i < bytes; i += PAGE_SIZE)
+	{
+		ASSERT(a[i] == 0xa5);
+	}
+
+	kfree(a);
+}
+
+// Test: krealloc grows into the free block after it, shrinks in place,
+// and moves (keeping the contents) when the next block is in use.
+void	test_heap_6(void)
+{
+	uint8	*a = NULL;
+	uint8	*b = NULL;
+	uint8	*c = NULL;
+	int	i;
+
+	a = kmalloc(100, 0);
+	memset(a, 0x11, 100);
+
+	b = krealloc(a, 200, 0);
+	ASSERT(a == b);
+
+	c = kmalloc(16, 0);
+
+	b = krealloc(a, 40, 0);
+	ASSERT(a == b);
+
+	b = krealloc(a, 150, 0);
+	ASSERT(a == b);
+
+	b = krealloc(a, 1000, 0);
+	ASSERT(a != b);
+
+	for (i = 0; i < 40; i++)
+	{
+		ASSERT(b[i] == 0x11);
+	}
+
+	kfree(b);
+	kfree(c);
+}
+
+// Test: heap_prefault() maps the pages past the high-water mark, and
+// heap_trim() leaves them there.
+void	test_heap_7(void)
+{
+	struct heap_arena	*ha = &heap_arenas[HEAP_ARENA_GENERAL];
+	uint8	*a = NULL;
+	uint32	addr;
+
+	a = kmalloc(3 * PAGE_SIZE, 0);
+	kfree(a);
+
+	heap_prefault();
+	heap_trim(~0);
+
+	for (addr = PAGE_BASE(ha->hwm); addr < (uint32)ha->prefault_top; addr += PAGE_SIZE)
+	{
+		ASSERT(vmm_lookup_phys((void*)addr));
+	}
+}
+
+#if (HEAP_PROFILE)
+// Test: the call site table follows kmalloc, krealloc and kfree.
+void	test_heap_8(void)
+{
+	void	*p[2];
+	struct block_t	*hdr = NULL;
+	struct heap_site	*site = NULL;
+	uint32	total = 0;
+	int	i;
+
+	for (i = 0; i < 2; i++)
+	{
+		p[i] = kmalloc(40, 0);
+	}
+
+	hdr = (struct block_t*)p[0] - 1;
+	site = heap_site_find(ptr_to_arena(hdr), hdr->file, hdr->line, NULL);
+	ASSERT(site);
+	ASSERT(site->live_count == 2);
+	ASSERT(site->live_bytes == 2 * BLOCK_SIZE(hdr));
+	total = site->total_allocs;
+
+	kfree(p[0]);
+	ASSERT(site->live_count == 1);
+
+	p[1] = krealloc(p[1], 16, 0);
+	ASSERT(site->live_count == 0);
+	ASSERT(site->live_bytes == 0);
+	ASSERT(site->peak_bytes >= 2 * BLOCK_SIZE(hdr));
+	ASSERT(site->total_allocs == total);
+
+	kfree(p[1]);
+}
+#endif
+
+// Test: arena flags pick the arena, krealloc keeps blocks in their arena,
+// and each arena counts its own allocations.
+void	test_heap_9(void)
+{
+	struct heap_arena_stats	before, after;
+	uint8	*a = NULL;
+	uint8	*b = NULL;
+
+	heap_arena_get_stats(HEAP_ARENA_VFS, &before);
+
+	a = kmalloc(100, HEAP_VFS);
+	b = kmalloc(100, HEAP_VFS);
+	ASSERT(ptr_to_arena(a) == &heap_arenas[HEAP_ARENA_VFS]);
+
+	a = krealloc(a, 1000, 0);
+	ASSERT(ptr_to_arena(a) == &heap_arenas[HEAP_ARENA_VFS]);
+
+	heap_arena_get_stats(HEAP_ARENA_VFS, &after);
+	ASSERT(after.alloc_blocks == before.alloc_blocks + 2);
+	ASSERT(after.total_allocs == before.total_allocs + 3);
+
+	kfree(a);
+	kfree(b);
+
+	heap_arena_get_stats(HEAP_ARENA_VFS, &after);
+	ASSERT(after.alloc_blocks == before.alloc_blocks);
+	ASSERT(after.alloc_bytes == before.alloc_bytes);
+}
+
+// Test: kfree() in an IRQ handler only queues the block, and the next
+// kmalloc() outside of one frees it.
+void	test_heap_10(void)
+{
+	void	*p = kmalloc(64, 0);
+	void	*q = NULL;
+
+	irq_nesting++;
+	kfree(p);
+	irq_nesting--;
+
+	ASSERT(heap_deferred == p);
+
+	q = kmalloc(64, 0);
+	ASSERT(!heap_deferred);
+
+	kfree(q);
+}
+
 typedef void (*test_func)(void);
 static test_func tests[] =
 {
@@ -478,15 +1478,26 @@ static test_func tests[] =
 	test_heap_2,
 	test_heap_3,
 	test_heap_4,
+	test_heap_5,
+	test_heap_6,
+	test_heap_7,
+#if (HEAP_PROFILE)
+	test_heap_8,
+#endif
+	test_heap_9,
+	test_heap_10,
 	NULL
 };
 
 void	test_heap(void)
 {
+	uint32	free_count = 0;
+	uint32	alloc_count = 0;
 	int	i;
 
-	ASSERT(heap_count_nodes(alloc_list) == 0);
-	ASSERT(heap_count_nodes(free_list) == 1);
+	heap_walk(&free_count, &alloc_count);
+	ASSERT(alloc_count == 0);
+	ASSERT(free_count == HEAP_ARENA_COUNT);	// Each arena is one free block.
 
 	for (i = 0; tests[i]; i++)
 	{
@@ -495,11 +1506,9 @@ void	test_heap(void)
 		tests[i]();
 //		heap_dump();
 
-//		printf("\t\talloc_list\n");
-		ASSERT(heap_count_nodes(alloc_list) == 0);
-//		printf("\t\tfree_list\n");
-		ASSERT(heap_count_nodes(free_list) == 1);
-
+		heap_walk(&free_count, &alloc_count);
+		ASSERT(alloc_count == 0);
+		ASSERT(free_count == HEAP_ARENA_COUNT);
 	}
 
 //	printf("heap: test over.\n");
@@ -509,28 +1518,64 @@ void	test_heap(void)
 void	heap_init(void)
 {
 	uint32	heap_bytes = (uint32)&_kernel_heap_end - (uint32)&_kernel_heap_start;
+	struct heap_arena	*a = NULL;
+	struct block_t	*block = NULL;
+	uint8	*start = (uint8*)heap_end;
+	int	i;
 
 	if (sizeof(struct block_t) % HEAP_ALLOC_GRANULARITY)
 	{
 		PANIC3("heap: sizeof(struct block_t) (*%d) not a multiple of %d\n", sizeof(struct block_t), HEAP_ALLOC_GRANULARITY);
 	}
 
-	corehelp.heap_free_list_ptr = (uint32)&free_list;
+	if (heap_bytes <= (HEAP_ARENA_COUNT - 1) * HEAP_ARENA_SIZE)
+	{
+		PANIC2("heap: only %d bytes, too small for the arenas.\n", heap_bytes);
+	}
+
+	corehelp.heap_start = (uint32)heap_start;
+	corehelp.heap_end = (uint32)heap_end;
+#if (HEAP_ALLOC_LIST)
 	corehelp.heap_alloc_list_ptr = (uint32)&alloc_list;
+	alloc_list = NULL;
+#endif
+#if (HEAP_PROFILE)
+	corehelp.heap_sites_ptr = (uint32)heap_sites;
+	corehelp.heap_sites_count = HEAP_ARENA_COUNT * HEAP_PROFILE_SITES;
+	memset(heap_sites, 0, sizeof(heap_sites));
+#endif
 
 // Allocate first block (to hold empty heap).
-	vmm_map_pages(heap_start, NULL, HEAP_GROW_PAGES, PTE_KDATA);
-
-// Create initial linked lists of blocks.
-	free_list = (struct block_t*)heap_start;
-	alloc_list = NULL;
+	heap_mapped_pages = vmm_map_pages(heap_start, 0, HEAP_GROW_PAGES, PTE_KDATA);
+	heap_top = (uint8*)heap_start + HEAP_GROW_PAGES * PAGE_SIZE;
+	heap_prefaulted_pages = 0;
 
-// Initialize list of free blocks.
-	memset(free_list, 0, sizeof(struct block_t));
-	free_list->size = heap_bytes - sizeof(struct block_t);
-	free_list->next = NULL;
+// Carve the arenas from the top down, so "general" gets whatever is left at the bottom.
+	for (i = HEAP_ARENA_COUNT - 1; i >= 0; i--)
+	{
+		a = &heap_arenas[i];
+
+		a->end = start;
+		a->start = start = i ? start - HEAP_ARENA_SIZE : (uint8*)heap_start;
+		a->hwm = a->prefault_top = a->start;
+		spinlock_init(&a->lock, a->name);
+
+		memset(a->bins, 0, sizeof(a->bins));
+		memset(a->sl_bitmap, 0, sizeof(a->sl_bitmap));
+		a->fl_bitmap = 0;
+		a->alloc_blocks = a->alloc_bytes = a->total_allocs = a->spills = 0;
+
+// Each arena starts out as one free block.  It is the last block, so it has no footer.
+		block = (struct block_t*)a->start;
+		memset(block, 0, sizeof(struct block_t));
+		block->guard = MALLOC_GUARD_MAGIC;
+		block_set_free(a, block, (uint32)a->end - (uint32)a->start);
+		bin_insert(a, block);
+
+		kdebug(DEBUG_INFO, FAC_HEAP, "heap: arena %s at %p, %d K.\n", a->name, a->start, ((uint32)a->end - (uint32)a->start) / 1024);
+	}
 
-	printf("heap: %d K available.\n", heap_bytes / 1024);
+	printf("heap: %d K available, %d arenas.\n", heap_bytes / 1024, HEAP_ARENA_COUNT);
 	kdebug(DEBUG_INFO, FAC_HEAP, "heap: %d K available.\n", heap_bytes / 1024);
 
 	test_heap();
@@ -560,9 +1605,62 @@ void	heap_grow(struct regs *r, void *cr2_value)
 		PANIC1("heap: not enough memory to grow.\n");
 	}
 
-	count = vmm_map_pages(virt, NULL, count, PTE_KDATA | VMM_SKIP_MAPPED);
+	spinlock_acquire(&heap_map_lock);
+
+	count = vmm_map_pages(virt, 0, count, PTE_KDATA | VMM_SKIP_MAPPED);
+	heap_mapped_pages += count;
+	heap_top = max(heap_top, (void*)((uint8*)virt + HEAP_GROW_PAGES * PAGE_SIZE));
+
+	spinlock_release(&heap_map_lock);
 
 #if (DEBUG_HEAP)
 	kdebug(DEBUG_DEBUG, FAC_HEAP, "heap: added %d pages, %d free\n", count, gp_total_free_4k_pages);
 #endif
 }
+
+// Maps up to HEAP_PREFAULT_PAGES past arena 'a's high-water mark.
+static uint32	heap_prefault_arena(struct heap_arena *a)
+{
+	uint32	lo = PAGE_BASE(a->hwm);
+	uint32	hi = min(lo + HEAP_PREFAULT_PAGES * PAGE_SIZE, (uint32)a->end);
+	uint32	count = 0;
+
+// Nothing above the high-water mark is ever trimmed, so once mapped, it stays mapped.
+	if (hi <= (uint32)a->prefault_top)
+	{
+		return 0;
+	}
+
+	lo = max(lo, (uint32)a->prefault_top);
+
+	spinlock_acquire(&heap_map_lock);
+
+	count = vmm_map_pages((void*)lo, 0, (hi - lo) / PAGE_SIZE, PTE_KDATA | VMM_SKIP_MAPPED);
+	heap_mapped_pages += count;
+	heap_prefaulted_pages += count;
+	heap_top = max(heap_top, (void*)hi);
+	a->prefault_top = (void*)hi;
+
+	spinlock_release(&heap_map_lock);
+
+	return count;
+}
+
+// Maps pages past the high-water mark of each arena in use, so that kmalloc()
+// doesn't have to fault them in.  Does not take the arena locks.  Returns
+// the number of pages that were mapped.
+uint32	heap_prefault(void)
+{
+	uint32	count = 0;
+	int	i;
+
+	for (i = 0; i < HEAP_ARENA_COUNT; i++)
+	{
+		if (heap_arenas[i].total_allocs)
+		{
+			count += heap_prefault_arena(&heap_arenas[i]);
+		}
+	}
+
+	return count;
+}
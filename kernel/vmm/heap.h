@@ -7,27 +7,131 @@
 // Bottom bit affects alignment of the result.
 #define	HEAP_FAILOK	(1 << 1)
 
+// Which arena to allocate from, in bits 8-11.  Zero is the general arena.
+enum
+{
+	HEAP_ARENA_GENERAL = 0,
+	HEAP_ARENA_OBJECTS,
+	HEAP_ARENA_VFS,
+	HEAP_ARENA_TASKS,
+	HEAP_ARENA_DRIVERS,
+	HEAP_ARENA_COUNT
+};
+
+#define HEAP_ARENA(x)		((x) << 8)
+#define HEAP_ARENA_MASK		HEAP_ARENA(0x0f)
+#define HEAP_ARENA_OF(f)	(((f) & HEAP_ARENA_MASK) >> 8)
+
+#define HEAP_OBJECTS		HEAP_ARENA(HEAP_ARENA_OBJECTS)
+#define HEAP_VFS		HEAP_ARENA(HEAP_ARENA_VFS)
+#define HEAP_TASKS		HEAP_ARENA(HEAP_ARENA_TASKS)
+#define HEAP_DRIVERS		HEAP_ARENA(HEAP_ARENA_DRIVERS)
+
 #define HEAP_ALLOC_MASK (~(HEAP_GROW_PAGES * PAGE_SIZE -1))
 
 void	heap_init(void);
 void	heap_grow(struct regs *r, void *cr2_value);
 
+struct heap_stats
+{
+	uint32	mapped_pages;		// Physical pages backing the heap.
+	uint32	trimmed_pages;		// Total pages returned by heap_trim().
+	uint32	prefaulted_pages;	// Total pages mapped by heap_prefault().
+	uint32	promoted_4m;		// Total 4M ranges remapped by heap_promote().
+	uint32	alloc_blocks;		// Live allocations.
+	uint32	alloc_bytes;		// Live allocations, including block headers and guards.
+	uint32	total_allocs;		// kmalloc() calls served by the heap since boot.
+	uint32	free_blocks;		// Blocks in the size-class bins.
+};
+
+// Totals for all arenas.
+void	heap_get_stats(struct heap_stats *stats);
+
+struct heap_arena_stats
+{
+	const char	*name;
+	uint32	region_bytes;		// Size of the arena's virtual range.
+	uint32	hwm_bytes;		// Highest offset ever allocated.
+	uint32	alloc_blocks;
+	uint32	alloc_bytes;
+	uint32	total_allocs;
+	uint32	free_blocks;
+	uint32	spills;			// Allocations sent to the general arena because this one was full.
+};
+
+// 'arena' is HEAP_ARENA_xxx.
+void	heap_arena_get_stats(uint32 arena, struct heap_arena_stats *stats);
+
+// Pages currently mapped into the heap, and total pages returned by heap_trim().
+extern uint32	heap_mapped_pages;
+extern uint32	heap_trimmed_pages;
+
+// Unmaps up to 'max_pages' whole pages inside free blocks and returns them
+// to the physical allocator.  Returns the number of pages released.
+uint32	heap_trim(uint32 max_pages);
+
+// Maps HEAP_PREFAULT_PAGES past each arena's high-water mark, outside of
+// the arena locks.  Returns the number of pages it had to map.
+uint32	heap_prefault(void);
+
+// Remaps the next fully populated 4M range of the heap with a 4M page.
+// Called by "[vmmd]".  Returns 1 if it promoted one.
+uint32	heap_promote(void);
+
+// Frees the blocks that were kfree()d by IRQ handlers (which only queue them).
+void	heap_drain_deferred(void);
+
+// Walks every block in address order, checking boundary tags.
+void	heap_walk(uint32 *free_count, uint32 *alloc_count);
+void	heap_dump(void);
+
 #if (HEAP_TRACK)
 	void	__kfree(void *ptr, const char *file, int line, const char *func);
 	void    *__kmalloc(uint32 bytes, uint32 flags, const char *file, int line, const char *func);
 
+	void	*__krealloc(void *ptr, uint32 bytes, uint32 flags, const char *file, int line, const char *func);
+
 	#define kfree(x) __kfree(x,__FILE__,__LINE__,__FUNCTION__)
 	#define kmalloc(x,f) __kmalloc(x,f,__FILE__,__LINE__,__FUNCTION__)
+	#define krealloc(p,x,f) __krealloc(p,x,f,__FILE__,__LINE__,__FUNCTION__)
 #else
 	void	__kfree(void *ptr);
 	void    *__kmalloc(uint32 bytes, uint32 flags);
+	void	*__krealloc(void *ptr, uint32 bytes, uint32 flags);
 	#define kfree(x) __kfree(x)
 	#define kmalloc(x,f) __kmalloc(x,f)
+	#define krealloc(p,x,f) __krealloc(p,x,f)
 #endif
 
+// krealloc(ptr, bytes, flags): Resizes 'ptr', in place when the block after it is
+// free (grow) or by splitting off the tail (shrink).  Otherwise it moves, like
+// kmalloc + memcpy + kfree.  krealloc(NULL, ...) is kmalloc, krealloc(ptr, 0, ...)
+// is kfree.  With HEAP_FAILOK, returns NULL on failure and 'ptr' is untouched.
+
+// heap_guard.c
+extern uint32	heap_guard_rate;
+
+void	heap_guard_init(uint32 rate);
+void	heap_guard_free(void *ptr);
+uint32	heap_guard_size(const void *ptr);
+int	heap_guard_fault(struct regs *r, void *cr2_value);
+
+#if (HEAP_TRACK)
+	void	*heap_guard_alloc(uint32 bytes, const char *file, int line, const char *func);
+#else
+	void	*heap_guard_alloc(uint32 bytes);
+#endif
+
+static inline int is_heap_guard_ptr(const void *x)
+{
+	return (x >= (const void*)&_kernel_heap_guard_start) && (x < (const void*)&_kernel_heap_guard_end);
+}
+
+// Returns non-zero if 'x' points into dynamically allocated kernel memory (heap, guard slots, vmalloc or slab).
 static inline int is_heap_ptr(const void *x)
 {
-	return (x >= (const void*)&_kernel_heap_start) && (x < (const void*)&_kernel_heap_end);
+	return ((x >= (const void*)&_kernel_heap_start) && (x < (const void*)&_kernel_heap_end)) ||
+		is_heap_guard_ptr(x) || is_vmalloc_ptr(x) || is_slab_ptr(x);
 }
 
 
@@ -14,14 +14,25 @@
 // ALWAYS be unaligned).
 #define MALLOC_GUARD_MAGIC	0xbdbdbdbd
 
-/* The free_list has this structure at the beginning of each node.
-   The alloc_list has this strucutre at the beginning of each block,
-   but the pointer returned to the caller points to the data after
-   the block. */
+// Flags kept in the low bits of block_t.size (sizes are always a
+// multiple of HEAP_ALLOC_GRANULARITY, so these bits are otherwise zero).
+#define BLOCK_FREE		0x00000001	// This block is free.
+#define BLOCK_PREV_FREE		0x00000002	// The block physically before this one is free.
+#define BLOCK_FLAGS_MASK	0x00000007
+
+#define BLOCK_SIZE(b)		((b)->size & ~BLOCK_FLAGS_MASK)
+
+/* Every block (free or allocated) starts with this structure (the
+   "boundary tag").  The pointer returned to the caller points to the
+   data after it.  Free blocks are linked into a size-class bin via
+   next/prev, and also store their size in their last uint32 (the
+   footer), so the block after them can find their start.  The last
+   block in the heap has no footer.  Allocated blocks only use
+   next/prev when HEAP_ALLOC_LIST is set. */
 struct block_t
 {
-	uint32		size;		// Total size of this block, including header, data and rear guard.
-	struct block_t	*next;		//
+	uint32		size;		// Total size of this block, including header, data and rear guard.  Low bits are BLOCK_xxx flags.
+	struct block_t	*next;		// Free: next block in same size class.  Allocated: alloc_list.
 	struct block_t	*prev;		//
 
 #if (HEAP_TRACK)
@@ -33,3 +44,20 @@ struct block_t
 
 	uint32		guard;		// MALLOC_GUARD, for detecting under-run.
 };
+
+// Free blocks only: location of the footer (a copy of the size, without flags).
+#define block_footer_ptr(b)	((uint32*)((uint8*)(b) + BLOCK_SIZE(b)) - 1)
+
+/* One entry in the heap's call site table (HEAP_PROFILE_SITES), keyed
+   by file + line.  Sizes are whole blocks, including headers.  A 'file'
+   of NULL means the entry is unused. */
+struct heap_site
+{
+	const char	*file;
+	int		line;
+	const char	*func;
+	uint32		live_bytes;
+	uint32		live_count;
+	uint32		total_allocs;	// Including krealloc()s.
+	uint32		peak_bytes;	// Highest 'live_bytes' has been.
+};
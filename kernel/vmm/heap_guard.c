@@ -0,0 +1,253 @@
+/*	kernel/vmm/heap_guard.c
+
+	Sampled guarded allocations.  When enabled ("heapguard=N" on the
+	kernel command line), one in every N kmalloc() calls is served from
+	a slot in the guard region (_kernel_heap_guard_start to
+	_kernel_heap_guard_end) instead of the heap.
+
+	Each slot is two virtual pages: a data page, and a guard page that
+	is never mapped.  The allocation is placed at the end of the data
+	page, so touching even one byte past it faults.  kfree() unmaps the
+	data page, so a later use-after-free faults too.  Slots are reused
+	round-robin to keep freed pages unmapped for as long as possible.
+
+	Faults in the region are reported by heap_guard_fault() (called from
+	vmm_page_fault()), which names the allocation that was hit.
+*/
+
+#include "kernel/kernel.h"
+#include "kernel/vmm/heap_block.h"
+
+// Max number of pages in the guard region that we can track.
+#define GUARD_REGION_PAGES	1024
+
+#define GUARD_SLOT_PAGES	2
+#define GUARD_SLOT_SIZE		(GUARD_SLOT_PAGES * PAGE_SIZE)
+#define GUARD_MAX_SLOTS		(GUARD_REGION_PAGES / GUARD_SLOT_PAGES)
+
+enum
+{
+	GUARD_SLOT_EMPTY = 0,	// Never used.
+	GUARD_SLOT_LIVE,	// Handed out, data page is mapped.
+	GUARD_SLOT_FREED	// Freed, data page unmapped.
+};
+
+struct guard_slot
+{
+	void		*ptr;		// What kmalloc() returned.
+	uint32		bytes;		// What the caller asked for.
+	uint32		state;		// GUARD_SLOT_xxx
+#if (HEAP_TRACK)
+	const char	*file;		// Who allocated it.
+	int		line;
+	const char	*func;
+#endif
+};
+
+static struct guard_slot	guard_slots[GUARD_MAX_SLOTS];
+static uint32		guard_slot_count = 0;
+static uint32		guard_next = 0;		// Next slot to try (round-robin).
+static uint32		guard_countdown = 0;	// Allocations left until next sample.
+static spinlock		guard_lock = INIT_SPINLOCK("heap_guard");
+
+// One in 'heap_guard_rate' allocations is guarded.  Zero disables sampling.
+uint32			heap_guard_rate = 0;
+
+static inline void*	slot_to_page(uint32 slot)
+{
+	return (void*)((uint32)&_kernel_heap_guard_start + slot * GUARD_SLOT_SIZE);
+}
+
+static inline uint32	ptr_to_slot(const void *ptr)
+{
+	return ((uint32)ptr - (uint32)&_kernel_heap_guard_start) / GUARD_SLOT_SIZE;
+}
+
+#if (HEAP_TRACK)
+void*	heap_guard_alloc(uint32 bytes, const char *file, int line, const char *func)
+#else
+void*	heap_guard_alloc(uint32 bytes)
+#endif
+{
+	struct guard_slot	*gs = NULL;
+	uint32	slot = 0;
+	uint32	i = 0;
+	void	*page = NULL;
+
+	if (!bytes || (bytes > PAGE_SIZE))
+	{
+		return NULL;
+	}
+
+	spinlock_acquire(&guard_lock);
+
+	if (--guard_countdown)
+	{
+		spinlock_release(&guard_lock);
+		return NULL;
+	}
+
+	guard_countdown = heap_guard_rate;
+
+	for (i = 0; i < guard_slot_count; i++)
+	{
+		slot = (guard_next + i) % guard_slot_count;
+
+		if (guard_slots[slot].state != GUARD_SLOT_LIVE)
+		{
+			break;
+		}
+	}
+
+// Every slot is in use.  Let the normal heap handle this one.
+	if (i == guard_slot_count)
+	{
+		spinlock_release(&guard_lock);
+		return NULL;
+	}
+
+	guard_next = (slot + 1) % guard_slot_count;
+
+	gs = &guard_slots[slot];
+	gs->state = GUARD_SLOT_LIVE;
+	gs->bytes = bytes;
+#if (HEAP_TRACK)
+	gs->file = file;
+	gs->line = line;
+	gs->func = func;
+#endif
+
+	spinlock_release(&guard_lock);
+
+	page = slot_to_page(slot);
+	vmm_map_pages(page, 0, 1, PTE_KDATA | VMM_NOZERO);
+
+// Slack before the object (and any rounding after it) is filled, and checked in kfree().
+	memset(page, MALLOC_FILL, PAGE_SIZE);
+	gs->ptr = (uint8*)page + PAGE_SIZE - ROUND_UP(bytes, HEAP_ALLOC_GRANULARITY);
+
+	return gs->ptr;
+}
+
+void	heap_guard_free(void *ptr)
+{
+	struct guard_slot	*gs = NULL;
+	uint32	slot = ptr_to_slot(ptr);
+	uint8	*page = NULL;
+	uint8	*p = NULL;
+
+	if (slot >= guard_slot_count)
+	{
+		PANIC2("kfree(%p) not in a valid guard slot!\n", ptr);
+	}
+
+	gs = &guard_slots[slot];
+	page = (uint8*)slot_to_page(slot);
+
+	if ((gs->state != GUARD_SLOT_LIVE) || (gs->ptr != ptr))
+	{
+		PANIC3("kfree(%p) guarded block not allocated (slot state %d)!\n", ptr, gs->state);
+	}
+
+// Under-run into the start of the page, or over-run into the alignment slack?
+	for (p = page; p < (uint8*)ptr; p++)
+	{
+		if (*p != MALLOC_FILL)
+		{
+			PANIC3("kfree(%p) guarded block was under-run at %p.\n", ptr, p);
+		}
+	}
+
+	for (p = (uint8*)ptr + gs->bytes; p < page + PAGE_SIZE; p++)
+	{
+		if (*p != MALLOC_FILL)
+		{
+			PANIC3("kfree(%p) guarded block was over-run at %p.\n", ptr, p);
+		}
+	}
+
+	vmm_free_pages(page, 1);
+
+	spinlock_acquire(&guard_lock);
+	gs->state = GUARD_SLOT_FREED;
+	spinlock_release(&guard_lock);
+}
+
+// Returns the size that was asked for when 'ptr' was allocated.
+uint32	heap_guard_size(const void *ptr)
+{
+	uint32	slot = ptr_to_slot(ptr);
+
+	if ((slot >= guard_slot_count) || (guard_slots[slot].state != GUARD_SLOT_LIVE) || (guard_slots[slot].ptr != ptr))
+	{
+		PANIC2("heap_guard_size(%p) guarded block not allocated!\n", ptr);
+	}
+
+	return guard_slots[slot].bytes;
+}
+
+// Called by vmm_page_fault() for addresses in the guard region.
+// Reports what was hit.  Always returns 0 (fault not handled).
+int	heap_guard_fault(struct regs *r, void *cr2_value)
+{
+	struct guard_slot	*gs = NULL;
+	uint32	slot = ptr_to_slot(cr2_value);
+	uint8	*page = (uint8*)slot_to_page(slot);
+	const char	*what = NULL;
+
+	if (slot >= guard_slot_count)
+	{
+		what = "unused guard slot";
+	}
+	else if ((uint8*)cr2_value >= page + PAGE_SIZE)
+	{
+		what = "over-run past guarded block";
+	}
+	else if (guard_slots[slot].state == GUARD_SLOT_FREED)
+	{
+		what = "use after free of guarded block";
+	}
+	else
+	{
+		what = "access to unallocated guard slot";
+	}
+
+	printf("heap_guard: %s, address %p, eip %p\n", what, cr2_value, r ? r->eip : 0);
+	kdebug(DEBUG_FATAL, FAC_HEAP, "heap_guard: %s, address %p, eip %p\n", what, cr2_value, r ? r->eip : 0);
+
+	if (slot < guard_slot_count)
+	{
+		gs = &guard_slots[slot];
+
+#if (HEAP_TRACK)
+		printf("heap_guard: slot %d: ptr=%p, bytes=%d, allocated by %s() at %s:%d\n",
+			slot, gs->ptr, gs->bytes, gs->func, gs->file, gs->line);
+		kdebug(DEBUG_FATAL, FAC_HEAP, "heap_guard: slot %d: ptr=%p, bytes=%d, allocated by %s() at %s:%d\n",
+			slot, gs->ptr, gs->bytes, gs->func, gs->file, gs->line);
+#else
+		printf("heap_guard: slot %d: ptr=%p, bytes=%d\n", slot, gs->ptr, gs->bytes);
+		kdebug(DEBUG_FATAL, FAC_HEAP, "heap_guard: slot %d: ptr=%p, bytes=%d\n", slot, gs->ptr, gs->bytes);
+#endif
+	}
+
+	return 0;
+}
+
+// 'rate' is N in "one in N allocations is guarded".  Zero disables sampling.
+void	heap_guard_init(uint32 rate)
+{
+	uint32	region_pages = ((uint32)&_kernel_heap_guard_end - (uint32)&_kernel_heap_guard_start) / PAGE_SIZE;
+
+	memset(guard_slots, 0, sizeof(guard_slots));
+
+	guard_slot_count = min(region_pages / GUARD_SLOT_PAGES, GUARD_MAX_SLOTS);
+	guard_next = 0;
+	guard_countdown = rate;
+	heap_guard_rate = rate;
+
+	if (rate)
+	{
+		printf("heap: guarding 1 in %d allocations (%d slots).\n", rate, guard_slot_count);
+		kdebug(DEBUG_INFO, FAC_HEAP, "heap: guarding 1 in %d allocations (%d slots).\n", rate, guard_slot_count);
+	}
+}
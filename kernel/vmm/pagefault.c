@@ -18,6 +18,18 @@ int	vmm_page_fault(struct regs *r, void *cr2_value)
 		return 1;
 	}
 
+// Guarded allocations are never faulted in.  This is an over-run or use-after-free.
+	if (is_heap_guard_ptr(cr2_value))
+	{
+		return heap_guard_fault(r, cr2_value);
+	}
+
+// Reserved areas are populated on first touch.
+	if (vma_fault(r, cr2_value))
+	{
+		return 1;
+	}
+
 	printf("Page fault for %p.  Heap from %p to %p\n",
 		cr2_value, (void*)&_kernel_heap_start, (void*)&_kernel_heap_end);
 
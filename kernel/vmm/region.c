@@ -0,0 +1,144 @@
+/*	kernel/vmm/region.c
+
+	Region (bump) allocator.  A region is a list of chunks, newest
+	first.  region_alloc() just moves the current chunk's 'used' offset
+	up, and kmalloc()s a new chunk when the current one is full.
+	Nothing is freed on its own: region_rollback() drops everything
+	after a mark, and region_free() drops everything.
+
+	Regions have no lock.  Each one belongs to whoever set it up.
+*/
+
+#include "kernel/kernel.h"
+
+#define CHUNK_DATA(c)	((uint8*)((c) + 1))
+
+void	region_init(struct region *r, uint32 chunk_bytes, uint32 flags)
+{
+	r->chunk = NULL;
+	r->chunk_bytes = ROUND_UP(chunk_bytes, HEAP_ALLOC_GRANULARITY);
+	r->flags = flags;
+}
+
+void	region_init_buf(struct region *r, void *buf, uint32 bytes, uint32 chunk_bytes, uint32 flags)
+{
+	struct region_chunk	*c = (struct region_chunk*)ROUND_UP((uint32)buf, HEAP_ALLOC_GRANULARITY);
+	uint8	*end = (uint8*)buf + bytes;
+
+	ASSERT((uint8*)(c + 1) <= end);
+
+	region_init(r, chunk_bytes, flags);
+
+	c->next = NULL;
+	c->size = (uint32)(end - CHUNK_DATA(c)) & ~(HEAP_ALLOC_GRANULARITY - 1);
+	c->used = 0;
+	c->flags = REGION_CHUNK_STATIC;
+	r->chunk = c;
+}
+
+// Pushes a new chunk, big enough for 'bytes'.
+static struct region_chunk*	region_new_chunk(struct region *r, uint32 bytes)
+{
+	struct region_chunk	*c = NULL;
+	uint32	size = max(bytes, r->chunk_bytes);
+
+	if (NULL == (c = (struct region_chunk*)kmalloc(sizeof(struct region_chunk) + size, r->flags)))
+	{
+		return NULL;
+	}
+
+	c->next = r->chunk;
+	c->size = size;
+	c->used = 0;
+	c->flags = 0;
+	r->chunk = c;
+
+	return c;
+}
+
+void*	region_alloc(struct region *r, uint32 bytes)
+{
+	struct region_chunk	*c = r->chunk;
+	void	*p = NULL;
+
+	bytes = ROUND_UP(max(bytes, 1), HEAP_ALLOC_GRANULARITY);
+
+	if (!c || (c->size - c->used < bytes))
+	{
+		if (NULL == (c = region_new_chunk(r, bytes)))
+		{
+			return NULL;
+		}
+	}
+
+	p = CHUNK_DATA(c) + c->used;
+	c->used += bytes;
+
+	return p;
+}
+
+char*	region_strndup(struct region *r, const char *str, uint32 len)
+{
+	char	*p = NULL;
+
+	if (NULL != (p = (char*)region_alloc(r, len + 1)))
+	{
+		memcpy(p, str, len);
+		p[len] = 0;
+	}
+
+	return p;
+}
+
+char*	region_strdup(struct region *r, const char *str)
+{
+	return region_strndup(r, str, strlen(str));
+}
+
+void	region_mark(const struct region *r, struct region_mark *m)
+{
+	m->chunk = r->chunk;
+	m->used = r->chunk ? r->chunk->used : 0;
+}
+
+void	region_rollback(struct region *r, const struct region_mark *m)
+{
+	struct region_chunk	*c = NULL;
+
+	while (r->chunk != m->chunk)
+	{
+		c = r->chunk;
+
+		if (!c || (c->flags & REGION_CHUNK_STATIC))
+		{
+			PANIC3("region_rollback(%p): mark %p is not in this region.\n", r, m);
+		}
+
+		r->chunk = c->next;
+		kfree(c);
+	}
+
+	if (r->chunk)
+	{
+		ASSERT(m->used <= r->chunk->used);
+		r->chunk->used = m->used;
+	}
+}
+
+void	region_free(struct region *r)
+{
+	struct region_chunk	*c = NULL;
+
+	while (NULL != (c = r->chunk))
+	{
+// The caller's buffer is always the oldest chunk.  Keep it for next time.
+		if (c->flags & REGION_CHUNK_STATIC)
+		{
+			c->used = 0;
+			break;
+		}
+
+		r->chunk = c->next;
+		kfree(c);
+	}
+}
@@ -0,0 +1,57 @@
+/*	kernel/vmm/region.h
+
+	Region (bump) allocator, for scratch memory that is thrown away all
+	at once (path walking, one request's worth of driver work), or for
+	small allocations that are never freed (boot time setup).
+*/
+
+#ifndef __REGION_H__
+#define __REGION_H__
+
+// A chunk of memory that a region hands out from.  The data follows the header.
+struct region_chunk
+{
+	struct region_chunk	*next;		// Older chunk.
+	uint32			size;		// Bytes of data after the header.
+	uint32			used;
+	uint32			flags;		// REGION_CHUNK_xxx
+};
+
+// Chunk is the caller's buffer (see region_init_buf()), never kfree()d.
+#define REGION_CHUNK_STATIC	0x00000001
+
+struct region
+{
+	struct region_chunk	*chunk;		// Current chunk (newest first).
+	uint32			chunk_bytes;	// Size of each new chunk.
+	uint32			flags;		// Passed to kmalloc() for new chunks.
+};
+
+// A position in a region, for region_rollback().
+struct region_mark
+{
+	struct region_chunk	*chunk;
+	uint32			used;
+};
+
+// Chunks of 'chunk_bytes' are kmalloc()ed with 'flags' (HEAP_FAILOK, HEAP_VFS, ...) as needed.
+void	region_init(struct region *r, uint32 chunk_bytes, uint32 flags);
+
+// As region_init(), but hands out 'buf' (eg, on the stack) first.
+void	region_init_buf(struct region *r, void *buf, uint32 bytes, uint32 chunk_bytes, uint32 flags);
+
+// Returns HEAP_ALLOC_GRANULARITY aligned memory.  NULL only if the region has HEAP_FAILOK.
+void*	region_alloc(struct region *r, uint32 bytes);
+
+char*	region_strndup(struct region *r, const char *str, uint32 len);
+char*	region_strdup(struct region *r, const char *str);
+
+void	region_mark(const struct region *r, struct region_mark *m);
+
+// Frees everything allocated since region_mark() set 'm'.
+void	region_rollback(struct region *r, const struct region_mark *m);
+
+// Frees everything in the region.  It can be used again afterwards.
+void	region_free(struct region *r);
+
+#endif	// __REGION_H__
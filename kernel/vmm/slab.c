@@ -0,0 +1,516 @@
+/*	kernel/vmm/slab.c
+
+	Implements object caches (kmem_cache_xxx) for fixed-size kernel
+	structures.  Allocating from a warm cache is a pop from the free
+	index stack of the first partial slab, freeing is a push.  Neither
+	one touches the general purpose heap.
+
+	Slabs are 1..SLAB_MAX_PAGES pages, aligned to their own size, so
+	that the slab header of any object can be found by masking the
+	object's address.  Slab pages live in their own virtual range
+	(_kernel_slab_start to _kernel_slab_end), tracked with a bitmap.
+*/
+
+#include "kernel/kernel.h"
+
+// Max number of pages in the slab region that we can track.
+#define SLAB_REGION_PAGES	4096
+
+static uint32		slab_vbitmap[SLAB_REGION_PAGES / 32];
+static uint32		slab_region_pages = 0;
+static spinlock		slab_vm_lock = INIT_SPINLOCK("slab_vm");
+
+static struct kmem_cache	*cache_list = NULL;
+static spinlock		cache_list_lock = INIT_SPINLOCK("cache_list");
+
+static inline int	slab_vbit_test(uint32 page)
+{
+	return slab_vbitmap[page / 32] & (1 << (page % 32));
+}
+
+static inline void	slab_vbit_set(uint32 page)
+{
+	slab_vbitmap[page / 32] |= (1 << (page % 32));
+}
+
+static inline void	slab_vbit_clear(uint32 page)
+{
+	slab_vbitmap[page / 32] &= ~(1 << (page % 32));
+}
+
+// Finds 'count' free virtual pages in the slab region, aligned to 'count' pages,
+// and maps fresh physical pages at them.  Returns NULL if the region is full.
+static void*	slab_get_pages(uint32 count)
+{
+	uint32	page = 0;
+	uint32	i = 0;
+	void	*virt = NULL;
+
+	spinlock_acquire(&slab_vm_lock);
+
+	for (page = 0; page + count <= slab_region_pages; page += count)
+	{
+		for (i = 0; (i < count) && !slab_vbit_test(page + i); i++);
+
+		if (i == count)
+		{
+			break;
+		}
+	}
+
+	if (page + count > slab_region_pages)
+	{
+		spinlock_release(&slab_vm_lock);
+		return NULL;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		slab_vbit_set(page + i);
+	}
+
+	spinlock_release(&slab_vm_lock);
+
+	virt = (void*)((uint32)&_kernel_slab_start + page * PAGE_SIZE);
+	vmm_map_pages(virt, 0, count, PTE_KDATA);
+
+	return virt;
+}
+
+static void	slab_put_pages(void *virt, uint32 count)
+{
+	uint32	page = ((uint32)virt - (uint32)&_kernel_slab_start) / PAGE_SIZE;
+	uint32	i = 0;
+
+	vmm_free_pages(virt, count);
+
+	spinlock_acquire(&slab_vm_lock);
+
+	for (i = 0; i < count; i++)
+	{
+		ASSERT(slab_vbit_test(page + i));
+		slab_vbit_clear(page + i);
+	}
+
+	spinlock_release(&slab_vm_lock);
+}
+
+// Slab lists are doubly linked and NULL terminated.
+static inline void	slab_list_add(struct slab **head, struct slab *slab)
+{
+	slab->prev = NULL;
+	slab->next = *head;
+
+	if (*head)
+	{
+		(*head)->prev = slab;
+	}
+
+	*head = slab;
+}
+
+static inline void	slab_list_del(struct slab **head, struct slab *slab)
+{
+	if (slab->prev)
+	{
+		slab->prev->next = slab->next;
+	}
+	else
+	{
+		ASSERT(*head == slab);
+		*head = slab->next;
+	}
+
+	if (slab->next)
+	{
+		slab->next->prev = slab->prev;
+	}
+
+	slab->next = slab->prev = NULL;
+}
+
+static inline void*	slab_obj_ptr(const struct kmem_cache *cache, const struct slab *slab, uint32 idx)
+{
+	return slab->objects + idx * cache->obj_size;
+}
+
+// Given an object pointer, return the slab header that it lives in.
+static inline struct slab*	slab_of(const struct kmem_cache *cache, const void *obj)
+{
+	return (struct slab*)((uint32)obj & ~(cache->slab_pages * PAGE_SIZE - 1));
+}
+
+// Returns how many bytes of slab header (header + free index stack) we need for 'count' objects.
+static inline uint32	slab_hdr_bytes(uint32 count, uint32 align)
+{
+	return ROUND_UP(sizeof(struct slab) + count * sizeof(uint16), align);
+}
+
+// Allocates and maps a new slab, and constructs all of its objects.
+// Called with the cache lock held.
+static struct slab*	slab_grow(struct kmem_cache *cache)
+{
+	struct slab	*slab = NULL;
+	uint32		i = 0;
+
+	if (NULL == (slab = (struct slab*)slab_get_pages(cache->slab_pages)))
+	{
+		return NULL;
+	}
+
+	slab->magic = SLAB_MAGIC;
+	slab->cache = cache;
+	slab->next = slab->prev = NULL;
+	slab->objects = (uint8*)slab + slab_hdr_bytes(cache->objs_per_slab, cache->align);
+	slab->inuse = 0;
+	slab->free_top = cache->objs_per_slab;
+
+// Free stack is filled in reverse, so that objects are handed out in address order.
+	for (i = 0; i < cache->objs_per_slab; i++)
+	{
+		slab->free_idx[i] = cache->objs_per_slab - 1 - i;
+
+		if (cache->ctor)
+		{
+			cache->ctor(slab_obj_ptr(cache, slab, i));
+		}
+	}
+
+	cache->nr_slabs++;
+
+	return slab;
+}
+
+// Unmaps an empty slab.  Called with the cache lock held.
+static void	slab_release(struct kmem_cache *cache, struct slab *slab)
+{
+	ASSERT(!slab->inuse);
+
+	slab->magic = 0;
+	cache->nr_slabs--;
+	slab_put_pages(slab, cache->slab_pages);
+}
+
+struct kmem_cache*	kmem_cache_create(const char *name, uint32 size, uint32 align, kmem_ctor_t ctor)
+{
+	struct kmem_cache	*cache = NULL;
+	uint32			pages = 1;
+	uint32			count = 0;
+
+	ASSERT(name);
+	ASSERT(size);
+
+	if (!align)
+	{
+		align = HEAP_ALLOC_GRANULARITY;
+	}
+
+	if (align & (align - 1))
+	{
+		PANIC3("kmem_cache_create(%s): alignment %d is not a power of 2.\n", name, align);
+	}
+
+	size = ROUND_UP(size, align);
+
+// Pick the smallest slab that holds SLAB_MIN_OBJECTS objects, or the biggest slab we allow.
+	for (pages = 1; pages < SLAB_MAX_PAGES; pages <<= 1)
+	{
+		if (slab_hdr_bytes(SLAB_MIN_OBJECTS, align) + SLAB_MIN_OBJECTS * size <= pages * PAGE_SIZE)
+		{
+			break;
+		}
+	}
+
+	count = (pages * PAGE_SIZE - sizeof(struct slab)) / (size + sizeof(uint16));
+	while (count && (slab_hdr_bytes(count, align) + count * size > pages * PAGE_SIZE))
+	{
+		count--;
+	}
+
+	if (!count)
+	{
+		PANIC3("kmem_cache_create(%s): object size %d is too large.\n", name, size);
+	}
+
+	if (NULL == (cache = (struct kmem_cache*)kmalloc(sizeof(struct kmem_cache), HEAP_FAILOK)))
+	{
+		return NULL;
+	}
+
+	memset(cache, 0, sizeof(*cache));
+	cache->name = name;
+	cache->obj_size = size;
+	cache->align = align;
+	cache->slab_pages = pages;
+	cache->objs_per_slab = count;
+	cache->ctor = ctor;
+	spinlock_init(&cache->lock, name);
+
+	spinlock_acquire(&cache_list_lock);
+	cache->next = cache_list;
+	cache_list = cache;
+	spinlock_release(&cache_list_lock);
+
+#if (DEBUG_SLAB)
+	kdebug(DEBUG_DEBUG, FAC_HEAP, "slab: cache '%s': size %d, %d pages/slab, %d objs/slab\n", name, size, pages, count);
+#endif
+
+	return cache;
+}
+
+void	kmem_cache_destroy(struct kmem_cache *cache)
+{
+	struct kmem_cache	**pp = NULL;
+
+	ASSERT(cache);
+
+	spinlock_acquire(&cache->lock);
+
+	if (cache->partial || cache->full)
+	{
+		PANIC3("kmem_cache_destroy(%s): %d objects still allocated.\n", cache->name, cache->nr_active);
+	}
+
+	while (cache->empty)
+	{
+		struct slab *slab = cache->empty;
+		slab_list_del(&cache->empty, slab);
+		slab_release(cache, slab);
+	}
+
+	spinlock_release(&cache->lock);
+
+	spinlock_acquire(&cache_list_lock);
+
+	for (pp = &cache_list; *pp && (*pp != cache); pp = &(*pp)->next);
+	ASSERT(*pp);
+	*pp = cache->next;
+
+	spinlock_release(&cache_list_lock);
+
+	kfree(cache);
+}
+
+void*	kmem_cache_alloc(struct kmem_cache *cache, uint32 flags)
+{
+	struct slab	*slab = NULL;
+	void		*obj = NULL;
+
+	ASSERT(cache);
+
+	spinlock_acquire(&cache->lock);
+
+	if (NULL == (slab = cache->partial))
+	{
+		if (NULL != (slab = cache->empty))
+		{
+			slab_list_del(&cache->empty, slab);
+			cache->nr_empty--;
+		}
+		else if (NULL == (slab = slab_grow(cache)))
+		{
+			spinlock_release(&cache->lock);
+
+			if (flags & HEAP_FAILOK)
+			{
+				kdebug(DEBUG_WARN, FAC_HEAP, "slab: cache '%s' failed to grow.  Returning NULL\n", cache->name);
+				return NULL;
+			}
+
+			PANIC2("slab: cache '%s' failed to grow.", cache->name);
+		}
+
+		slab_list_add(&cache->partial, slab);
+	}
+
+	ASSERT(slab->free_top);
+
+	obj = slab_obj_ptr(cache, slab, slab->free_idx[--slab->free_top]);
+	slab->inuse++;
+
+	if (!slab->free_top)
+	{
+		slab_list_del(&cache->partial, slab);
+		slab_list_add(&cache->full, slab);
+	}
+
+	cache->nr_active++;
+	cache->total_allocs++;
+
+	spinlock_release(&cache->lock);
+
+	return obj;
+}
+
+void	kmem_cache_free(struct kmem_cache *cache, void *obj)
+{
+	struct slab	*slab = NULL;
+	uint32		idx = 0;
+
+	ASSERT(cache);
+
+	if (!is_slab_ptr(obj))
+	{
+		PANIC3("kmem_cache_free(%s, %p): not a slab pointer!\n", cache->name, obj);
+	}
+
+	slab = slab_of(cache, obj);
+
+	if ((slab->magic != SLAB_MAGIC) || (slab->cache != cache))
+	{
+		PANIC3("kmem_cache_free(%s, %p): object is not from this cache!\n", cache->name, obj);
+	}
+
+	idx = ((uint8*)obj - slab->objects) / cache->obj_size;
+
+	if (((uint8*)obj < slab->objects) || (slab_obj_ptr(cache, slab, idx) != obj) || (idx >= cache->objs_per_slab))
+	{
+		PANIC3("kmem_cache_free(%s, %p): bad object pointer!\n", cache->name, obj);
+	}
+
+	spinlock_acquire(&cache->lock);
+
+#if (DEBUG_SLAB)
+	{
+		uint32	i;
+
+		for (i = 0; i < slab->free_top; i++)
+		{
+			if (slab->free_idx[i] == idx)
+			{
+				PANIC3("kmem_cache_free(%s, %p): double free!\n", cache->name, obj);
+			}
+		}
+	}
+#endif
+
+	ASSERT(slab->inuse);
+
+	if (!slab->free_top)
+	{
+		slab_list_del(&cache->full, slab);
+		slab_list_add(&cache->partial, slab);
+	}
+
+	slab->free_idx[slab->free_top++] = idx;
+	slab->inuse--;
+	cache->nr_active--;
+
+	if (!slab->inuse)
+	{
+		slab_list_del(&cache->partial, slab);
+
+		if (cache->nr_empty < SLAB_MAX_EMPTY)
+		{
+			slab_list_add(&cache->empty, slab);
+			cache->nr_empty++;
+		}
+		else
+		{
+			slab_release(cache, slab);
+		}
+	}
+
+	spinlock_release(&cache->lock);
+}
+
+uint32	kmem_cache_shrink(struct kmem_cache *cache)
+{
+	uint32	pages = 0;
+
+	spinlock_acquire(&cache->lock);
+
+	while (cache->empty)
+	{
+		struct slab *slab = cache->empty;
+		slab_list_del(&cache->empty, slab);
+		slab_release(cache, slab);
+		pages += cache->slab_pages;
+	}
+
+	cache->nr_empty = 0;
+
+	spinlock_release(&cache->lock);
+
+	return pages;
+}
+
+void	slab_dump(void)
+{
+	struct kmem_cache	*cache = NULL;
+
+	spinlock_acquire(&cache_list_lock);
+
+	for (cache = cache_list; cache; cache = cache->next)
+	{
+		printf("slab: %-12s size:%4d slabs:%4d (%d pg) active:%5d allocs:%d\n",
+			cache->name, cache->obj_size, cache->nr_slabs, cache->slab_pages,
+			cache->nr_active, cache->total_allocs);
+	}
+
+	spinlock_release(&cache_list_lock);
+}
+
+static int	test_ctor_count = 0;
+
+static void	test_slab_ctor(void *obj)
+{
+	*(uint32*)obj = 0x600dc0de;
+	test_ctor_count++;
+}
+
+// Test: objects come back constructed, freed objects are re-used LIFO,
+// and the cache grows past one slab and shrinks back to nothing.
+void	test_slab(void)
+{
+#define		TEST_SLAB_COUNT	100
+	struct kmem_cache	*cache = NULL;
+	void			*array[TEST_SLAB_COUNT];
+	void			*obj = NULL;
+	int			i;
+
+	cache = kmem_cache_create("slab_test", 120, 0, test_slab_ctor);
+
+	for (i = 0; i < TEST_SLAB_COUNT; i++)
+	{
+		array[i] = kmem_cache_alloc(cache, 0);
+		ASSERT(*(uint32*)array[i] == 0x600dc0de);
+	}
+
+	ASSERT(cache->nr_active == TEST_SLAB_COUNT);
+	ASSERT(cache->nr_slabs > 1);
+	ASSERT(test_ctor_count == cache->nr_slabs * cache->objs_per_slab);
+
+	kmem_cache_free(cache, array[17]);
+	obj = kmem_cache_alloc(cache, 0);
+	ASSERT(obj == array[17]);
+
+	for (i = 0; i < TEST_SLAB_COUNT; i++)
+	{
+		kmem_cache_free(cache, array[i]);
+	}
+
+	ASSERT(cache->nr_active == 0);
+	ASSERT(!cache->partial && !cache->full);
+
+	kmem_cache_shrink(cache);
+	ASSERT(cache->nr_slabs == 0);
+
+	kmem_cache_destroy(cache);
+}
+
+void	slab_init(void)
+{
+	slab_region_pages = ((uint32)&_kernel_slab_end - (uint32)&_kernel_slab_start) / PAGE_SIZE;
+
+	if (slab_region_pages > SLAB_REGION_PAGES)
+	{
+		PANIC3("slab: region has %d pages, can only track %d\n", slab_region_pages, SLAB_REGION_PAGES);
+	}
+
+	memset(slab_vbitmap, 0, sizeof(slab_vbitmap));
+
+	printf("slab: %d K available.\n", slab_region_pages * PAGE_SIZE / 1024);
+
+	test_slab();
+}
@@ -0,0 +1,85 @@
+/*	kernel/vmm/slab.h
+
+	Object caches for fixed-size kernel structures (tasks, wait nodes,
+	handles, vnodes, dentries).  Each cache hands out objects from
+	"slabs", which are runs of pages mapped into the slab region
+	(see "kernel-elf.lds").
+*/
+
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+// Stored in every slab header, to catch frees of pointers that were
+// never handed out by a cache.
+#define SLAB_MAGIC		0x51ab51ab
+
+// Largest slab that a cache will use (in pages).  MUST be a power of 2.
+#define SLAB_MAX_PAGES		8
+
+// A cache will try to fit at least this many objects into each slab.
+#define SLAB_MIN_OBJECTS	8
+
+typedef void (*kmem_ctor_t)(void *obj);
+
+// This structure appears at the beginning of every slab.  It is followed
+// by an array of free object indicies (used as a stack), then the objects.
+struct slab
+{
+	uint32			magic;		// SLAB_MAGIC.
+	struct kmem_cache	*cache;		// Cache that owns this slab.
+	struct slab		*next;		// Next slab on the same cache list.
+	struct slab		*prev;
+	uint8			*objects;	// First object in this slab.
+	uint32			inuse;		// # of objects handed out.
+	uint32			free_top;	// # of valid entries in "free_idx".
+	uint16			free_idx[];	// Stack of free object indicies.
+};
+
+struct kmem_cache
+{
+	const char		*name;		// In .rodata, for debugging.
+	uint32			obj_size;	// Rounded up to "align".
+	uint32			align;
+	uint32			slab_pages;	// Pages per slab.
+	uint32			objs_per_slab;
+	kmem_ctor_t		ctor;		// Optional, run once per object when a slab is built.
+
+	struct slab		*partial;	// Slabs with some free objects.
+	struct slab		*full;		// Slabs with no free objects.
+	struct slab		*empty;		// Slabs with no allocated objects.
+	uint32			nr_empty;
+
+	uint32			nr_slabs;	// Stats.
+	uint32			nr_active;
+	uint32			total_allocs;
+
+	spinlock		lock;
+	struct kmem_cache	*next;		// Global list of caches.
+};
+
+void	slab_init(void);
+
+// Creates a new object cache.  "align" may be zero (defaults to HEAP_ALLOC_GRANULARITY).
+struct kmem_cache*	kmem_cache_create(const char *name, uint32 size, uint32 align, kmem_ctor_t ctor);
+
+// Destroys a cache.  Panics if any objects are still allocated.
+void	kmem_cache_destroy(struct kmem_cache *cache);
+
+// Returns a constructed object.  'flags' takes the same HEAP_xxx flags as kmalloc().
+void*	kmem_cache_alloc(struct kmem_cache *cache, uint32 flags);
+
+// Returns an object to its cache.  Object must be in its constructed state.
+void	kmem_cache_free(struct kmem_cache *cache, void *obj);
+
+// Releases all empty slabs held by the cache.  Returns # of pages released.
+uint32	kmem_cache_shrink(struct kmem_cache *cache);
+
+// Diagnostic function.
+void	slab_dump(void);
+
+static inline int is_slab_ptr(const void *x)
+{
+	return (x >= (const void*)&_kernel_slab_start) && (x < (const void*)&_kernel_slab_end);
+}
+
+#endif	// __SLAB_H__
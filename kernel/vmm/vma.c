@@ -0,0 +1,516 @@
+/*	kernel/vmm/vma.c
+
+	Virtual memory areas and demand paging.  Each address space keeps
+	its areas in an AVL tree keyed by start address, so the page-fault
+	handler can find the area for a faulting address in O(log n).
+
+	Creating an area maps nothing.  The first touch of a page faults,
+	vma_fault() finds the area and populates the page from its backing:
+		VMA_ANON	one zeroed page.
+		VMA_PHYS	the rest of the area within the faulting 4M
+				slot, so whole 4M runs still get a 4M page.
+		VMA_FILE	one page, copied from the page cache.
+*/
+
+#include "kernel/kernel.h"
+
+struct vm_space			kernel_vm_space = { NULL, 0, 0, INIT_SPINLOCK("kernel_vm") };
+static struct kmem_cache	*vma_cache = NULL;
+
+static inline int	vma_height(struct vma *v)
+{
+	return v ? v->height : 0;
+}
+
+static inline void	vma_fix_height(struct vma *v)
+{
+	v->height = 1 + max(vma_height(v->left), vma_height(v->right));
+}
+
+static struct vma*	vma_rotate_right(struct vma *v)
+{
+	struct vma	*l = v->left;
+
+	v->left = l->right;
+	l->right = v;
+	vma_fix_height(v);
+	vma_fix_height(l);
+
+	return l;
+}
+
+static struct vma*	vma_rotate_left(struct vma *v)
+{
+	struct vma	*r = v->right;
+
+	v->right = r->left;
+	r->left = v;
+	vma_fix_height(v);
+	vma_fix_height(r);
+
+	return r;
+}
+
+// Restores the AVL property at 'v' after one of its subtrees changed height by one.
+// Returns the new root of the subtree.
+static struct vma*	vma_balance(struct vma *v)
+{
+	int	bal = 0;
+
+	vma_fix_height(v);
+	bal = vma_height(v->left) - vma_height(v->right);
+
+	if (bal > 1)
+	{
+		if (vma_height(v->left->left) < vma_height(v->left->right))
+		{
+			v->left = vma_rotate_left(v->left);
+		}
+
+		return vma_rotate_right(v);
+	}
+
+	if (bal < -1)
+	{
+		if (vma_height(v->right->right) < vma_height(v->right->left))
+		{
+			v->right = vma_rotate_right(v->right);
+		}
+
+		return vma_rotate_left(v);
+	}
+
+	return v;
+}
+
+static struct vma*	__vma_insert(struct vma *root, struct vma *v)
+{
+	if (!root)
+	{
+		v->left = v->right = NULL;
+		v->height = 1;
+		return v;
+	}
+
+	if (v->start < root->start)
+	{
+		root->left = __vma_insert(root->left, v);
+	}
+	else
+	{
+		root->right = __vma_insert(root->right, v);
+	}
+
+	return vma_balance(root);
+}
+
+// Unlinks the leftmost node of 'root' into '*min'.
+static struct vma*	__vma_remove_min(struct vma *root, struct vma **min)
+{
+	if (!root->left)
+	{
+		*min = root;
+		return root->right;
+	}
+
+	root->left = __vma_remove_min(root->left, min);
+
+	return vma_balance(root);
+}
+
+static struct vma*	__vma_remove(struct vma *root, struct vma *v)
+{
+	struct vma	*min = NULL;
+
+	ASSERT(root);
+
+	if (v->start < root->start)
+	{
+		root->left = __vma_remove(root->left, v);
+	}
+	else if (v->start > root->start)
+	{
+		root->right = __vma_remove(root->right, v);
+	}
+	else
+	{
+		if (!root->left || !root->right)
+		{
+			return root->left ? root->left : root->right;
+		}
+
+		root->right = __vma_remove_min(root->right, &min);
+		min->left = root->left;
+		min->right = root->right;
+		root = min;
+	}
+
+	return vma_balance(root);
+}
+
+// Returns the first area that intersects [start, end), or NULL.  Caller holds the lock.
+static struct vma*	__vma_find_range(struct vm_space *vs, uint32 start, uint32 end)
+{
+	struct vma	*v = vs->root;
+
+	while (v)
+	{
+		if (end <= v->start)
+		{
+			v = v->left;
+		}
+		else if (start >= v->end)
+		{
+			v = v->right;
+		}
+		else
+		{
+			return v;
+		}
+	}
+
+	return NULL;
+}
+
+// Allocates and links a copy of 'tmpl'.  Returns NULL if it overlaps an existing area.
+// The copy is complete before it is linked, so the fault handler never sees half of it.
+static struct vma*	vma_insert(struct vm_space *vs, const struct vma *tmpl)
+{
+	struct vma	*v = NULL;
+
+	if (!IS_PAGE_ALIGNED(tmpl->start) || (tmpl->end <= tmpl->start))
+	{
+		PANIC3("vma: bad range %p - %p\n", tmpl->start, tmpl->end);
+	}
+
+	if ((tmpl->flags & ~PTE_ALL_FLAGS) || !(tmpl->flags & PTE_PRESENT))
+	{
+		PANIC2("vma: illegal flags: %b\n", tmpl->flags);
+	}
+
+	v = (struct vma*)kmem_cache_alloc(vma_cache, 0);
+	*v = *tmpl;
+
+	spinlock_acquire(&vs->lock);
+
+	if (__vma_find_range(vs, v->start, v->end))
+	{
+		spinlock_release(&vs->lock);
+		kmem_cache_free(vma_cache, v);
+		return NULL;
+	}
+
+	vs->root = __vma_insert(vs->root, v);
+	vs->count++;
+
+	spinlock_release(&vs->lock);
+
+	return v;
+}
+
+// Fills in the fields every kind of area has.
+static inline void	vma_template(struct vma *tmpl, void *start, uint32 pages, uint32 flags,
+				uint32 backing, const char *name)
+{
+	memset(tmpl, 0, sizeof(*tmpl));
+	tmpl->start = (uint32)start;
+	tmpl->end = (uint32)start + pages * PAGE_SIZE;
+	tmpl->flags = flags;
+	tmpl->backing = backing;
+	tmpl->name = name;
+}
+
+struct vma*	vma_map_anon(struct vm_space *vs, void *start, uint32 pages, uint32 flags, const char *name)
+{
+	struct vma	tmpl;
+
+	vma_template(&tmpl, start, pages, flags, VMA_ANON, name);
+
+	return vma_insert(vs, &tmpl);
+}
+
+struct vma*	vma_map_phys(struct vm_space *vs, void *start, paddr_t phys, uint32 pages, uint32 flags, const char *name)
+{
+	struct vma	tmpl;
+
+	if (phys & ~PAGE_MASK)
+	{
+		PANIC2("vma: physical address, %p, is not page aligned.\n", (uint32)phys);
+	}
+
+	vma_template(&tmpl, start, pages, flags, VMA_PHYS, name);
+	tmpl.phys = phys;
+
+	return vma_insert(vs, &tmpl);
+}
+
+struct vma*	vma_map_file(struct vm_space *vs, void *start, struct vnode *vn, off64_t offset,
+			uint32 pages, uint32 flags, const char *name)
+{
+	struct vma	tmpl;
+	struct vma	*v = NULL;
+
+	ASSERT(vn && vn->vnode_ops && vn->vnode_ops->read);
+
+	if (offset & ~PAGE_MASK)
+	{
+		PANIC1("vma: file offset is not page aligned.\n");
+	}
+
+	vma_template(&tmpl, start, pages, flags, VMA_FILE, name);
+	tmpl.vnode = vn;
+	tmpl.offset = offset;
+
+	spinlock_acquire(&vn->v_lock);
+	vn->ref_count++;
+	spinlock_release(&vn->v_lock);
+
+	if (!(v = vma_insert(vs, &tmpl)))
+	{
+		spinlock_acquire(&vn->v_lock);
+		vn->ref_count--;
+		spinlock_release(&vn->v_lock);
+	}
+
+	return v;
+}
+
+struct vma*	vma_find(struct vm_space *vs, const void *addr)
+{
+	struct vma	*v = NULL;
+
+	spinlock_acquire(&vs->lock);
+	v = __vma_find_range(vs, (uint32)addr, (uint32)addr + 1);
+	spinlock_release(&vs->lock);
+
+	return v;
+}
+
+// Peeks at the page tables without splitting 4M pages.
+static int	vma_page_mapped(uint32 addr)
+{
+	uint32	pde_slot = ADDR_TO_PDE_SLOT(addr);
+	pte_t	pde = gp_kernel_page_dir[pde_slot];
+
+	if (!(pde & PTE_PRESENT))
+	{
+		return 0;
+	}
+
+	if (PDE_IS_4M(pde))
+	{
+		return 1;
+	}
+
+	return (PTBL_VIRT(pde_slot)[ADDR_TO_PTE_SLOT(addr)] & PTE_PRESENT) ? 1 : 0;
+}
+
+void	vma_unmap(struct vm_space *vs, void *start)
+{
+	struct vma	*v = NULL;
+	uint32		addr = 0;
+	uint32		run = 0;
+
+	spinlock_acquire(&vs->lock);
+
+	v = __vma_find_range(vs, (uint32)start, (uint32)start + 1);
+	if (!v || (v->start != (uint32)start))
+	{
+		PANIC2("vma_unmap: no area starts at %p\n", start);
+	}
+
+	vs->root = __vma_remove(vs->root, v);
+	vs->count--;
+
+	spinlock_release(&vs->lock);
+
+// Only what was touched is mapped.  Release it in runs, skipping empty page tables whole.
+	for (addr = v->start; addr < v->end; )
+	{
+		if (!(gp_kernel_page_dir[ADDR_TO_PDE_SLOT(addr)] & PTE_PRESENT))
+		{
+			addr = min((addr & PDIR_MASK) + PDIR_SIZE, v->end);
+			continue;
+		}
+
+		for (run = 0; (addr + run * PAGE_SIZE < v->end) && vma_page_mapped(addr + run * PAGE_SIZE); run++);
+
+		if (run)
+		{
+			if (v->backing == VMA_PHYS)
+			{
+				vmm_unmap_pages((void*)addr, run);
+			}
+			else
+			{
+				vmm_free_pages((void*)addr, run);
+			}
+		}
+
+		addr += (run + 1) * PAGE_SIZE;
+	}
+
+	if (v->vnode)
+	{
+		spinlock_acquire(&v->vnode->v_lock);
+		v->vnode->ref_count--;
+		spinlock_release(&v->vnode->v_lock);
+	}
+
+	kmem_cache_free(vma_cache, v);
+}
+
+// Maps one page of a file area, read through the vnode.  Returns 0 on a read error.
+static int	vma_fault_file(const struct vma *v, uint32 page)
+{
+	uint32	pfn = 0;
+	uint8	*virt = NULL;
+	ssize_t	got = 0;
+
+// Fill the frame before it is mapped, so the page never shows its contents with
+// the wrong protection.  The read may sleep, so the frame comes from the direct
+// map rather than through kmap_atomic().
+	while (!(pfn = pmm_alloc_contig(1, 0, g_direct_map_limit - 1)))
+	{
+		if (!pagecache_shrink(1))
+		{
+			printf("vma: no direct mapped frame for '%s' at %p\n", v->name, page);
+			return 0;
+		}
+	}
+
+	virt = (uint8*)phys_to_virt(PFN_TO_PHYS(pfn));
+	got = vfs_read(v->vnode, virt, PAGE_SIZE, v->offset + (page - v->start));
+	if (got < 0)
+	{
+		printf("vma: read of '%s' at %p failed: %d\n", v->name, page, (int)got);
+		pmm_free_contig(pfn, 1);
+		return 0;
+	}
+
+// A short read leaves the tail of the page empty.
+	memset(virt + got, 0, PAGE_SIZE - got);
+
+// Someone else may have beaten us to it.
+	if (!vmm_map_pages((void*)page, PFN_TO_PHYS(pfn), 1, v->flags | VMM_PHYS_REAL | VMM_SKIP_MAPPED))
+	{
+		pmm_free_contig(pfn, 1);
+	}
+
+	return 1;
+}
+
+int	vma_fault(struct regs *r, void *addr)
+{
+	struct vm_space	*vs = &kernel_vm_space;
+	struct vma	*v = NULL;
+	struct vma	area;
+	uint32		page = (uint32)addr & PAGE_MASK;
+	uint32		start = 0;
+	uint32		end = 0;
+
+// Take a copy, so the lock is not held while we allocate (or read from a file).
+	spinlock_acquire(&vs->lock);
+	if ((v = __vma_find_range(vs, page, page + 1)))
+	{
+// Only not-present faults are populated.  A protection fault on a mapped
+// page, or a write to an area without PTE_RW, is a real bug.
+		if ((r->err_code & 1) || ((r->err_code & 2) && !(v->flags & PTE_RW)))
+		{
+			v = NULL;
+		}
+		else
+		{
+			area = *v;
+			vs->faults++;
+		}
+	}
+	spinlock_release(&vs->lock);
+
+	if (!v)
+	{
+		return 0;
+	}
+
+	switch (area.backing)
+	{
+		case VMA_ANON:
+			vmm_map_pages((void*)page, 0, 1, area.flags | VMM_SKIP_MAPPED);
+			return 1;
+
+		case VMA_PHYS:
+			start = max(area.start, page & PDIR_MASK);
+			end = min(area.end, (page & PDIR_MASK) + PDIR_SIZE);
+			vmm_map_pages((void*)start, area.phys + (start - area.start),
+				(end - start) / PAGE_SIZE, area.flags | VMM_PHYS_REAL | VMM_SKIP_MAPPED);
+			return 1;
+
+		case VMA_FILE:
+			return vma_fault_file(&area, page);
+	}
+
+	PANIC2("vma: bad backing type %d\n", area.backing);
+	return 0;
+}
+
+static void	vma_dump_tree(struct vma *v)
+{
+	static const char	*backing_names[] = { "anon", "phys", "file" };
+
+	if (!v)
+	{
+		return;
+	}
+
+	vma_dump_tree(v->left);
+	kdebug(DEBUG_INFO, FAC_HEAP, "vma: %p - %p %s %x %s\n",
+		v->start, v->end, backing_names[v->backing], v->flags, v->name ? v->name : "");
+	vma_dump_tree(v->right);
+}
+
+void	vma_dump(struct vm_space *vs)
+{
+	spinlock_acquire(&vs->lock);
+	vma_dump_tree(vs->root);
+	kdebug(DEBUG_INFO, FAC_HEAP, "vma: %d areas, %d faults\n", vs->count, vs->faults);
+	spinlock_release(&vs->lock);
+}
+
+// Test: areas are found by any address inside them, overlaps are refused,
+// and only touched pages of an anonymous area are ever mapped.
+void	test_vma(void)
+{
+	struct vm_space	*vs = &kernel_vm_space;
+	uint8		*base = (uint8*)0x80000000;	// Nothing lives here.
+	uint32		count = vs->count;
+	uint32		i = 0;
+
+	for (i = 0; i < 16; i++)
+	{
+		ASSERT(vma_map_anon(vs, base + i * 4 * PAGE_SIZE, 2, PTE_KDATA, "test"));
+	}
+
+	ASSERT(vma_find(vs, base + 5 * 4 * PAGE_SIZE + PAGE_SIZE)->start == (uint32)base + 5 * 4 * PAGE_SIZE);
+	ASSERT(!vma_find(vs, base + 5 * 4 * PAGE_SIZE + 2 * PAGE_SIZE));
+	ASSERT(!vma_map_anon(vs, base + PAGE_SIZE, 2, PTE_KDATA, "test"));
+
+	base[3 * 4 * PAGE_SIZE + PAGE_SIZE + 5] = 0xaa;
+	ASSERT(!vma_page_mapped((uint32)base + 3 * 4 * PAGE_SIZE));
+	ASSERT(vma_page_mapped((uint32)base + 3 * 4 * PAGE_SIZE + PAGE_SIZE));
+	ASSERT(base[3 * 4 * PAGE_SIZE + PAGE_SIZE] == 0);
+
+	for (i = 0; i < 16; i++)
+	{
+		vma_unmap(vs, base + ((i * 7) % 16) * 4 * PAGE_SIZE);
+	}
+
+	ASSERT(!vma_page_mapped((uint32)base + 3 * 4 * PAGE_SIZE + PAGE_SIZE));
+	ASSERT((vs->count == count) && (!count || vs->root));
+}
+
+void	vma_init(void)
+{
+	vma_cache = kmem_cache_create("vma", sizeof(struct vma), 0, NULL);
+
+	test_vma();
+}
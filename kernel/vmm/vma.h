@@ -0,0 +1,71 @@
+/*	kernel/vmm/vma.h
+
+	Virtual memory areas.  A VMA reserves a range of an address space
+	and says what backs it.  Nothing is mapped when the area is created;
+	vmm_page_fault() populates pages as they are touched.
+*/
+
+#ifndef __VMA_H__
+#define __VMA_H__
+
+// What backs the pages of an area.
+enum
+{
+	VMA_ANON,	// Zeroed pages from the free pool, freed on unmap.
+	VMA_PHYS,	// A fixed physical range (devices, boot modules).
+	VMA_FILE,	// Private copies of a vnode's pages (via the page cache), freed on unmap.
+};
+
+struct vnode;
+
+struct vma
+{
+	uint32		start;		// Page aligned.
+	uint32		end;		// Exclusive.
+	uint32		flags;		// PTE_xxx flags for the pages.
+	uint32		backing;	// VMA_xxx
+	paddr_t		phys;		// VMA_PHYS: physical address of 'start'.
+	struct vnode	*vnode;		// VMA_FILE: file and byte offset of 'start'.
+	off64_t		offset;
+	const char	*name;		// Diagnostics only.
+
+// AVL tree, keyed by 'start'.
+	struct vma	*left;
+	struct vma	*right;
+	int		height;
+};
+
+// One per address space.  Areas never overlap.
+struct vm_space
+{
+	struct vma	*root;
+	uint32		count;
+	uint32		faults;		// Pages (or 4M runs) populated on demand.
+	spinlock	lock;
+};
+
+// Covers everything above _kernel_direct_map_start.  User processes will get their own.
+extern struct vm_space	kernel_vm_space;
+
+void	vma_init(void);
+
+// Reserve 'pages' pages at 'start'.  Return the new area, or NULL if the
+// range overlaps an existing one.
+struct vma*	vma_map_anon(struct vm_space *vs, void *start, uint32 pages, uint32 flags, const char *name);
+struct vma*	vma_map_phys(struct vm_space *vs, void *start, paddr_t phys, uint32 pages, uint32 flags, const char *name);
+struct vma*	vma_map_file(struct vm_space *vs, void *start, struct vnode *vn, off64_t offset,
+			uint32 pages, uint32 flags, const char *name);
+
+// Removes the area that begins at 'start' and unmaps whatever was populated.
+void	vma_unmap(struct vm_space *vs, void *start);
+
+// Returns the area containing 'addr', or NULL.
+struct vma*	vma_find(struct vm_space *vs, const void *addr);
+
+// Called by vmm_page_fault().  Returns 1 if 'addr' was in an area and is now mapped.
+int	vma_fault(struct regs *r, void *addr);
+
+// Diagnostic function.
+void	vma_dump(struct vm_space *vs);
+
+#endif	// __VMA_H__
@@ -0,0 +1,296 @@
+/*	kernel/vmm/vmalloc.c
+
+	Implements vmalloc() / vfree().  Big buffers get their own run of
+	virtual pages in the vmalloc region (_kernel_vmalloc_start to
+	_kernel_vmalloc_end), each page backed by pmm_get_page().  Every
+	range is followed by an unmapped guard page.
+
+	The region is managed as a list of free ranges, sorted by address
+	and coalesced on free.  Allocated ranges are kept on "busy_list".
+
+	vfree() does not unmap anything.  The range is parked on "lazy_list"
+	until VMALLOC_LAZY_PAGES pages have built up (or the region runs
+	out of space).  Then all of them are revoked, the TLB is flushed
+	once, and only then are the physical pages released and the
+	virtual ranges made available again.
+*/
+
+#include "kernel/kernel.h"
+
+static struct vm_range		*free_list = NULL;	// Sorted by address.
+static struct vm_range		*busy_list = NULL;
+static struct vm_range		*lazy_list = NULL;
+static uint32			lazy_pages = 0;
+static struct kmem_cache	*vm_range_cache = NULL;
+static spinlock			vmalloc_lock = INIT_SPINLOCK("vmalloc");
+
+// Carves 'pages' pages out of the first free range that is big enough.
+// Returns a range descriptor for them, or NULL.  Caller holds vmalloc_lock.
+static struct vm_range*	range_take(uint32 pages, uint32 flags)
+{
+	struct vm_range	**pp = NULL;
+	struct vm_range	*r = NULL;
+	struct vm_range	*ret = NULL;
+
+	for (pp = &free_list; *pp && ((*pp)->pages < pages); pp = &(*pp)->next);
+
+	if (NULL == (r = *pp))
+	{
+		return NULL;
+	}
+
+// Exact fit, hand out the free node itself.
+	if (r->pages == pages)
+	{
+		*pp = r->next;
+		r->next = NULL;
+		return r;
+	}
+
+	if (NULL == (ret = (struct vm_range*)kmem_cache_alloc(vm_range_cache, flags)))
+	{
+		return NULL;
+	}
+
+	ret->start = r->start;
+	ret->pages = pages;
+	ret->next = NULL;
+
+	r->start += pages * PAGE_SIZE;
+	r->pages -= pages;
+
+	return ret;
+}
+
+// Returns a range to the free list, merging with its neighbours.  Caller holds vmalloc_lock.
+static void	range_give(struct vm_range *r)
+{
+	struct vm_range	*prev = NULL;
+	struct vm_range	*next = free_list;
+
+	for (; next && (next->start < r->start); prev = next, next = next->next);
+
+	if (next && (r->start + r->pages * PAGE_SIZE == next->start))
+	{
+		r->pages += next->pages;
+		r->next = next->next;
+		kmem_cache_free(vm_range_cache, next);
+	}
+	else
+	{
+		r->next = next;
+	}
+
+	if (prev && (prev->start + prev->pages * PAGE_SIZE == r->start))
+	{
+		prev->pages += r->pages;
+		prev->next = r->next;
+		kmem_cache_free(vm_range_cache, r);
+	}
+	else if (prev)
+	{
+		prev->next = r;
+	}
+	else
+	{
+		free_list = r;
+	}
+}
+
+// Caller holds vmalloc_lock.
+static void	__vmalloc_purge(void)
+{
+	struct vm_range	*r = NULL;
+
+	if (!lazy_list)
+	{
+		return;
+	}
+
+#if (DEBUG_HEAP)
+	kdebug(DEBUG_DEBUG, FAC_HEAP, "vmalloc: purging %d lazy pages\n", lazy_pages);
+#endif
+
+	for (r = lazy_list; r; r = r->next)
+	{
+		vmm_revoke_pages((void*)r->start, r->pages - 1);
+	}
+
+	flush_tlb_all();
+
+	while (NULL != (r = lazy_list))
+	{
+		lazy_list = r->next;
+		vmm_release_pages((void*)r->start, r->pages - 1);
+		range_give(r);
+	}
+
+	lazy_pages = 0;
+}
+
+void	vmalloc_purge(void)
+{
+	spinlock_acquire(&vmalloc_lock);
+	__vmalloc_purge();
+	spinlock_release(&vmalloc_lock);
+}
+
+void*	vmalloc(uint32 bytes, uint32 flags)
+{
+	struct vm_range	*r = NULL;
+	uint32	pages = PAGE_AFTER(bytes);
+
+// Called by kmalloc() before we are set up?  Let the heap have it.
+	if (!vm_range_cache || !pages)
+	{
+		return NULL;
+	}
+
+	spinlock_acquire(&vmalloc_lock);
+
+	if (!(r = range_take(pages + 1, flags | HEAP_FAILOK)) && lazy_list)
+	{
+		__vmalloc_purge();
+		r = range_take(pages + 1, flags | HEAP_FAILOK);
+	}
+
+	if (!r)
+	{
+		spinlock_release(&vmalloc_lock);
+
+		if (flags & HEAP_FAILOK)
+		{
+			kdebug(DEBUG_WARN, FAC_HEAP, "vmalloc(%d) failed.  Returning NULL\n", bytes);
+			return NULL;
+		}
+
+		PANIC2("vmalloc(%d) failed.\n", bytes);
+	}
+
+	r->next = busy_list;
+	busy_list = r;
+
+	spinlock_release(&vmalloc_lock);
+
+// The trailing guard page stays unmapped.
+	vmm_map_pages((void*)r->start, 0, pages, PTE_KDATA);
+
+	return (void*)r->start;
+}
+
+void	vfree(void *ptr)
+{
+	struct vm_range	**pp = NULL;
+	struct vm_range	*r = NULL;
+
+	spinlock_acquire(&vmalloc_lock);
+
+	for (pp = &busy_list; *pp && ((*pp)->start != (uint32)ptr); pp = &(*pp)->next);
+
+	if (NULL == (r = *pp))
+	{
+		spinlock_release(&vmalloc_lock);
+		PANIC2("vfree(%p) not allocated!\n", ptr);
+	}
+
+	*pp = r->next;
+
+	r->next = lazy_list;
+	lazy_list = r;
+	lazy_pages += r->pages - 1;
+
+	if (lazy_pages >= VMALLOC_LAZY_PAGES)
+	{
+		__vmalloc_purge();
+	}
+
+	spinlock_release(&vmalloc_lock);
+}
+
+uint32	vmalloc_size(const void *ptr)
+{
+	struct vm_range	*r = NULL;
+	uint32	bytes = 0;
+
+	spinlock_acquire(&vmalloc_lock);
+
+	for (r = busy_list; r && (r->start != (uint32)ptr); r = r->next);
+
+	if (!r)
+	{
+		spinlock_release(&vmalloc_lock);
+		PANIC2("vmalloc_size(%p) not allocated!\n", ptr);
+	}
+
+	bytes = (r->pages - 1) * PAGE_SIZE;
+
+	spinlock_release(&vmalloc_lock);
+
+	return bytes;
+}
+
+void	vmalloc_dump(void)
+{
+	struct vm_range	*r = NULL;
+
+	spinlock_acquire(&vmalloc_lock);
+
+	for (r = free_list; r; r = r->next)
+	{
+		kdebug(DEBUG_INFO, FAC_HEAP, "vmalloc: free %p, %d pages\n", r->start, r->pages);
+	}
+
+	for (r = busy_list; r; r = r->next)
+	{
+		kdebug(DEBUG_INFO, FAC_HEAP, "vmalloc: busy %p, %d pages\n", r->start, r->pages);
+	}
+
+	kdebug(DEBUG_INFO, FAC_HEAP, "vmalloc: %d lazy pages\n", lazy_pages);
+
+	spinlock_release(&vmalloc_lock);
+}
+
+// Test: ranges are handed out in address order, a freed range is not
+// re-used until purged, and the region coalesces back to one range.
+void	test_vmalloc(void)
+{
+	uint8	*a = NULL;
+	uint8	*b = NULL;
+	uint8	*c = NULL;
+	uint32	total = free_list->pages;
+
+	a = vmalloc(3 * PAGE_SIZE, 0);
+	b = vmalloc(PAGE_SIZE + 1, 0);
+	ASSERT(b == a + 4 * PAGE_SIZE);
+
+	a[3 * PAGE_SIZE - 1] = 1;
+	b[2 * PAGE_SIZE - 1] = 1;
+
+	vfree(a);
+	c = vmalloc(PAGE_SIZE, 0);
+	ASSERT(c != a);
+
+	vfree(b);
+	vfree(c);
+	vmalloc_purge();
+
+	ASSERT(!busy_list && !lazy_list);
+	ASSERT(free_list && !free_list->next && (free_list->pages == total));
+}
+
+void	vmalloc_init(void)
+{
+	struct vm_range	*r = NULL;
+
+	vm_range_cache = kmem_cache_create("vm_range", sizeof(struct vm_range), 0, NULL);
+
+	r = (struct vm_range*)kmem_cache_alloc(vm_range_cache, 0);
+	r->start = (uint32)&_kernel_vmalloc_start;
+	r->pages = ((uint32)&_kernel_vmalloc_end - (uint32)&_kernel_vmalloc_start) / PAGE_SIZE;
+	r->next = NULL;
+	free_list = r;
+
+	printf("vmalloc: %d K available.\n", r->pages * PAGE_SIZE / 1024);
+
+	test_vmalloc();
+}
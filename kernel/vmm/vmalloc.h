@@ -0,0 +1,42 @@
+/*	kernel/vmm/vmalloc.h
+
+	Virtually contiguous allocations for large buffers.  Backed by
+	individual physical pages, mapped into their own virtual region
+	(see "kernel-elf.lds").  kmalloc() sends requests larger than
+	VMALLOC_THRESHOLD here automatically.
+*/
+
+#ifndef __VMALLOC_H__
+#define __VMALLOC_H__
+
+// A run of pages in the vmalloc region (free, allocated or waiting to be purged).
+struct vm_range
+{
+	uint32			start;		// Virtual address.
+	uint32			pages;		// Including the trailing guard page.
+	struct vm_range		*next;
+};
+
+void	vmalloc_init(void);
+
+// Returns page aligned memory.  'flags' takes the same HEAP_xxx flags as kmalloc().
+void*	vmalloc(uint32 bytes, uint32 flags);
+
+// Frees memory from vmalloc().  The pages are unmapped lazily.
+void	vfree(void *ptr);
+
+// Returns the usable size of a vmalloc()ed buffer (whole pages).
+uint32	vmalloc_size(const void *ptr);
+
+// Unmaps all lazily freed ranges, with a single TLB flush.
+void	vmalloc_purge(void);
+
+// Diagnostic function.
+void	vmalloc_dump(void);
+
+static inline int is_vmalloc_ptr(const void *x)
+{
+	return (x >= (const void*)&_kernel_vmalloc_start) && (x < (const void*)&_kernel_vmalloc_end);
+}
+
+#endif	// __VMALLOC_H__
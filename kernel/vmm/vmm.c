@@ -18,78 +18,138 @@ uint32	g_modules_start;
 uint32	g_module_pages;
 void	*g_pVastMapAddr = NULL;
 
-void	*gp_next_free_4k_page = NULL;
+struct page		*pmm_pages = NULL;
+uint32			pmm_page_count = 0;
+struct pmm_zone		pmm_zones[PMM_ZONE_COUNT] =
+{
+	{ .name = "dma",	.start_pfn = 0 },
+	{ .name = "normal",	.start_pfn = PAGE_OF(PMM_DMA_LIMIT) },
+	{ .name = "high",	.start_pfn = ~0 },
+};
 uint32	gp_total_free_4k_pages = 0;
-uint32	*gp_kernel_page_dir = NULL;
+uint32	g_pmm_low_watermark = VMM_LOW_WATERMARK;
+pte_t	*gp_kernel_page_dir = NULL;
+uint32	g_direct_map_limit = 0;
+uint32	g_pse_enabled = 0;
+uint32	g_pge_enabled = 0;
+uint32	g_nx_enabled = 0;
 
 static const char *pte_flag_chars = "sss00da00uwp";
 
-static void	*temp_vpages[VMM_TEMP_PAGES];
-static int	temp_vpages_idx = 0;
-static spinlock	temp_vpages_lock = INIT_SPINLOCK("temp_vpages");
+// kmap_atomic() slots in use at each nesting level.  A level only ever
+// changes its own count, and anything that interrupts it puts its slots
+// back before returning, so no lock is needed.
+static uint32	kmap_depth[KMAP_LEVELS];
+
+// Protects the buddy free lists, the PG_BUDDY state in "pmm_pages" and the zero pool.
+static spinlock	pmm_lock = INIT_SPINLOCK("pmm");
+
+// Physical pages that are already cleared, refilled by "[vmmd]" (see pmm_zero_refill()).
+// They are still counted in gp_total_free_4k_pages.
+static uint32	pmm_zero_pool[PMM_ZERO_POOL_PAGES];
+static uint32	pmm_zero_count = 0;
 
 void	vmm_get_stats(struct vmm_stats *stats)
 {
+	int	i;
+	int	z;
+
 	stats->pmm_free_pages = gp_total_free_4k_pages;
+	stats->pmm_low_watermark = g_pmm_low_watermark;
+	stats->heap_mapped_pages = heap_mapped_pages;
+	stats->heap_trimmed_pages = heap_trimmed_pages;
+	stats->pmm_zero_pages = pmm_zero_count;
+	stats->pmm_dma_free_pages = pmm_zones[PMM_ZONE_DMA].free_pages;
+
+	for (i = 0; i < PMM_ORDERS; i++)
+	{
+		stats->pmm_free_blocks[i] = 0;
+
+		for (z = 0; z < PMM_ZONE_COUNT; z++)
+		{
+			stats->pmm_free_blocks[i] += pmm_zones[z].free_area[i].blocks;
+		}
+	}
 }
 
 // Locked when searching or updating the active page tables.
 //static spinlock	kernel_pde_lock = INIT_SPINLOCK("pde");
 
-static void	*borrow_vpage(void)
+static inline int	kmap_level(void)
 {
-	void	*ret = NULL;
+	return in_irq() ? KMAP_IRQ : KMAP_TASK;
+}
 
-	spinlock_acquire(&temp_vpages_lock);
+static inline pte_t*	kmap_pte(const void *virtual)
+{
+	return PTBL_VIRT(ADDR_TO_PDE_SLOT(virtual)) + ADDR_TO_PTE_SLOT(virtual);
+}
+
+// Returns a kernel virtual address for 'physical'.  A single add for memory
+// in the direct map.  Anything above it goes in this level's next slot of the
+// temp vpages, whose page table setup allocated.  The slot was flushed from
+// the TLB when it was last unmapped.
+void*	kmap_atomic(paddr_t physical)
+{
+	uint8	*virt = NULL;
+	int	level = 0;
 
-	if (temp_vpages_idx >= VMM_TEMP_PAGES)
+	if (PHYS_IS_DIRECT(physical))
 	{
-		PANIC2("vmm: Exhausted %d temp_vpages.\n", temp_vpages_idx);
+		return phys_to_virt(physical);
 	}
 
-	ret = temp_vpages[temp_vpages_idx];
-	temp_vpages[temp_vpages_idx] = 0;
-	temp_vpages_idx++;
-
-	spinlock_release(&temp_vpages_lock);
+	level = kmap_level();
 
+	if (level == KMAP_TASK)
 	{
-		int pde_slot = ADDR_TO_PDE_SLOT(ret);
-		int pte_slot = ADDR_TO_PTE_SLOT(ret);
-		uint32 ptbl = gp_kernel_page_dir[pde_slot];
-
-		if (!ptbl)
-		{
-int i;
-			printf("borrowing: %p  [%03x,%03x] cr3[%03x] = %p\n", ret, pde_slot, pte_slot, pde_slot, ptbl);
-for (i = 0; i < 0x400; i++) if ( gp_kernel_page_dir[i] ) printf("gp_kernel_page_dir[%03x] = %p\n", i, gp_kernel_page_dir[i]);
-			Halt();
-		}
+		preempt_disable();
 	}
 
-	return ret;
+	ASSERT(kmap_depth[level] < KMAP_DEPTH);
+
+	virt = (uint8*)&_kernel_temp_vpages_start + ((level * KMAP_DEPTH + kmap_depth[level]++) << PAGE_BITS);
+	*kmap_pte(virt) = (physical & PTE_ADDR_MASK) | PTE_KDATA |
+		(g_pge_enabled ? PTE_GLOBAL : 0) | (g_nx_enabled ? PTE_NX : 0);
+
+	return virt + ((uint32)physical & ~PAGE_MASK);
 }
 
-static void	return_vpage(void *vpage)
+void	kunmap_atomic(void *virtual)
 {
-	spinlock_acquire(&temp_vpages_lock);
+	uint32	slot = 0;
+	int	level = 0;
+
+	if (VIRT_IS_DIRECT(virtual))
+	{
+		return;
+	}
+
+	virtual = (void*)PAGE_BASE(virtual);
+	slot = PAGE_OF((uint32)virtual - (uint32)&_kernel_temp_vpages_start);
+	level = kmap_level();
 
-	if (!temp_vpages_idx)
+	if (!kmap_depth[level] || (slot != level * KMAP_DEPTH + kmap_depth[level] - 1))
 	{
-		PANIC2("vmm: Attempt to return vpage when not acquired: %p\n", vpage);
+		PANIC2("kunmap_atomic: %p is not the newest mapping at this level.\n", virtual);
 	}
 
-	temp_vpages[--temp_vpages_idx] = vpage;
+	*kmap_pte(virtual) = 0;
+	InvalidatePage(virtual);
+	kmap_depth[level]--;
 
-	spinlock_release(&temp_vpages_lock);
+	if (level == KMAP_TASK)
+	{
+		preempt_enable();
+	}
 }
 
 void	vmm_debug_virt_addr(const void *virtual)
 {
 	int	pde_slot = ADDR_TO_PDE_SLOT(virtual);
 	int	pte_slot = ADDR_TO_PTE_SLOT(virtual);
-	uint32	ptbl = gp_kernel_page_dir[pde_slot] & PAGE_MASK;
-	uint32	physical = 0;
+	paddr_t	ptbl = PTE_ADDR(gp_kernel_page_dir[pde_slot]);
+	paddr_t	physical = 0;
 	void	*temp = NULL;
 
 	if (!ptbl)
@@ -99,14 +159,19 @@ void	vmm_debug_virt_addr(const void *virtual)
 		return;
 	}
 
-// temporarily map ptbl to temp vpage.
-	temp = borrow_vpage();
-	vmm_map_pages(temp, (void*)ptbl, 1, PTE_KDATA | VMM_PHYS_REAL);
-	physical = ((uint32*)temp)[pte_slot] & PAGE_MASK;
-	return_vpage(temp);
+	if (gp_kernel_page_dir[pde_slot] & PTE_4M_PAGE)
+	{
+		printf ("virt:%p, (pde:%03x) 4M page, pfn:%05x\n",
+			virtual, pde_slot, PHYS_TO_PFN(vmm_lookup_phys(virtual)));
+		return;
+	}
+
+	temp = kmap_atomic(ptbl);
+	physical = PTE_ADDR(((pte_t*)temp)[pte_slot]);
+	kunmap_atomic(temp);
 
-	printf ("virt:%p, (pde,pte:%03x,%03x) ptbl:%p, phys:%p\n",
-		virtual, pde_slot, pte_slot, ptbl, physical);
+	printf ("virt:%p, (pde,pte:%03x,%03x) ptbl pfn:%05x, pfn:%05x\n",
+		virtual, pde_slot, pte_slot, PHYS_TO_PFN(ptbl), PHYS_TO_PFN(physical));
 
 	return;
 }
@@ -115,9 +180,9 @@ void	vmm_debug_virt_addr(const void *virtual)
 void	vmm_dump_page_tables(const void *virt_start, const void *virt_end)
 {
 	uint32	flags;
-	uint32	*ptbl_phys;
-	uint32	*ptbl_virt;
-	uint32	paddr;
+	paddr_t	ptbl_phys;
+	pte_t	*ptbl_virt;
+	paddr_t	paddr;
 	uint32	vaddr;
 	char	flag_str[13];
 	int	first_pde = ADDR_TO_PDE_SLOT(virt_start);
@@ -132,23 +197,28 @@ void	vmm_dump_page_tables(const void *virt_start, const void *virt_end)
 	{
 		if (!(gp_kernel_page_dir[pde] & PTE_PRESENT)) continue;
 
-		flags = gp_kernel_page_dir[pde] & ~PAGE_MASK;
-		ptbl_phys = (uint32*)(gp_kernel_page_dir[pde] & PAGE_MASK);
-		ptbl_virt = (uint32*)((uint32)&_kernel_ptbl_start + (uint32)(pde << 12));
-		vaddr = (pde << 22);
+		flags = (uint32)gp_kernel_page_dir[pde] & ~PAGE_MASK;
+		ptbl_phys = PTE_ADDR(gp_kernel_page_dir[pde]);
+		ptbl_virt = PTBL_VIRT(pde);
+		vaddr = PDE_SLOT_TO_ADDR(pde);
 
-		printf("cr3[%03x] (virt:%p) = %08x, %03x\n", pde, vaddr, ptbl_phys, flags);
+		printf("cr3[%03x] (virt:%p) = pfn %05x, %03x\n", pde, vaddr, PHYS_TO_PFN(ptbl_phys), flags);
+
+		if (flags & PTE_4M_PAGE)
+		{
+			continue;	// 4M page, no page table.
+		}
 
 		first_pte = (pde == first_pde) ? ADDR_TO_PTE_SLOT(virt_start) : 0;
-		last_pte = (pde == last_pde) ? ADDR_TO_PTE_SLOT(virt_end) : 1023;
+		last_pte = (pde == last_pde) ? ADDR_TO_PTE_SLOT(virt_end) : PTE_SIZE - 1;
 
 		for (pte = first_pte; pte <= last_pte; pte++)
 		{
 			if (!(ptbl_virt[pte] & PTE_PRESENT)) continue;
 
-			flags = ptbl_virt[pte] & ~PAGE_MASK;
-			paddr = ptbl_virt[pte] & PAGE_MASK;
-			vaddr = (pde << 22) | (pte << 12);
+			flags = (uint32)ptbl_virt[pte] & ~PAGE_MASK;
+			paddr = PTE_ADDR(ptbl_virt[pte]);
+			vaddr = PDE_PTE_TO_ADDR(pde, pte);
 
 			for (f = 0; f < 12; f++)
 			{
@@ -156,8 +226,8 @@ void	vmm_dump_page_tables(const void *virt_start, const void *virt_end)
 			}
 			flag_str[f] = 0;
 
-			printf("\t%08x [%03x,%03x] = p:%08x, %03x (%s)\n",
-				vaddr, pde, pte, paddr, flags, flag_str);
+			printf("\t%08x [%03x,%03x] = pfn:%05x, %03x (%s)\n",
+				vaddr, pde, pte, PHYS_TO_PFN(paddr), flags, flag_str);
 		}
 	}
 }
@@ -181,58 +251,401 @@ static inline void clear_pages(void *addr, int count)
 	);
 }
 
-static inline const void* virt_to_phys(const void *virt)
+static inline void	pmm_area_add(struct page *pg, uint32 order)
 {
-	return ((void*)virt > (void*)&_kernel_virtual) ?
-		(uint8*)virt - (uint32)&_kernel_virtual :
-		virt;
+	struct pmm_zone		*zone = &pmm_zones[PFN_TO_ZONE(PAGE_TO_PFN(pg))];
+	struct pmm_free_area	*area = &zone->free_area[order];
+
+	pg->flags |= PG_BUDDY;
+	pg->order = order;
+	pg->prev = NULL;
+	pg->next = area->head;
+
+	if (area->head)
+	{
+		area->head->prev = pg;
+	}
+
+	area->head = pg;
+	area->blocks++;
+	zone->free_pages += 1 << order;
 }
 
-// Unlinks a physical page from the free page list.  Has to map the page
-// temporarily to get the pointer for the next page in the list.  Clears
-// the page out before returning it.  Page returned in NOT MAPPED.  Return
-// value is raw physical address of page.
+static inline void	pmm_area_del(struct page *pg, uint32 order)
+{
+	struct pmm_zone		*zone = &pmm_zones[PFN_TO_ZONE(PAGE_TO_PFN(pg))];
+	struct pmm_free_area	*area = &zone->free_area[order];
+
+	if (pg->prev)
+	{
+		pg->prev->next = pg->next;
+	}
+	else
+	{
+		area->head = pg->next;
+	}
+
+	if (pg->next)
+	{
+		pg->next->prev = pg->prev;
+	}
+
+	pg->flags &= ~PG_BUDDY;
+	pg->next = pg->prev = NULL;
+	area->blocks--;
+	zone->free_pages -= 1 << order;
+}
 
-void*		pmm_get_page(void)
+// Takes the first block in 'zone', of the smallest order >= 'order' that has
+// one, whose first 2^order pages end at or below 'end_pfn'.  Splits it down,
+// returning the upper halves to their free lists.  Returns NULL if there is
+// none.  Caller holds pmm_lock.
+static struct page*	__pmm_take_zone(struct pmm_zone *zone, uint32 order, uint32 end_pfn)
 {
-	void		*ret = NULL;
-	pmm_list_hdr	*node = (pmm_list_hdr*)borrow_vpage();
+	struct page	*pg = NULL;
+	uint32		o = order;
 
-	if (NULL == (ret = gp_next_free_4k_page))
+	for (; o <= PMM_MAX_ORDER; o++)
+	{
+		for (pg = zone->free_area[o].head; pg; pg = pg->next)
+		{
+			if (PAGE_TO_PFN(pg) + (1 << order) <= end_pfn)
+			{
+				break;
+			}
+		}
+
+		if (pg)
+		{
+			break;
+		}
+	}
+
+	if (!pg)
 	{
-		PANIC1("pmm_get_page: no free pages available.\n");
 		return NULL;
 	}
 
-	vmm_map_pages(node, ret, 1, PTE_KDATA | VMM_PHYS_REAL);
+	pmm_area_del(pg, o);
+
+	while (o > order)
+	{
+		o--;
+		pmm_area_add(pg + (1 << o), o);
+	}
+
+	pg->order = order;
+	gp_total_free_4k_pages -= 1 << order;
+
+	return pg;
+}
+
+// Takes a block of 2^order pages from the high zone, or a lower one if it
+// can't supply it.  Caller holds pmm_lock.
+static struct page*	__pmm_take(uint32 order)
+{
+	struct page	*pg = NULL;
+	int		z = 0;
+
+	for (z = PMM_ZONE_COUNT - 1; !pg && (z >= 0); z--)
+	{
+		pg = __pmm_take_zone(&pmm_zones[z], order, pmm_page_count);
+	}
+
+	return pg;
+}
+
+// Returns a block to its free list, merging it with its buddy for as
+// long as the buddy is a free block of the same order.  Caller holds pmm_lock.
+static void	__pmm_give(uint32 pfn, uint32 order)
+{
+	uint32		buddy = 0;
+
+	if (!pfn || (pfn & ((1 << order) - 1)) ||
+		(order > PMM_MAX_ORDER) || (pfn + (1 << order) > pmm_page_count))
+	{
+		PANIC3("pmm_free_order: bad block, pfn %05x, order %d.\n", pfn, order);
+	}
+
+	if (PFN_TO_PAGE(pfn)->flags & PG_BUDDY)
+	{
+		PANIC2("pmm_free_order: pfn %05x is already free.\n", pfn);
+	}
+
+	gp_total_free_4k_pages += 1 << order;
+
+	while (order < PMM_MAX_ORDER)
+	{
+		buddy = pfn ^ (1 << order);
+
+		if ((buddy >= pmm_page_count) ||
+			!(PFN_TO_PAGE(buddy)->flags & PG_BUDDY) ||
+			(PFN_TO_PAGE(buddy)->order != order))
+		{
+			break;
+		}
+
+		pmm_area_del(PFN_TO_PAGE(buddy), order);
+		pfn &= ~(1 << order);
+		order++;
+	}
+
+	pmm_area_add(PFN_TO_PAGE(pfn), order);
+}
+
+// The pages are not mapped, and are NOT cleared.
+uint32		pmm_alloc_order(uint32 order)
+{
+	struct page	*pg = NULL;
+
+	ASSERT(order <= PMM_MAX_ORDER);
+
+	spinlock_acquire(&pmm_lock);
+	pg = __pmm_take(order);
+	spinlock_release(&pmm_lock);
+
+	return pg ? PAGE_TO_PFN(pg) : 0;
+}
+
+void		pmm_free_order(uint32 pfn, uint32 order)
+{
+	spinlock_acquire(&pmm_lock);
+	__pmm_give(pfn, order);
+	spinlock_release(&pmm_lock);
+}
+
+// Clears a physical page through the direct map (or a temp mapping).
+static void	pmm_clear_page(uint32 pfn)
+{
+	void	*virt = kmap_atomic(PFN_TO_PHYS(pfn));
+
+	clear_pages(virt, 1);
+	kunmap_atomic(virt);
+}
+
+// Returns [pfn, pfn + pages) to the free lists, as the largest aligned blocks
+// that fit.  Caller holds pmm_lock.
+static void	__pmm_give_range(uint32 pfn, uint32 pages)
+{
+	uint32	end = pfn + pages;
+	uint32	order = 0;
+
+	while (pfn < end)
+	{
+		for (order = PMM_MAX_ORDER; order; order--)
+		{
+			if (!(pfn & ((1 << order) - 1)) && (pfn + (1 << order) <= end)) break;
+		}
+
+		__pmm_give(pfn, order);
+		pfn += 1 << order;
+	}
+}
+
+// Prefers the highest zone that can meet 'max_phys', leaving the lower
+// ones to the callers that can't use anything else.
+uint32		pmm_alloc_contig(uint32 pages, uint32 align, paddr_t max_phys)
+{
+	struct page	*pg = NULL;
+	uint32		end_pfn = min(PHYS_TO_PFN(max_phys) + 1, pmm_page_count);
+	uint32		order = 0;
+	int		z = 0;
+
+	ASSERT(pages && !(align & (align - 1)));
+
+	while ((1 << order) < pages)
+	{
+		order++;
+	}
+
+// Blocks are naturally aligned, so a big enough block is aligned enough.
+	while ((PAGE_SIZE << order) < align)
+	{
+		order++;
+	}
+
+	if (order > PMM_MAX_ORDER)
+	{
+		return 0;
+	}
 
-	gp_next_free_4k_page = node->next;
-	gp_total_free_4k_pages--;
+	spinlock_acquire(&pmm_lock);
 
-	clear_pages(node, 1);
+	for (z = PMM_ZONE_COUNT - 1; !pg && (z >= 0); z--)
+	{
+		if (pmm_zones[z].start_pfn < end_pfn)
+		{
+			pg = __pmm_take_zone(&pmm_zones[z], order, end_pfn);
+		}
+	}
+
+// Give back the tail of the block that wasn't asked for.
+	if (pg && (pages < (1 << order)))
+	{
+		__pmm_give_range(PAGE_TO_PFN(pg) + pages, (1 << order) - pages);
+	}
 
-	vmm_unmap_pages(node, 1);
+	spinlock_release(&pmm_lock);
 
-	return_vpage(node);
+	return pg ? PAGE_TO_PFN(pg) : 0;
+}
+
+void		pmm_free_contig(uint32 pfn, uint32 pages)
+{
+	spinlock_acquire(&pmm_lock);
+	__pmm_give_range(pfn, pages);
+	spinlock_release(&pmm_lock);
+}
+
+// Returns a free, zeroed page.  The page is NOT MAPPED.
+uint32		pmm_get_page(void)
+{
+	uint32	ret = 0;
+
+	pmm_get_pages(&ret, 1, 0);
 
 	return ret;
 }
 
-void		pmm_free_page(void *physical)
+void		pmm_free_page(uint32 pfn)
+{
+	pmm_free_order(pfn, 0);
+}
+
+// Fills 'pfns' with 'count' single (not necessarily contiguous) free pages,
+// under one acquisition of pmm_lock.  All or nothing: if there aren't enough,
+// panics, or with PMM_CANFAIL returns 0.  Returns 'count' on success.
+//
+// Pages are zeroed, from the zero pool while it lasts, and by hand after that.
+// PMM_NOZERO leaves the pool alone and returns whatever is in the pages.
+uint32		pmm_get_pages(uint32 *pfns, uint32 count, uint32 flags)
+{
+	struct page	*pg = NULL;
+	uint32		zeroed = 0;
+	uint32		i = 0;
+
+	spinlock_acquire(&pmm_lock);
+
+	if (gp_total_free_4k_pages < count)
+	{
+		spinlock_release(&pmm_lock);
+
+		if (flags & PMM_CANFAIL)
+		{
+			return 0;
+		}
+
+		PANIC3("pmm_get_pages: %d pages wanted, %d free.\n", count, gp_total_free_4k_pages);
+	}
+
+	if (!(flags & PMM_NOZERO))
+	{
+		for (; (zeroed < count) && pmm_zero_count; zeroed++)
+		{
+			pfns[zeroed] = pmm_zero_pool[--pmm_zero_count];
+			gp_total_free_4k_pages--;
+		}
+	}
+
+	for (i = zeroed; i < count; i++)
+	{
+		if (NULL != (pg = __pmm_take(0)))
+		{
+			pfns[i] = PAGE_TO_PFN(pg);
+			continue;
+		}
+
+// Only PMM_NOZERO gets here, when the buddy allocator has run dry.
+		ASSERT(pmm_zero_count);
+		pfns[i] = pmm_zero_pool[--pmm_zero_count];
+		gp_total_free_4k_pages--;
+	}
+
+	spinlock_release(&pmm_lock);
+
+	if (!(flags & PMM_NOZERO))
+	{
+		for (i = zeroed; i < count; i++)
+		{
+			pmm_clear_page(pfns[i]);
+		}
+	}
+
+	return count;
+}
+
+// Clears up to 'max' pages from the buddy allocator into the zero pool.
+// The clearing is done without pmm_lock held.  Returns the number added.
+uint32		pmm_zero_refill(uint32 max)
 {
-	pmm_list_hdr    *node = (pmm_list_hdr*)borrow_vpage();
+	struct page	*pg = NULL;
+	uint32		pfn = 0;
+	uint32		added = 0;
 
-//	Map the page (temporarily) so that we can follow its link and clear it out.
-	vmm_map_pages(node, physical, 1, PTE_KDATA | VMM_PHYS_REAL);
+	for (; added < max; added++)
+	{
+		spinlock_acquire(&pmm_lock);
+
+		pg = (pmm_zero_count < PMM_ZERO_POOL_PAGES) ? __pmm_take(0) : NULL;
+
+		spinlock_release(&pmm_lock);
+
+		if (!pg)
+		{
+			break;
+		}
+
+		pfn = PAGE_TO_PFN(pg);
+		pmm_clear_page(pfn);
 
-	clear_pages(node, 1);
-	node->next = gp_next_free_4k_page;
-	node->size = PAGE_SIZE;
-	gp_next_free_4k_page = physical;
-	gp_total_free_4k_pages++;
+		spinlock_acquire(&pmm_lock);
 
-	vmm_unmap_pages(node, 1);
-	return_vpage(node);
+// Somebody else may have filled the pool while we were clearing.
+		if (pmm_zero_count < PMM_ZERO_POOL_PAGES)
+		{
+			pmm_zero_pool[pmm_zero_count++] = pfn;
+			gp_total_free_4k_pages++;
+		}
+		else
+		{
+			__pmm_give(pfn, 0);
+		}
+
+		spinlock_release(&pmm_lock);
+	}
+
+	return added;
+}
+
+void		pmm_free_pages(const uint32 *pfns, uint32 count)
+{
+	uint32	i = 0;
+
+	spinlock_acquire(&pmm_lock);
+
+	for (i = 0; i < count; i++)
+	{
+		__pmm_give(pfns[i], 0);
+	}
+
+	spinlock_release(&pmm_lock);
+}
+
+// Invalidates the TLB entries for a range of pages.  Past VMM_FLUSH_ALL_PAGES
+// pages, one full flush is cheaper than an invlpg per page.  invlpg drops
+// global entries too, so the full flush has to as well.
+void		vmm_flush_range(void *virtual, uint32 count)
+{
+	if (count > VMM_FLUSH_ALL_PAGES)
+	{
+		flush_tlb_all();
+		return;
+	}
+
+	for (; count; count--, virtual = (void*)((uint32)virtual + PAGE_SIZE))
+	{
+		InvalidatePage(virtual);
+	}
 }
 
 // Walks the page tables between 'virtual' and 'virtual + count * PAGE_SIZE'.
@@ -278,11 +691,11 @@ uint32		vmm_map_pages_rand(void* virtual, uint32 count, uint32 flags)
 		if (!page_table_phys)
 		{
 // It seems that the page we want to map requires a page directory entry (ie, a page table)
-// to be allocated.  So we will grab a (zeroed-out) physical page and plug it in.
+// to be allocated.  So we will grab a physical page and plug it in.
 
 			// Early assertion to help track bug better.
 			// Would otherwise be caught in 'pmm_get_page' and be confusing.
-			ASSERT(gp_next_free_4k_page);
+			ASSERT(gp_total_free_4k_pages);
 
 			page_table_phys = (uint32)pmm_get_page();	// recursively calls map/unmap
 			gp_kernel_page_dir[pde_slot] = page_table_phys | PTE_KDATA;
@@ -312,6 +725,152 @@ uint32		vmm_map_pages_rand(void* virtual, uint32 count, uint32 flags)
 }
 */
 
+// Replaces the 4M page at 'pde_slot' with a page table that maps the same frames.
+// Returns 0 if there was no page for the table ('pmm_flags' has PMM_CANFAIL).
+static int	__vmm_split_4m(uint32 pde_slot, uint32 pmm_flags)
+{
+	pte_t	pde = gp_kernel_page_dir[pde_slot];
+	uint32	ptbl_pfn = 0;
+	pte_t	*ptbl = NULL;
+	uint32	i = 0;
+
+	if (!pmm_get_pages(&ptbl_pfn, 1, pmm_flags | PMM_NOZERO))
+	{
+		return 0;
+	}
+
+	ptbl = kmap_atomic(PFN_TO_PHYS(ptbl_pfn));
+
+	for (i = 0; i < PTE_SIZE; i++)
+	{
+		ptbl[i] = (PDE_ADDR_4M(pde) + (i << PAGE_BITS)) | (pde & (PTE_ALL_FLAGS | PTE_GLOBAL | PTE_NX));
+	}
+
+	kunmap_atomic(ptbl);
+
+	gp_kernel_page_dir[pde_slot] = PFN_TO_PHYS(ptbl_pfn) | PTE_KDATA;
+	flush_tlb_all();
+
+	return 1;
+}
+
+static inline void	vmm_split_4m(uint32 pde_slot)
+{
+	__vmm_split_4m(pde_slot, 0);
+}
+
+int		vmm_demote_4m(void *virtual)
+{
+	uint32	pde_slot = ADDR_TO_PDE_SLOT(virtual);
+
+	if (!PDE_IS_4M(gp_kernel_page_dir[pde_slot]))
+	{
+		return 1;
+	}
+
+	return __vmm_split_4m(pde_slot, PMM_CANFAIL);
+}
+
+int		vmm_promote_4m(void *virtual, int may_copy)
+{
+	uint32	pde_slot = ADDR_TO_PDE_SLOT(virtual);
+	pte_t	pde = gp_kernel_page_dir[pde_slot];
+	pte_t	*pte = PTBL_VIRT(pde_slot);
+	pte_t	*old = NULL;
+	pte_t	flags = 0;
+	paddr_t	block = 0;
+	int	copied = 0;
+	uint32	frames[VMM_MAP_BATCH];
+	void	*dst = NULL;
+	uint32	i = 0;
+	uint32	j = 0;
+
+	ASSERT(IS_PDIR_ALIGNED(virtual));
+	ASSERT(PTE_BITS <= PMM_MAX_ORDER);
+
+	if (!g_pse_enabled || !(pde & PTE_PRESENT) || (pde & PTE_4M_PAGE))
+	{
+		return 0;
+	}
+
+// Every page must be mapped, the same way.  If the frames already happen to be
+// one aligned 4M block, there is nothing to copy.
+	flags = pte[0] & (PTE_ALL_FLAGS | PTE_GLOBAL | PTE_NX);
+	block = IS_PDIR_ALIGNED(PTE_ADDR(pte[0])) ? PTE_ADDR(pte[0]) : 0;
+
+	for (i = 0; i < PTE_SIZE; i++)
+	{
+		if (!(pte[i] & PTE_PRESENT) || ((pte[i] & (PTE_ALL_FLAGS | PTE_GLOBAL | PTE_NX)) != flags))
+		{
+			return 0;
+		}
+
+		if (block && (PTE_ADDR(pte[i]) != block + (i << PAGE_BITS)))
+		{
+			block = 0;
+		}
+	}
+
+	if (!block)
+	{
+		if (!may_copy || !(block = PFN_TO_PHYS(pmm_alloc_order(PTE_BITS))))
+		{
+			return 0;
+		}
+
+		for (i = 0; i < PTE_SIZE; i++)
+		{
+			dst = kmap_atomic(block + (i << PAGE_BITS));
+			memcpy(dst, (uint8*)virtual + (i << PAGE_BITS), PAGE_SIZE);
+			kunmap_atomic(dst);
+		}
+
+		copied = 1;
+	}
+
+	gp_kernel_page_dir[pde_slot] = block | flags | PTE_4M_PAGE;
+	flush_tlb_all();
+
+// The old page table is no longer reachable through the self-map.
+	old = kmap_atomic(PTE_ADDR(pde));
+
+	for (i = 0; copied && (i < PTE_SIZE); i += VMM_MAP_BATCH)
+	{
+		for (j = 0; j < VMM_MAP_BATCH; j++)
+		{
+			frames[j] = PHYS_TO_PFN(PTE_ADDR(old[i + j]));
+		}
+
+		pmm_free_pages(frames, VMM_MAP_BATCH);
+	}
+
+	kunmap_atomic(old);
+	pmm_free_page(PHYS_TO_PFN(PTE_ADDR(pde)));
+
+	return copied ? 2 : 1;
+}
+
+// How many frames vmm_map_pages() should fetch for the 'run' entries from 'pte'
+// on ('count' more pages follow in later page tables).  With VMM_SKIP_MAPPED only
+// the entries that are not present need one, so a nearly full range doesn't ask
+// for (and panic over) frames it won't use.
+static uint32	vmm_map_batch(const pte_t *pte, uint32 run, uint32 count, uint32 flags)
+{
+	uint32	want = 0;
+
+	if (!(flags & VMM_SKIP_MAPPED))
+	{
+		return min(run + count, VMM_MAP_BATCH);
+	}
+
+	for (; run && (want < VMM_MAP_BATCH); run--, pte++)
+	{
+		want += !(*pte & PTE_PRESENT);
+	}
+
+	return want;
+}
+
 /* Maps physical pages into virtual address space.  Has two methods for choosing
    physical address.  "flags" usage:
 
@@ -337,17 +896,23 @@ uint32		vmm_map_pages_rand(void* virtual, uint32 count, uint32 flags)
    requested.
 */
 
-uint32		vmm_map_pages(void* virtual, void* physical, uint32 count, uint32 flags)
+uint32		vmm_map_pages(void* virtual, paddr_t physical, uint32 count, uint32 flags)
 {
 	uint32	pde_slot = 0;
-	uint32	pte_slot = 0;
-	uint32	page_table_phys = 0;	// value as hardware sees it.
-	uint32 *page_table_virt = 0;	// where we can access the innards of the table itself.
-	uint32	pte_flags = flags & PTE_ALL_FLAGS;
+	uint32	run = 0;
+	pte_t	*pte = NULL;
+	pte_t	pte_flags = flags & PTE_ALL_FLAGS;
 	uint32	result = 0;
+	uint32	replaced = 0;
+	uint32	kernel_pde = ADDR_TO_PDE_SLOT(&_kernel_direct_map_start);
+	void	*start = virtual;
+	uint32	pages = count;
+	uint32	frames[VMM_MAP_BATCH];
+	uint32	frame_count = 0;
+	uint32	frame_next = 0;
 
 #if (DEBUG_PMM_MAP_UNMAP)
-	printf("map_pages: virt:%p, phys:%p, count:%d, flags:%x\n", virtual, physical, count, flags);
+	printf("map_pages: virt:%p, pfn:%05x, count:%d, flags:%x\n", virtual, PHYS_TO_PFN(physical), count, flags);
 #endif
 
 	if (!gp_kernel_page_dir)
@@ -365,64 +930,114 @@ uint32		vmm_map_pages(void* virtual, void* physical, uint32 count, uint32 flags)
 		PANIC2("virtual address, %p, is not page aligned.\n", virtual);
 	}
 
-	if ((flags & VMM_PHYS_REAL) && !IS_PAGE_ALIGNED(physical))
+	if ((flags & VMM_PHYS_REAL) && (physical & ~PAGE_MASK))
 	{
-		PANIC2("physical address, %p, is not page aligned.\n", physical);
+		PANIC2("physical address, %p, is not page aligned.\n", (uint32)physical);
 	}
 
 	while (count)
 	{
 		pde_slot = ADDR_TO_PDE_SLOT(virtual);
-		pte_slot = ADDR_TO_PTE_SLOT(virtual);
+		pte = PTBL_VIRT(pde_slot);
 
-		page_table_phys = (gp_kernel_page_dir[pde_slot] & PAGE_MASK);
+		pte_flags = (flags & PTE_ALL_FLAGS) | ((g_pge_enabled && (pde_slot >= kernel_pde)) ? PTE_GLOBAL : 0);
 
-		if (!page_table_phys)
+		if (g_nx_enabled && (flags & PTE_RW))
+		{
+			pte_flags |= PTE_NX;
+		}
+
+		if (PDE_IS_4M(gp_kernel_page_dir[pde_slot]))
+		{
+			if (flags & VMM_SKIP_MAPPED)
+			{
+				run = min(count, PTE_SIZE - ADDR_TO_PTE_SLOT(virtual));
+				count -= run;
+				virtual = (void*)((uint32)virtual + (run << PAGE_BITS));
+				physical += run << PAGE_BITS;
+				continue;
+			}
+
+			vmm_split_4m(pde_slot);
+		}
+
+		if (!PTE_ADDR(gp_kernel_page_dir[pde_slot]))
 		{
+// Whole, aligned 4M runs of real physical memory get a 4M page and no page table.
+			if ((flags & VMM_PHYS_REAL) && g_pse_enabled && (count >= PTE_SIZE) &&
+				IS_PDIR_ALIGNED(virtual) && IS_PDIR_ALIGNED(physical))
+			{
+				gp_kernel_page_dir[pde_slot] = physical | pte_flags | PTE_4M_PAGE;
+				count -= PTE_SIZE;
+				result += PTE_SIZE;
+				virtual = (void*)((uint32)virtual + PDIR_SIZE);
+				physical += PDIR_SIZE;
+				continue;
+			}
+
 // It seems that the page we want to map requires a page directory entry (ie, a page table)
-// to be allocated.  So we will grab a (zeroed-out) physical page and plug it in.
+// to be allocated.  So we will grab a physical page and plug it in.
 
 			// Early assertion to help track bug better.
 			// Would otherwise be caught in 'pmm_get_page' and be confusing.
-			ASSERT(gp_next_free_4k_page);
-
-			page_table_phys = (uint32)pmm_get_page();	// recursively calls map/unmap
-			gp_kernel_page_dir[pde_slot] = page_table_phys | PTE_KDATA;
+			ASSERT(gp_total_free_4k_pages);
 
-			InvalidatePage(gp_kernel_page_dir);	// FIXME: do we need this?
-//printf("allocated new pde: %p (%d)\n", page_table_phys, pde_slot);
+			gp_kernel_page_dir[pde_slot] = PFN_TO_PHYS(pmm_get_page()) | PTE_KDATA;
+//printf("allocated new pde: %p (%d)\n", gp_kernel_page_dir[pde_slot], pde_slot);
 		}
 
-// Now we need to modify the page table.  But all we have is its physical address.
-// (pte_table is a physical address).  We can cheat though - it is already mapped
-// due to use mapping our page directory itself as a page table.
-
-		page_table_virt = (uint32*)((uint32)&_kernel_ptbl_start + (uint32)(pde_slot << 12));
+// Fill the rest of this page table's run in one pass.
+		pte += ADDR_TO_PTE_SLOT(virtual);
+		run = min(count, PTE_SIZE - ADDR_TO_PTE_SLOT(virtual));
+		count -= run;
 
-		if (!(flags & VMM_REMAP_OK) && (page_table_virt[pte_slot] & PTE_PRESENT))
+		for (; run; run--, pte++,
+			virtual = (void*)((uint32)virtual + PAGE_SIZE),
+			physical += PAGE_SIZE)
 		{
-			PANIC3("page %p already mapped to phys_addr %p!\n",
-				virtual, page_table_virt[pte_slot] & PAGE_MASK);
-		}
+			if (*pte & PTE_PRESENT)
+			{
+				if (flags & VMM_SKIP_MAPPED)
+				{
+					continue;
+				}
+
+				if (!(flags & VMM_REMAP_OK))
+				{
+					PANIC3("page %p already mapped to pfn %05x!\n",
+						virtual, PHYS_TO_PFN(PTE_ADDR(*pte)));
+				}
+
+				replaced++;
+			}
 
-		if ((flags & VMM_SKIP_MAPPED) && (page_table_virt[pte_slot] & PTE_PRESENT))
-		{
-			goto skip;
-		}
+			if (!(flags & VMM_PHYS_REAL))
+			{
+				if (frame_next == frame_count)
+				{
+					frame_count = pmm_get_pages(frames, vmm_map_batch(pte, run, count, flags),
+						(flags & VMM_NOZERO) ? PMM_NOZERO : 0);
+					frame_next = 0;
+				}
+
+				physical = PFN_TO_PHYS(frames[frame_next++]);
+			}
 
-		if (!(flags & VMM_PHYS_REAL))
-		{
-			physical = pmm_get_page();
+			*pte = physical | pte_flags;
+			result++;
 		}
+	}
 
-		page_table_virt[pte_slot] = (uint32)physical | pte_flags;
-		InvalidatePage(virtual);
-		result++;
+// Frames fetched for pages that turned out to be mapped already.
+	if (frame_next < frame_count)
+	{
+		pmm_free_pages(frames + frame_next, frame_count - frame_next);
+	}
 
-skip:
-		count--;
-		virtual = (void*)((uint32)virtual + PAGE_SIZE);
-		physical = (void*)((uint32)physical + PAGE_SIZE);
+// The TLB never holds not-present entries, so only replaced mappings need flushing.
+	if (replaced)
+	{
+		vmm_flush_range(start, pages);
 	}
 
 	return result;
@@ -432,8 +1047,9 @@ void		vmm_unmap_pages(void *virtual, uint32 count)
 {
 	uint32	pde_slot = 0;
 	uint32	pte_slot = 0;
-	uint32 	page_table_phys = 0;
-	uint32 *page_table_virt = NULL;
+	pte_t	*page_table_virt = NULL;
+	void	*start = virtual;
+	uint32	pages = count;
 
 #if (DEBUG_PMM_MAP_UNMAP)
 	printf("unmap_pages(virtual:%p, count:%d)\n", virtual, count);
@@ -459,39 +1075,155 @@ void		vmm_unmap_pages(void *virtual, uint32 count)
 			PANIC2("unmap_pages: gp_kernel_page_dir[%03x] is not initialized!\n", pde_slot);
 		}
 
-		page_table_phys = (gp_kernel_page_dir[pde_slot] & PAGE_MASK);
-		page_table_virt = (uint32*)((uint32)&_kernel_ptbl_start + (uint32)(pde_slot << 12));
-
-		if (!page_table_virt[pte_slot])
+		if (PDE_IS_4M(gp_kernel_page_dir[pde_slot]))
 		{
-			PANIC2("unmap_pages: vaddr %p is not mapped!\n", virtual);
+			vmm_split_4m(pde_slot);
 		}
 
-		if (page_table_virt[pte_slot] & PTE_4M_PAGE)
+		page_table_virt = PTBL_VIRT(pde_slot);
+
+		if (!page_table_virt[pte_slot])
 		{
-			PANIC2("unmap_pages: vaddr %p is a 4M page.\n", virtual);
+			PANIC2("unmap_pages: vaddr %p is not mapped!\n", virtual);
 		}
 
 // Unmap the page.
 		page_table_virt[pte_slot] = 0;
-		InvalidatePage(virtual);
 
 		count--;
 		virtual = (void*)((uint32)virtual + PAGE_SIZE);
 	}
+
+	vmm_flush_range(start, pages);
+}
+
+// Revokes the whole range, flushes the TLB once, then frees the frames in batches.
+void		vmm_free_pages(void *virtual, uint32 count)
+{
+#if (DEBUG_PMM_MAP_UNMAP)
+	printf("free_pages(virtual:%p, count:%d)\n", virtual, count);
+#endif
+
+	if (!IS_PAGE_ALIGNED(virtual))
+	{
+		PANIC2("free_pages: virtual address, %p, is not page aligned.\n", virtual);
+	}
+
+	vmm_revoke_pages(virtual, count);
+	vmm_flush_range(virtual, count);
+	vmm_release_pages(virtual, count);
 }
 
 #define PMM_COUNT 4
+// Returns the page table entry for 'virtual'.  Its page table must exist.
+// A 4M page is split into 4K pages first.
+static inline pte_t*	vmm_pte_ptr(const void *virtual, const char *who)
+{
+	uint32	pde_slot = ADDR_TO_PDE_SLOT(virtual);
+
+	if (!gp_kernel_page_dir[pde_slot])
+	{
+		PANIC3("%s: gp_kernel_page_dir[%03x] is not initialized!\n", who, pde_slot);
+	}
+
+	if (PDE_IS_4M(gp_kernel_page_dir[pde_slot]))
+	{
+		vmm_split_4m(pde_slot);
+	}
+
+	return PTBL_VIRT(pde_slot) + ADDR_TO_PTE_SLOT(virtual);
+}
+
+paddr_t		vmm_lookup_phys(const void *virtual)
+{
+	uint32	pde_slot = ADDR_TO_PDE_SLOT(virtual);
+	pte_t	pte = 0;
+
+	if (!(gp_kernel_page_dir[pde_slot] & PTE_PRESENT))
+	{
+		return 0;
+	}
+
+	if (gp_kernel_page_dir[pde_slot] & PTE_4M_PAGE)
+	{
+		return PDE_ADDR_4M(gp_kernel_page_dir[pde_slot]) | ((uint32)virtual & ~PDIR_MASK & PAGE_MASK);
+	}
+
+	pte = *vmm_pte_ptr(virtual, "lookup_phys");
+
+	return (pte & PTE_PRESENT) ? PTE_ADDR(pte) : 0;
+}
+
+void		vmm_revoke_pages(void *virtual, uint32 count)
+{
+	pte_t	*pte = NULL;
+
+	if (!IS_PAGE_ALIGNED(virtual))
+	{
+		PANIC2("revoke_pages: virtual address, %p, is not page aligned.\n", virtual);
+	}
+
+	for (; count; count--, pte++, virtual = (void*)((uint32)virtual + PAGE_SIZE))
+	{
+// Page tables are only looked up again when the range crosses into the next one.
+		if (!pte || !ADDR_TO_PTE_SLOT(virtual))
+		{
+			pte = vmm_pte_ptr(virtual, "revoke_pages");
+		}
+
+		if (!(*pte & PTE_PRESENT) || (*pte & PTE_4M_PAGE))
+		{
+			PANIC3("revoke_pages: vaddr %p is not a mapped 4K page (%p)!\n", virtual, (uint32)*pte);
+		}
+
+		*pte &= ~PTE_PRESENT;
+	}
+}
+
+void		vmm_release_pages(void *virtual, uint32 count)
+{
+	pte_t	*pte = NULL;
+	uint32	frames[VMM_MAP_BATCH];
+	uint32	frame_count = 0;
+
+	for (; count; count--, pte++, virtual = (void*)((uint32)virtual + PAGE_SIZE))
+	{
+		if (!pte || !ADDR_TO_PTE_SLOT(virtual))
+		{
+			pte = vmm_pte_ptr(virtual, "release_pages");
+		}
+
+		if (*pte & PTE_PRESENT)
+		{
+			PANIC3("release_pages: vaddr %p was not revoked (%p)!\n", virtual, (uint32)*pte);
+		}
+
+		frames[frame_count++] = PHYS_TO_PFN(PTE_ADDR(*pte));
+		*pte = 0;
+
+		if (frame_count == VMM_MAP_BATCH)
+		{
+			pmm_free_pages(frames, frame_count);
+			frame_count = 0;
+		}
+	}
+
+	pmm_free_pages(frames, frame_count);
+}
+
 void	pmm_test(void)
 {
-	void	*array[PMM_COUNT];
+	uint32	array[PMM_COUNT];
+	uint32	free_before = gp_total_free_4k_pages;
+	uint32	block = 0;
+	uint32	*virt = NULL;
 	int	i;
 
 	for (i = 0; i < PMM_COUNT; i++)
 	{
 		array[i] = pmm_get_page();
 #if (DEBUG_PMM_MAP_UNMAP)
-		printf("get_page() = %p (next = %p)\n", array[i], gp_next_free_4k_page);
+		printf("get_page() = %05x (free = %d)\n", array[i], gp_total_free_4k_pages);
 #endif
 	}
 
@@ -499,10 +1231,50 @@ void	pmm_test(void)
 	{
 		pmm_free_page(array[i]);
 #if (DEBUG_PMM_MAP_UNMAP)
-		printf("free(%p) (next = %p)\n", array[i], gp_next_free_4k_page);
+		printf("free(%05x) (free = %d)\n", array[i], gp_total_free_4k_pages);
 #endif
 	}
 
+// Multi-page blocks are naturally aligned, and merge back with their buddies.
+	block = pmm_alloc_order(3);
+	ASSERT(block && !(block & 7));
+	ASSERT(gp_total_free_4k_pages == free_before - 8);
+
+	pmm_free_order(block, 3);
+	ASSERT(gp_total_free_4k_pages == free_before);
+	ASSERT(PFN_TO_PAGE(block)->flags & PG_BUDDY);
+	ASSERT(PFN_TO_PAGE(block)->order >= 3);
+
+// Contiguous runs honour the address limit and alignment, and the unused
+// tail of the block goes straight back.
+	block = pmm_alloc_contig(3, 16 * PAGE_SIZE, PMM_PHYS_MAX_ISA);
+	ASSERT(block && !(block & 15));
+	ASSERT(PFN_TO_PHYS(block + 3) - 1 <= PMM_PHYS_MAX_ISA);
+	ASSERT(gp_total_free_4k_pages == free_before - 3);
+	pmm_free_contig(block, 3);
+	ASSERT(gp_total_free_4k_pages == free_before);
+
+// Batched gets are all or nothing.
+	ASSERT(pmm_get_pages(array, PMM_COUNT, 0) == PMM_COUNT);
+	ASSERT(gp_total_free_4k_pages == free_before - PMM_COUNT);
+	ASSERT(!pmm_get_pages(array, free_before + 1, PMM_CANFAIL));
+	pmm_free_pages(array, PMM_COUNT);
+	ASSERT(gp_total_free_4k_pages == free_before);
+
+// The direct map (or a temp mapping, above it) reaches the same frame.
+	block = pmm_get_page();
+	virt = kmap_atomic(PFN_TO_PHYS(block));
+	ASSERT(vmm_lookup_phys(virt) == PFN_TO_PHYS(block));
+	ASSERT(!virt[0] && !virt[PAGE_SIZE / 4 - 1]);
+	ASSERT(!PHYS_IS_DIRECT(PFN_TO_PHYS(block)) || (virt_to_phys(virt) == PFN_TO_PHYS(block)));
+	kunmap_atomic(virt);
+	pmm_free_page(block);
+
+// So does the highest frame in the page db (above 4G, if there is RAM up there).
+	virt = kmap_atomic(PFN_TO_PHYS(pmm_page_count - 1));
+	ASSERT(vmm_lookup_phys(virt) == PFN_TO_PHYS(pmm_page_count - 1));
+	kunmap_atomic(virt);
+
 /*
 	// this code maps the VGA screen to the 2G virtual mark and blits crap into it.
 	{
@@ -517,26 +1289,11 @@ void	pmm_test(void)
 */
 }
 
-// Find a page table in our kernel memory area that has some free virtual addresses.
-// Claim these entries for future use a temp virtual pages (used when I need to qucikly
-// map a physical page).
-static void	init_temp_vpages(void)
-{
-	int	i;
-	uint32	addr = (uint32)&_kernel_temp_vpages_start;
-
-	for (i = 0; i < VMM_TEMP_PAGES; i++, addr += PAGE_SIZE)
-	{
-		temp_vpages[i] = (void*)addr;
-	}
-}
-
-
 // Warning: This function assumes the linker order defined in 'kernel-elf.lds'.
 // If the order in that file changes, you must make adjustments here.
 void	vmm_init(const struct phys_multiboot_info *mbi)
 {
-	init_temp_vpages();
+	ASSERT(KMAP_LEVELS * KMAP_DEPTH <= PTE_SIZE - ADDR_TO_PTE_SLOT(&_kernel_temp_vpages_start));
 	pmm_test();
 }
 
@@ -544,16 +1301,17 @@ void	vmm_init(const struct phys_multiboot_info *mbi)
 // as available physical memory.  Also claims pages used by .setup.
 void	vmm_init_cleanup(void)
 {
-	uint32		phys_addr;
+	uint32		pfn;
 
-	for (phys_addr = 0x00000000; phys_addr < 0x000a0000; phys_addr += PAGE_SIZE)
+// Physical page zero is never handed out, as zero means "no page".
+	for (pfn = 1; pfn < PAGE_OF(0x000a0000); pfn++)
 	{
-		pmm_free_page((void*)phys_addr);
+		pmm_free_page(pfn);
 	}
 
-	for (phys_addr = (uint32)&_setup_start; phys_addr < (uint32)&_setup_end; phys_addr += PAGE_SIZE)
+	for (pfn = PAGE_OF(&_setup_start); pfn < PAGE_OF(&_setup_end); pfn++)
 	{
-		pmm_free_page((void*)phys_addr);
+		pmm_free_page(pfn);
 	}
 
 	printf("vmm: Currently unused physical memory: %d K\n", gp_total_free_4k_pages * 4);
@@ -8,8 +8,23 @@
 
 // Size of physical memory page.  MMU allocation unit.
 #define PAGE_BITS		12
+
+// With PAE the hardware has three levels, but the four page directories are
+// allocated together and used as one 2048 entry directory indexed by
+// 'address >> 21'.  Only setup ever sees the third level (the PDPT), so
+// everything else still walks two: PDE, then PTE.  A "4M page" is then a 2M page.
+// Physical addresses are 64 bits wide with PAE, as RAM may sit above 4G.
+#if (VMM_USE_PAE)
+typedef uint64		pte_t;
+typedef uint64		paddr_t;
+#define PTE_BITS		9
+#define PDE_BITS		11
+#else
+typedef uint32		pte_t;
+typedef uint32		paddr_t;
 #define PTE_BITS		10
 #define PDE_BITS		10
+#endif
 
 #define PAGE_SIZE		(1 << PAGE_BITS)
 #define PAGE_MASK		(~(PAGE_SIZE - 1))
@@ -20,6 +35,14 @@
 #define PDIR_SIZE		(1 << (PTE_BITS + PAGE_BITS))
 #define PDIR_MASK		(~(PDIR_SIZE - 1))
 
+// The page directory maps itself in its last PDIR_PAGES slots, so every page
+// table shows up in a window at the top of memory, in PDE order, and the
+// directory itself at the end of it (0xfffff000, or 0xffffc000 with PAE).
+#define PDE_COUNT		(1 << PDE_BITS)
+#define PDIR_PAGES		(PDE_COUNT >> PTE_BITS)
+#define PTBL_WINDOW		((uint32)0 - (PDE_COUNT << PAGE_BITS))
+#define PTBL_VIRT(pde_slot)	((pte_t*)(PTBL_WINDOW + ((uint32)(pde_slot) << PAGE_BITS)))
+
 #define MAX_PAGES		(1 << 20)
 #define ADDR_TO_PDE_SLOT(x)	((uint32)(x) >> (PTE_BITS + PAGE_BITS))
 #define ADDR_TO_PTE_SLOT(x)	(((uint32)(x) >> PAGE_BITS) & ~PTE_MEM_MASK)
@@ -48,10 +71,28 @@
 #define PTE_PRESENT	0x001
 #define PTE_NOT_PRESENT	0x000
 
+#define PTE_GLOBAL	0x100	// Kept across CR3 reloads (with CR4.PGE).
 #define PTE_DIRTY	0x040
 #define PTE_ACCESSED	0x020
 #define PTE_SYSTEM	0xe00
 
+// Writable kernel mappings can't be executed (PAE only).
+#if (VMM_USE_PAE)
+#define PTE_NX		(1ULL << 63)
+#else
+#define PTE_NX		0
+#endif
+
+// Physical frame in a page table entry (or a 4M page directory entry).
+#if (VMM_USE_PAE)
+#define PTE_ADDR_MASK	0x000ffffffffff000ULL	// Bits 12 to 51, without NX.
+#else
+#define PTE_ADDR_MASK	PAGE_MASK
+#endif
+
+#define PTE_ADDR(pte)	((paddr_t)(pte) & PTE_ADDR_MASK)
+#define PDE_ADDR_4M(pde)	(PTE_ADDR(pde) & PDIR_MASK)
+
 // According to the Intel spec, the CPU will let ring-0 code
 // read and write all present pages, even if they are marked read-only.
 #define	PTE_KCODE	(PTE_RO | PTE_SUPERVISOR | PTE_PRESENT)
@@ -65,57 +106,229 @@
 #define VMM_PHYS_REAL	0x80000000
 #define VMM_REMAP_OK	0x40000000
 #define VMM_SKIP_MAPPED	0x20000000
+#define VMM_NOZERO	0x10000000	// New physical pages need not be cleared.
 
 // Bits that are valid to pass to "vmm_map_pages" as flags.
-#define VMM_MAP_VALID_FLAGS	(PTE_ALL_FLAGS | VMM_PHYS_REAL | VMM_REMAP_OK | VMM_SKIP_MAPPED)
+#define VMM_MAP_VALID_FLAGS	(PTE_ALL_FLAGS | VMM_PHYS_REAL | VMM_REMAP_OK | VMM_SKIP_MAPPED | VMM_NOZERO)
 
 // Flags applied to the i686 CR0 register.
 #define CR0_PG_MASK 	(1 << 31)
 #define CR0_WP_MASK	(1 << 16)
 
+// CPUID.1:EDX feature bits (see CR4_xxx in i386.h).
+#define CPUID_PSE_MASK	(1 << 3)
+#define CPUID_PAE_MASK	(1 << 6)
+#define CPUID_PGE_MASK	(1 << 13)
+
+// CPUID.80000001h:EDX
+#define CPUID_NX_MASK	(1 << 20)
+
+// Page directory entry maps a 4M page (not a page table).
+#define PDE_IS_4M(pde)	(((pde) & (PTE_PRESENT | PTE_4M_PAGE)) == (PTE_PRESENT | PTE_4M_PAGE))
+
 #define BIOS_PAGE_COUNT	((1024 * 1024) / PAGE_SIZE)
 
+// The buddy allocator hands out blocks of 2^order physical pages, order 0..PMM_MAX_ORDER.
+#define PMM_MAX_ORDER		10
+#define PMM_ORDERS		(PMM_MAX_ORDER + 1)
+
 struct vmm_stats
 {
 	uint32	pmm_free_pages;
+	uint32	pmm_low_watermark;	// Below this many free pages, "[vmmd]" trims the heap.
+	uint32	heap_mapped_pages;	// Physical pages currently backing the heap.
+	uint32	heap_trimmed_pages;	// Total pages ever returned by heap_trim().
+	uint32	pmm_zero_pages;	// Free pages that are already cleared (part of pmm_free_pages).
+	uint32	pmm_dma_free_pages;	// Free pages in the DMA zone (part of pmm_free_pages).
+	uint32	pmm_free_blocks[PMM_ORDERS];	// Free buddy blocks of each order, all zones.
+};
+
+// One of these for every physical page frame, indexed by PFN (see "pmm_pages").
+// The free lists are kept here, so the buddy allocator never touches the frames.
+struct page
+{
+	struct page	*next;		// Free list links, while PG_BUDDY.
+	struct page	*prev;
+	uint32		flags;		// PG_xxx
+	uint32		order;		// Block size, while PG_BUDDY.
+};
+
+// First page of a free block on its zone's free_area[order].
+#define PG_BUDDY	0x00000001
+
+struct pmm_free_area
+{
+	struct page	*head;
+	uint32		blocks;
 };
 
-// This structure appears at the beginning of every free physical page.
-typedef struct	pmm_list_hdr
+// Physical memory is split into zones, each with its own buddy free lists.
+// ISA DMA can only reach the first 16M.  "high" is everything above the
+// direct map (setup sets its start_pfn), which is only reached through
+// kmap_atomic().  Ordinary allocations come from the highest zone first, so
+// that the direct map and the DMA zone last.  PMM_DMA_LIMIT and the end of the
+// direct map are multiples of the largest block, so buddies never straddle two zones.
+enum
 {
-	struct pmm_list_hdr	*next;		// Next page of the same size.
-	uint32			size;		// Size in bytes.
-} pmm_list_hdr;
+	PMM_ZONE_DMA,
+	PMM_ZONE_NORMAL,
+	PMM_ZONE_HIGH,
+	PMM_ZONE_COUNT
+};
 
-// Physical address of the next free 4k physical page.
-extern void	*gp_next_free_4k_page;
+#define PMM_DMA_LIMIT		(16 * 1024 * 1024)
+#define PFN_TO_ZONE(pfn)	(((pfn) < PAGE_OF(PMM_DMA_LIMIT)) ? PMM_ZONE_DMA : \
+				 ((pfn) < pmm_zones[PMM_ZONE_HIGH].start_pfn) ? PMM_ZONE_NORMAL : PMM_ZONE_HIGH)
+
+struct pmm_zone
+{
+	const char		*name;
+	uint32			start_pfn;
+	uint32			free_pages;
+	struct pmm_free_area	free_area[PMM_ORDERS];
+};
+
+// Page frame database.  Built by setup_vmm.c, mapped at _kernel_page_db_start,
+// with an entry for every frame up to the highest usable one in the e820 map
+// (as far as the window goes).  Frames at or above 'pmm_page_count' are never
+// handed out.
+extern struct page		*pmm_pages;
+extern uint32			pmm_page_count;
+extern struct pmm_zone		pmm_zones[PMM_ZONE_COUNT];
+
+#define PFN_TO_PAGE(pfn)	(&pmm_pages[(pfn)])
+#define PAGE_TO_PFN(pg)		((uint32)((pg) - pmm_pages))
+#define PFN_TO_PHYS(pfn)	((paddr_t)(pfn) << PAGE_BITS)
+#define PHYS_TO_PFN(phys)	((uint32)((paddr_t)(phys) >> PAGE_BITS))
+
+// Number of free 4k physical pages, in all orders.
 extern uint32	gp_total_free_4k_pages;
 
+// See "struct vmm_stats".  Defaults to VMM_LOW_WATERMARK.
+extern uint32	g_pmm_low_watermark;
+
 
 // VIRTUAL address of the physical kernel page directory.
-extern uint32	*gp_kernel_page_dir;
+extern pte_t	*gp_kernel_page_dir;
+
+// Non-zero if the CPU has 4M pages (PSE), and setup turned them on.  Always on with PAE.
+extern uint32	g_pse_enabled;
+
+// Non-zero if setup turned on global pages (PGE).  Everything mapped at or
+// above _kernel_direct_map_start is then marked PTE_GLOBAL, so switching
+// page directories keeps the kernel's TLB entries.
+extern uint32	g_pge_enabled;
+
+// Non-zero if setup turned on no-execute (PAE builds only).  Mappings with
+// PTE_RW then get PTE_NX.
+extern uint32	g_nx_enabled;
+
+// Physical memory below this address is always mapped at _kernel_direct_map_start.
+// See phys_to_virt().
+extern uint32	g_direct_map_limit;
 
 extern void	vmm_init(const struct phys_multiboot_info *mbi);
 extern void	pm_dump_memmap(void);
 
-// Flags passed to 'pmm_alloc()':
-//#define PMM_CANFAIL	(1 << 0)
+// Flags passed to 'pmm_get_pages()':
+#define PMM_CANFAIL	(1 << 0)
 //#define PMM_BIOS	(1 << 1)
+#define PMM_NOZERO	(1 << 2)	// Caller overwrites the whole page, don't clear it.
+
+// The physical memory manager deals in page frame numbers (PFNs).  Frame zero
+// is never handed out, so zero means "no page".  A frame may lie above the
+// direct map (and with PAE, above 4G): use kmap_atomic(PFN_TO_PHYS(pfn)) to
+// touch it, unless it came from pmm_alloc_contig() below g_direct_map_limit.
+
+// Returns a free, zeroed physical RAM page.
+// Panics if there is no free memory.
+extern uint32	pmm_get_page(void);
+
+// Places the physical page back into the buddy allocator.
+extern void	pmm_free_page(uint32 pfn);
+
+// Returns the first of 2^order contiguous, naturally aligned pages, or
+// zero.  They are NOT cleared.  pmm_free_order() must be given the same
+// order back.
+extern uint32	pmm_alloc_order(uint32 order);
+extern void	pmm_free_order(uint32 pfn, uint32 order);
+
+// Batched versions of pmm_get_page()/pmm_free_page(), one lock round trip
+// for 'count' pages.  pmm_get_pages() returns 'count', or 0 with PMM_CANFAIL.
+extern uint32	pmm_get_pages(uint32 *pfns, uint32 count, uint32 flags);
+extern void	pmm_free_pages(const uint32 *pfns, uint32 count);
 
-// Returns physical address of a free physical RAM page.
-extern void*	pmm_get_page(void);
+// Returns the first of 'pages' contiguous pages, aligned to 'align' bytes
+// (zero or a power of two), that all lie at or below 'max_phys' (the highest
+// address the device can reach, eg, PMM_PHYS_MAX_ISA).  At most
+// 2^PMM_MAX_ORDER pages.  Zero if there is no such run.  Not cleared.
+extern uint32	pmm_alloc_contig(uint32 pages, uint32 align, paddr_t max_phys);
+extern void	pmm_free_contig(uint32 pfn, uint32 pages);
 
-// Places the physical page back into the linked list of available pages.
-extern void	pmm_free_page(void *physical);
+#define PMM_PHYS_MAX_ISA	(PMM_DMA_LIMIT - 1)
+#define PMM_PHYS_MAX_32BIT	0xffffffff
+
+// Clears up to 'max' free pages into the zero pool.  Called by "[vmmd]".
+extern uint32	pmm_zero_refill(uint32 max);
 
 extern void	vmm_get_stats(struct vmm_stats *stats);
 
 // Maps a range of physical page to a (page aligned) virtual address.
-extern uint32	vmm_map_pages(void *virtual, void *physical, uint32 count, uint32 flags);
+// With VMM_PHYS_REAL, 4M aligned runs are mapped with 4M pages (if PSE is on).
+// 'physical' is ignored (pass 0) without VMM_PHYS_REAL.
+extern uint32	vmm_map_pages(void *virtual, paddr_t physical, uint32 count, uint32 flags);
+
+// Invalidates the TLB for a range of virtual pages, global ones included.
+// Past VMM_FLUSH_ALL_PAGES it flushes the whole TLB instead.
+extern void	vmm_flush_range(void *virtual, uint32 count);
+
+// Remaps a fully populated, 4M aligned range of 4K pages as one 4M page.
+// If the frames are not already one aligned block and 'may_copy' is set, the
+// data is copied into a new 4M block.  Returns 0 if the range was left alone,
+// 1 if it was remapped in place, 2 if it was copied.  The caller must
+// keep anything else from writing to the range meanwhile, which in practice
+// means holding a spinlock (interrupts off) for the whole 4M copy.
+// Unmapping part of it splits it again.
+extern int	vmm_promote_4m(void *virtual, int may_copy);
+
+// Gives the 4M page holding 'virtual' (if it is one) a page table again, so
+// its 4K pages can be unmapped one at a time.  Returns 0 if there was no free
+// page for the table.  vmm_unmap_pages() does this too, but panics instead.
+extern int	vmm_demote_4m(void *virtual);
 
 // Unmaps a range of virutal pages.
 extern void	vmm_unmap_pages(void *virtual, uint32 count);
 
+// Unmaps a range of virtual pages and returns their physical pages to the free-page pool.
+extern void	vmm_free_pages(void *virtual, uint32 count);
+
+// Lazy version of vmm_free_pages(), in two steps.  vmm_revoke_pages() marks the
+// pages not-present but does NOT invalidate the TLB, and keeps the physical
+// addresses in the PTEs.  After the caller flushes the TLB (once, for many
+// ranges), vmm_release_pages() clears the PTEs and frees the physical pages.
+extern void	vmm_revoke_pages(void *virtual, uint32 count);
+extern void	vmm_release_pages(void *virtual, uint32 count);
+
+// Returns the physical page mapped at 'virtual', or 0 if it is not mapped.
+extern paddr_t	vmm_lookup_phys(const void *virtual);
+
+// Nesting levels that kmap_atomic() keeps separate slots for.  Page faults
+// use the level of whatever they interrupted.
+enum
+{
+	KMAP_TASK,
+	KMAP_IRQ,
+	KMAP_LEVELS
+};
+
+// Maps a physical address for the kernel to touch, and undoes it.  Free (no
+// mapping at all) for memory below g_direct_map_limit.  Anything above it
+// gets the next of KMAP_DEPTH fixed slots at the current nesting level,
+// without a lock.  Mappings must be undone newest first, and the caller must
+// not sleep in between (the timer won't switch tasks meanwhile).
+extern void*	kmap_atomic(paddr_t physical);
+extern void	kunmap_atomic(void *virtual);
+
 // Diagnostic function.
 extern void	vmm_debug_virt_addr(const void *virtual);
 
@@ -136,9 +349,9 @@ extern const unsigned long _text_start, _text_end;
 extern const unsigned long _data_start, _data_end;
 extern const unsigned long _bss_start, _bss_end;
 
-// Virtual address that "setup_vmm.c" uses to temporarily map 4M pages to
-// when initializing physical RAM.
-extern const unsigned long _kernel_vmm_setup;
+// Virtual address range that "setup_vmm.c" maps the page frame database to.
+extern const unsigned long _kernel_page_db_start;
+extern const unsigned long _kernel_page_db_end;
 
 // Virtual address the kernel was configured for.  Set by linker script.
 extern const unsigned long _kernel_virtual;
@@ -147,6 +360,18 @@ extern const unsigned long _kernel_virtual;
 extern const unsigned long _kernel_heap_start;
 extern const unsigned long _kernel_heap_end;
 
+// Virtual address range that the slab allocator maps its slabs into.
+extern const unsigned long _kernel_slab_start;
+extern const unsigned long _kernel_slab_end;
+
+// Virtual address range for sampled guarded heap allocations.
+extern const unsigned long _kernel_heap_guard_start;
+extern const unsigned long _kernel_heap_guard_end;
+
+// Virtual address range for large, page backed allocations (vmalloc).
+extern const unsigned long _kernel_vmalloc_start;
+extern const unsigned long _kernel_vmalloc_end;
+
 // Virtual address of where we remap the VGA console to.
 extern const unsigned long _kernel_console_start;
 
@@ -154,6 +379,10 @@ extern const unsigned long _kernel_console_start;
 extern const unsigned long _kernel_stack_start;
 extern const unsigned long _kernel_stack_size;
 
+// Virtual address range of the direct map of low physical memory.
+extern const unsigned long _kernel_direct_map_start;
+extern const unsigned long _kernel_direct_map_end;
+
 // Virtual address of where we map the kernel page tables to.
 extern const unsigned long _kernel_ptbl_start;
 
@@ -176,4 +405,24 @@ extern unsigned long	g_module_pages;
 
 extern void*		g_pVastMapAddr;
 
+#define PHYS_IS_DIRECT(p)	((paddr_t)(p) < g_direct_map_limit)
+#define VIRT_IS_DIRECT(v)	(((uint32)(v) >= (uint32)&_kernel_direct_map_start) && \
+				 ((uint32)(v) < (uint32)&_kernel_direct_map_start + g_direct_map_limit))
+
+// Only valid for physical memory below g_direct_map_limit (see kmap_atomic() for the rest).
+static inline void*	phys_to_virt(paddr_t physical)
+{
+	ASSERT(PHYS_IS_DIRECT(physical));
+
+	return (uint8*)&_kernel_direct_map_start + (uint32)physical;
+}
+
+// Only valid for addresses inside the direct map.
+static inline paddr_t	virt_to_phys(const void *virtual)
+{
+	ASSERT(VIRT_IS_DIRECT(virtual));
+
+	return (uint32)virtual - (uint32)&_kernel_direct_map_start;
+}
+
 #endif // __PHYS_MEM_H__
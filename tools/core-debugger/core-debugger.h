@@ -16,6 +16,7 @@
 // need 'basename'
 #include <libgen.h>
 
+typedef unsigned long long uint64;
 typedef unsigned int uint32;
 typedef unsigned short int uint16;
 typedef unsigned char uint8;
@@ -44,6 +45,8 @@ extern void	DumpMemory(uint32 offset, uint32 count);
 
 extern void	DumpHeap(void);
 
+extern void	DumpHeapSites(uint32 top);
+
 extern void	DumpStack(uint32 ebp);
 
 extern uint32 parse_value(const char *str);
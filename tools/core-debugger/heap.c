@@ -3,9 +3,9 @@
 #include "core-debugger.h"
 #include "kernel/vmm/heap_block.h"
 
-static void	DumpBlock(const char *type, struct block_t *blk)
+static void	DumpBlock(const char *type, struct block_t *blk, uint32 raw_size)
 {
-	uint32 size = (ReadDword((uint32)&blk->size) - sizeof(*blk) - sizeof(uint32)) & ~7;
+	uint32 size = ((raw_size & ~BLOCK_FLAGS_MASK) - sizeof(*blk) - sizeof(uint32)) & ~7;
 	uint32 seq_id = ReadDword((uint32)&blk->seq_id);
 	uint32 line = ReadDword((uint32)&blk->line);
 	char *file = DupString(ReadDword((uint32)&blk->file));
@@ -19,36 +19,129 @@ static void	DumpBlock(const char *type, struct block_t *blk)
 	free(func);
 }
 
+// Blocks are laid out back to back, so walk them by size (boundary tags).
 void	DumpHeap(void)
 {
-	uint32	free_list_ptr = *(uint32*)(&corehelp->heap_free_list_ptr);
+	uint32	heap_start = *(uint32*)(&corehelp->heap_start);
+	uint32	heap_end = *(uint32*)(&corehelp->heap_end);
 	uint32	alloc_list_ptr = *(uint32*)(&corehelp->heap_alloc_list_ptr);
-	struct block_t *free_blk = (struct block_t*)ReadDword(free_list_ptr);
-	struct block_t *alloc_blk = (struct block_t*)ReadDword(alloc_list_ptr);
+	uint32	blk = heap_start;
+	uint32	raw_size = 0;
 
-	printf("free_list  = %08x -> %08x\n", free_list_ptr, (uint32)free_blk);
-	printf("alloc_list = %08x -> %08x\n", alloc_list_ptr, (uint32)alloc_blk);
+	printf("heap       = %08x - %08x\n", heap_start, heap_end);
+	printf("alloc_list = %08x\n", alloc_list_ptr);
 
-	while (1)
+	while (blk && (blk < heap_end))
 	{
-		if (free_blk && (free_blk < alloc_blk))
+		raw_size = ReadDword((uint32)&((struct block_t*)blk)->size);
+
+		if (!(raw_size & ~BLOCK_FLAGS_MASK))
 		{
-			DumpBlock("free ", free_blk);
-			free_blk = (struct block_t*)ReadDword((uint32)&free_blk->next);
+			printf("bad block %08x (size is zero)\n", blk);
+			break;
 		}
-		else if (alloc_blk)
+
+		if (raw_size & BLOCK_FREE)
 		{
-			DumpBlock("alloc", alloc_blk);
-			alloc_blk = (struct block_t*)ReadDword((uint32)&alloc_blk->next);
+			printf("free  %08x = size:%8d\n", blk + sizeof(struct block_t), raw_size & ~BLOCK_FLAGS_MASK);
 		}
 		else
 		{
-			break;
+			DumpBlock("alloc", (struct block_t*)blk, raw_size);
 		}
+
+		blk += raw_size & ~BLOCK_FLAGS_MASK;
 	}
 
+//	DumpMemory(0xf1000000, 16384);
 
+}
 
-//	DumpMemory(0xf1000000, 16384);
+static int	CompareSites(const void *a, const void *b)
+{
+	const struct heap_site	*sa = (const struct heap_site*)a;
+	const struct heap_site	*sb = (const struct heap_site*)b;
+
+	if (sa->live_bytes != sb->live_bytes)
+	{
+		return (sa->live_bytes < sb->live_bytes) ? 1 : -1;
+	}
+
+	return (sa->peak_bytes < sb->peak_bytes) ? 1 : (sa->peak_bytes > sb->peak_bytes) ? -1 : 0;
+}
+
+// Prints the 'top' call sites with the most live heap bytes (HEAP_PROFILE_SITES).
+void	DumpHeapSites(uint32 top)
+{
+	uint32	sites_ptr = *(uint32*)(&corehelp->heap_sites_ptr);
+	uint32	count = *(uint32*)(&corehelp->heap_sites_count);
+	struct heap_site	*sites = NULL;
+	uint32	used = 0;
+	uint32	i, j;
+	uint32	*dst = NULL;
+	char	*file = NULL;
+	char	*func = NULL;
+
+	if (!sites_ptr || !count)
+	{
+		printf("heap sites: not recorded (needs HEAP_TRACK and HEAP_PROFILE_SITES)\n");
+		return;
+	}
+
+	sites = (struct heap_site*)calloc(count, sizeof(struct heap_site));
+
+	for (i = 0; i < count; i++)
+	{
+		dst = (uint32*)&sites[used];
+
+		for (j = 0; j < sizeof(struct heap_site) / sizeof(uint32); j++)
+		{
+			dst[j] = ReadDword(sites_ptr + i * sizeof(struct heap_site) + j * sizeof(uint32));
+		}
+
+		if (!sites[used].file)
+		{
+			continue;
+		}
+
+// Each arena has its own table, so a site that allocated in several arenas
+// shows up once per arena.  Fold them together (the peaks just add up, so
+// the merged peak can be higher than the site ever really reached).
+		for (j = 0; j < used; j++)
+		{
+			if ((sites[j].file == sites[used].file) && (sites[j].line == sites[used].line))
+			{
+				sites[j].live_bytes += sites[used].live_bytes;
+				sites[j].live_count += sites[used].live_count;
+				sites[j].total_allocs += sites[used].total_allocs;
+				sites[j].peak_bytes += sites[used].peak_bytes;
+				break;
+			}
+		}
+
+		if (j == used)
+		{
+			used++;
+		}
+	}
+
+	qsort(sites, used, sizeof(struct heap_site), CompareSites);
+
+	printf("heap sites: %d sites in %d slots\n", used, count);
+	printf("%10s %8s %10s %10s  %s\n", "live", "count", "peak", "allocs", "site");
+
+	for (i = 0; (i < used) && (i < top); i++)
+	{
+		file = DupString((uint32)sites[i].file);
+		func = DupString((uint32)sites[i].func);
+
+		printf("%10u %8u %10u %10u  %s() %s:%d\n",
+			sites[i].live_bytes, sites[i].live_count, sites[i].peak_bytes,
+			sites[i].total_allocs, func, basename(file), sites[i].line);
+
+		free(file);
+		free(func);
+	}
 
+	free(sites);
 }
@@ -7,9 +7,9 @@
 static uint8	*core = NULL;
 static uint32	core_size = 0;
 
-// 1<<20 entries.  Fully decoded page table entries.
-// Unmapped pages are NULL.
-static uint32	*page_tables = NULL;
+// 1<<20 entries.  Fully decoded page table entries, 64 bits wide as
+// PAE frames can lie above 4G.  Unmapped pages are NULL.
+static uint64	*page_tables = NULL;
 
 // Pointer to loaded corehelp struct.
 struct corehelp *corehelp = NULL;
@@ -36,7 +36,7 @@ uint8		ReadByte(uint32 virtaddr)
 {
 	if (page_tables[virtaddr >> 12])
 	{
-		uint32 offset = page_tables[virtaddr >> 12] | (virtaddr & 0xfff);
+		uint64 offset = page_tables[virtaddr >> 12] | (virtaddr & 0xfff);
 
 		if (offset < core_size)
 		{
@@ -51,7 +51,7 @@ uint32		ReadDword(uint32 virtaddr)
 {
 	if (page_tables[virtaddr >> 12])
 	{
-		uint32 offset = page_tables[virtaddr >> 12] | (virtaddr & 0xfff);
+		uint64 offset = page_tables[virtaddr >> 12] | (virtaddr & 0xfff);
 
 		if (offset < core_size)
 		{
@@ -75,13 +75,65 @@ char	*DupString(uint32 virtaddr)
 	return str;
 }
 
-static void	BuildPageTables(uint32 cr3)
+// Page table entry bits that we care about.
+#define PTE_PRESENT	0x00000001
+#define PTE_LARGE	0x00000080	// 4M page (2M with PAE), in a page directory entry.
+#define PTE_FRAME	0x000ffffffffff000ULL	// Physical frame, up to 52 bits with PAE.
+
+// CR4 bit: 64 bit entries, and cr3 points at a page directory pointer table.
+#define CR4_PAE		0x00000020
+
+// Decodes one page directory entry, which maps the virtual pages from 'vpage' on.
+// With 'pae', tables hold 512 64 bit entries instead of 1024 32 bit ones.
+static void	DecodePde(uint64 pde, uint32 vpage, int pae)
+{
+	uint32	count = pae ? 512 : 1024;
+	uint64	phys = pde & PTE_FRAME;
+	uint64	entry;
+	uint32	pte;
+
+	if (!(pde & PTE_PRESENT))	// page present bit.
+	{
+		return;
+	}
+
+	if (pde & PTE_LARGE)
+	{
+		phys &= ~(uint64)((count << 12) - 1);
+
+		for (pte = 0; pte < count; pte++)
+		{
+			page_tables[vpage + pte] = phys + (pte << 12);
+		}
+
+		return;
+	}
+
+	if (phys + 4096 > core_size)
+	{
+		fprintf(stderr, "Error: page table for %08x at %llx.  core_size = %08x.\n", vpage << 12, phys, core_size);
+		return;
+	}
+
+	for (pte = 0; pte < count; pte++)
+	{
+		entry = pae ? ((uint64*)(core + phys))[pte] : ((uint32*)(core + phys))[pte];
+
+		if (entry & PTE_PRESENT)
+		{
+			page_tables[vpage + pte] = entry & PTE_FRAME;
+		}
+	}
+}
+
+static void	BuildPageTables(uint32 cr3, uint32 cr4)
 {
 	int	i;
-	uint32	*page_table;
 	uint32	*page_dir;
+	uint64	*pae_dir;
+	uint64	*pdpt;
+	int	pdpte;
 	int	pde;
-	int	pte;
 
 	if (cr3 > core_size)
 	{
@@ -89,37 +141,48 @@ static void	BuildPageTables(uint32 cr3)
 		exit(-1);
 	}
 
-	i = sizeof(uint8*) * (1 << 20);
-	if (NULL == (page_tables = (uint32*)malloc(i)))
+	i = sizeof(*page_tables) * (1 << 20);
+	if (NULL == (page_tables = (uint64*)malloc(i)))
 	{
 		fprintf(stderr, "malloc(%d) failed.\n", i);
 		perror("malloc");
 		exit(-1);
 	}
 
-	page_dir = (uint32*)(core + cr3);
+	memset(page_tables, 0, i);
 
-	for (pde = 0; pde < 1024; pde++)
+	if (!(cr4 & CR4_PAE))
 	{
-		if (page_dir[pde] & 0x00000001)		// page present bit.
+		page_dir = (uint32*)(core + cr3);
+
+		for (pde = 0; pde < 1024; pde++)
 		{
-			i = page_dir[pde] & 0xfffff000;
+			DecodePde(page_dir[pde], pde * 1024, 0);
+		}
 
-			if (i > core_size)
-			{
-				fprintf(stderr, "Error: page_dir[%03x] = %08x.  core_size = %08x.\n", pde, i, core_size);
-				continue;
-			}
+		return;
+	}
 
-			page_table = (uint32*)(core + i);
+// PAE: cr3 holds a 32 byte aligned table of 4 pointers to page directories.
+	pdpt = (uint64*)(core + (cr3 & 0xffffffe0));
 
-			for (pte = 0; pte < 1024; pte++)
-			{
-				if (page_table[pte] & 0x00000001)
-				{
-					page_tables[pde * 1024 + pte] = page_table[pte] & 0xfffff000;
-				}
-			}
+	for (pdpte = 0; pdpte < 4; pdpte++)
+	{
+		i = (uint32)pdpt[pdpte] & 0xfffff000;
+
+		if (!(pdpt[pdpte] & PTE_PRESENT)) continue;
+
+		if (i + 4096 > core_size)
+		{
+			fprintf(stderr, "Error: pdpt[%d] = %08x.  core_size = %08x.\n", pdpte, i, core_size);
+			continue;
+		}
+
+		pae_dir = (uint64*)(core + i);
+
+		for (pde = 0; pde < 512; pde++)
+		{
+			DecodePde(pae_dir[pde], (pdpte * 512 + pde) * 512, 1);
 		}
 	}
 
@@ -207,7 +270,7 @@ void	LoadCore(const char *filename)
 	}
 
 	cr3 = *(uint32*)(&corehelp->cr3);
-	printf("cr3 = %08x\n", cr3);
+	printf("cr3 = %08x, cr4 = %08x\n", cr3, corehelp->cr4);
 
-	BuildPageTables(cr3);
+	BuildPageTables(cr3, corehelp->cr4);
 }
@@ -59,6 +59,7 @@ int	main(int argc, char *argv[])
 	char		*core_file = NULL;
 	uint32		stack = 0;
 	uint32		heap = 0;
+	uint32		heap_sites = 0;
 	int		i;
 
 	for (i = 1; i < argc; i++)
@@ -75,6 +76,10 @@ int	main(int argc, char *argv[])
 		{
 			heap = 1;
 		}
+		else if (!strcmp(argv[i], "heapsites"))
+		{
+			heap_sites = parse_value(argv[++i]);
+		}
 	}
 
 	if (!core_file)
@@ -95,5 +100,10 @@ int	main(int argc, char *argv[])
 		DumpHeap();
 	}
 
+	if (heap_sites)
+	{
+		DumpHeapSites(heap_sites);
+	}
+
 	return 0;
 }
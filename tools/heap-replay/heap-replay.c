@@ -0,0 +1,382 @@
+/*	tools/heap-replay/heap-replay.c
+
+	Replays kmalloc() / kfree() traces against the kernel heap, on the
+	linux host.  "kernel/vmm/heap.c" is compiled in as-is, against the
+	shim in "tools/heap-replay/kernel/kernel.h", so allocator changes
+	can be compared on real workloads without booting.
+
+	To capture a trace, build the kernel with HEAP_REPLAY (and
+	HEAP_TRACK) set in config.h, and save the debug port output.  Only
+	the "heap-replay: ..." lines are used, everything else is skipped:
+
+		heap-replay: replay_list[12] = kmalloc(40,0);
+		heap-replay: krealloc(replay_list[12],64,0);
+		heap-replay: kfree(replay_list[12]); replay_list[12] = NULL;
+
+	(krealloc() only logs when it resized in place.  When it has to move
+	a block, it logs the kmalloc and kfree that it did instead.)
+
+	Usage: heap-replay [-r repeats] [-t trim_interval] trace.log
+
+	The heap range is mmap()ed PROT_NONE.  Pages fault in through
+	heap_grow() (from a SIGSEGV handler), just like in the kernel, so
+	the footprint is the number of pages the heap actually touched.
+*/
+
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include "kernel/kernel.h"
+
+#define HOST_HEAP_PAGES		(((uint32)&_kernel_heap_end - (uint32)&_kernel_heap_start) / PAGE_SIZE)
+
+enum { OP_ALLOC, OP_FREE, OP_REALLOC };
+
+struct replay_op
+{
+	uint32	type;		// OP_xxx
+	uint32	id;		// Allocation sequence id (from the kernel's HEAP_TRACK).
+	uint32	bytes;
+	uint32	flags;
+};
+
+static struct replay_op	*ops = NULL;
+static uint32		op_count = 0;
+
+// Indexed by allocation id.
+static void		**live_ptr = NULL;
+static uint32		*live_bytes = NULL;
+static uint32		max_id = 0;
+
+static uint8		*page_mapped = NULL;	// One byte per heap page.
+
+struct corehelp		corehelp;
+uint32			gp_total_free_4k_pages = 0;
+uint32			heap_guard_rate = 0;
+
+/* Stand-ins for the VMM. */
+
+uint32	vmm_map_pages(void *virtual, paddr_t physical, uint32 count, uint32 flags)
+{
+	uint32	page = ((uint32)virtual - (uint32)&_kernel_heap_start) / PAGE_SIZE;
+	uint32	mapped = 0;
+	uint32	i;
+
+	for (i = 0; i < count; i++)
+	{
+		if (!page_mapped[page + i])
+		{
+			page_mapped[page + i] = 1;
+			mapped++;
+		}
+	}
+
+	mprotect(virtual, count * PAGE_SIZE, PROT_READ | PROT_WRITE);
+
+	return mapped;
+}
+
+void	vmm_unmap_pages(void *virtual, uint32 count)
+{
+	uint32	page = ((uint32)virtual - (uint32)&_kernel_heap_start) / PAGE_SIZE;
+
+	memset(page_mapped + page, 0, count);
+	madvise(virtual, count * PAGE_SIZE, MADV_DONTNEED);
+	mprotect(virtual, count * PAGE_SIZE, PROT_NONE);
+}
+
+paddr_t	vmm_lookup_phys(const void *virtual)
+{
+	uint32	page = ((uint32)virtual - (uint32)&_kernel_heap_start) / PAGE_SIZE;
+
+	return page_mapped[page] ? (uint32)virtual : 0;
+}
+
+void	pmm_free_page(uint32 pfn)
+{
+}
+
+/* The replay only exercises the heap itself. */
+
+#if (HEAP_TRACK)
+void*	heap_guard_alloc(uint32 bytes, const char *file, int line, const char *func)
+#else
+void*	heap_guard_alloc(uint32 bytes)
+#endif
+{
+	return NULL;
+}
+
+void	heap_guard_free(void *ptr)
+{
+	abort();
+}
+
+uint32	heap_guard_size(const void *ptr)
+{
+	abort();
+}
+
+void*	vmalloc(uint32 bytes, uint32 flags)
+{
+	return NULL;
+}
+
+void	vfree(void *ptr)
+{
+	abort();
+}
+
+uint32	vmalloc_size(const void *ptr)
+{
+	abort();
+}
+
+static void	on_segv(int sig, siginfo_t *si, void *ctx)
+{
+	static struct regs	r;
+
+	if ((si->si_addr >= (void*)&_kernel_heap_start) && (si->si_addr < (void*)&_kernel_heap_end))
+	{
+		heap_grow(&r, si->si_addr);
+		return;
+	}
+
+	signal(SIGSEGV, SIG_DFL);	// Let it crash for real.
+}
+
+static uint64	now_ns(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void	load_trace(const char *filename)
+{
+	FILE	*fp = NULL;
+	char	line[256];
+	char	*p = NULL;
+	uint32	op_max = 0;
+	struct replay_op	op;
+
+	if (NULL == (fp = fopen(filename, "r")))
+	{
+		perror(filename);
+		exit(1);
+	}
+
+	while (fgets(line, sizeof(line), fp))
+	{
+		if (NULL == (p = strstr(line, "heap-replay: ")))
+		{
+			continue;
+		}
+
+		p += strlen("heap-replay: ");
+		memset(&op, 0, sizeof(op));
+
+		if (3 == sscanf(p, "replay_list[%u] = kmalloc(%u,%u);", &op.id, &op.bytes, &op.flags))
+		{
+			op.type = OP_ALLOC;
+		}
+		else if (3 == sscanf(p, "krealloc(replay_list[%u],%u,%u);", &op.id, &op.bytes, &op.flags))
+		{
+			op.type = OP_REALLOC;
+		}
+		else if (1 == sscanf(p, "kfree(replay_list[%u]);", &op.id))
+		{
+			op.type = OP_FREE;
+		}
+		else
+		{
+			continue;
+		}
+
+		if (op_count == op_max)
+		{
+			op_max = op_max ? op_max * 2 : 4096;
+			ops = (struct replay_op*)realloc(ops, op_max * sizeof(struct replay_op));
+		}
+
+		ops[op_count++] = op;
+		max_id = max(max_id, op.id + 1);
+	}
+
+	fclose(fp);
+
+	live_ptr = (void**)calloc(max_id, sizeof(void*));
+	live_bytes = (uint32*)calloc(max_id, sizeof(uint32));
+}
+
+int	main(int argc, char *argv[])
+{
+	struct sigaction	sa;
+	struct heap_stats	hs;
+	void	*heap = NULL;
+	uint32	repeats = 1;
+	uint32	trim_interval = 0;
+	uint32	r, i;
+	int	opt;
+
+	uint64	t = 0;
+	uint64	alloc_ns = 0, free_ns = 0;
+	uint64	alloc_worst = 0, free_worst = 0;
+	uint32	allocs = 0, frees = 0, reallocs = 0, skipped = 0;
+	uint32	live = 0, peak_live = 0;
+	uint32	peak_pages = 0, live_at_peak = 0;
+
+	while (-1 != (opt = getopt(argc, argv, "r:t:")))
+	{
+		switch (opt)
+		{
+			case 'r': repeats = max(atoi(optarg), 1); break;
+			case 't': trim_interval = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-r repeats] [-t trim_interval] trace.log\n", argv[0]);
+				return 1;
+		}
+	}
+
+	if (optind >= argc)
+	{
+		fprintf(stderr, "usage: %s [-r repeats] [-t trim_interval] trace.log\n", argv[0]);
+		return 1;
+	}
+
+	load_trace(argv[optind]);
+	printf("heap-replay: %u ops, %u ids from %s\n", op_count, max_id, argv[optind]);
+
+// Reserve the heap's virtual range at the address the kernel uses (as linked in).
+	heap = mmap((void*)&_kernel_heap_start, HOST_HEAP_PAGES * PAGE_SIZE, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	if (heap != (void*)&_kernel_heap_start)
+	{
+		fprintf(stderr, "heap-replay: could not map heap at %p\n", (void*)&_kernel_heap_start);
+		return 1;
+	}
+
+	page_mapped = (uint8*)calloc(HOST_HEAP_PAGES, 1);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = on_segv;
+	sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+	sigaction(SIGSEGV, &sa, NULL);
+
+	heap_init();
+
+	for (r = 0; r < repeats; r++)
+	{
+		for (i = 0; i < op_count; i++)
+		{
+			struct replay_op	*op = &ops[i];
+
+			if (op->type == OP_ALLOC)
+			{
+				if (live_ptr[op->id])
+				{
+					skipped++;
+					continue;
+				}
+
+				t = now_ns();
+				live_ptr[op->id] = kmalloc(op->bytes, op->flags);
+				t = now_ns() - t;
+
+				alloc_ns += t;
+				alloc_worst = max(alloc_worst, t);
+				allocs++;
+
+				live_bytes[op->id] = op->bytes;
+				live += op->bytes;
+				peak_live = max(peak_live, live);
+			}
+			else if (op->type == OP_REALLOC)
+			{
+				if (!live_ptr[op->id])
+				{
+					skipped++;
+					continue;
+				}
+
+				t = now_ns();
+				live_ptr[op->id] = krealloc(live_ptr[op->id], op->bytes, op->flags);
+				t = now_ns() - t;
+
+				alloc_ns += t;
+				alloc_worst = max(alloc_worst, t);
+				reallocs++;
+
+				live += op->bytes - live_bytes[op->id];
+				live_bytes[op->id] = op->bytes;
+				peak_live = max(peak_live, live);
+			}
+			else
+			{
+// Trace started after this was allocated.
+				if (!live_ptr[op->id])
+				{
+					skipped++;
+					continue;
+				}
+
+				t = now_ns();
+				kfree(live_ptr[op->id]);
+				t = now_ns() - t;
+
+				free_ns += t;
+				free_worst = max(free_worst, t);
+				frees++;
+
+				live_ptr[op->id] = NULL;
+				live -= live_bytes[op->id];
+			}
+
+			if (heap_mapped_pages > peak_pages)
+			{
+				peak_pages = heap_mapped_pages;
+				live_at_peak = live;
+			}
+
+			if (trim_interval && !(i % trim_interval))
+			{
+				heap_trim(~0);
+			}
+		}
+
+// Things still allocated at the end of the trace.  Free them so the next pass starts clean.
+		heap_get_stats(&hs);
+		printf("heap-replay: pass %u: %u blocks live (%u bytes requested, %u used), %u free blocks\n",
+			r, hs.alloc_blocks, live, hs.alloc_bytes, hs.free_blocks);
+
+		for (i = 0; i < max_id; i++)
+		{
+			if (live_ptr[i])
+			{
+				kfree(live_ptr[i]);
+				live_ptr[i] = NULL;
+			}
+		}
+
+		live = 0;
+	}
+
+	heap_get_stats(&hs);
+
+	printf("\n");
+	printf("kmalloc+krealloc: %10u calls, %8.1f ns/op, worst %8llu ns\n",
+		allocs + reallocs, (allocs + reallocs) ? (double)alloc_ns / (allocs + reallocs) : 0.0, alloc_worst);
+	printf("kfree:            %10u calls, %8.1f ns/op, worst %8llu ns\n",
+		frees, frees ? (double)free_ns / frees : 0.0, free_worst);
+	printf("skipped ops:      %10u\n", skipped);
+	printf("peak live:        %10u bytes requested\n", peak_live);
+	printf("peak footprint:   %10u bytes (%u pages)\n", peak_pages * PAGE_SIZE, peak_pages);
+	printf("fragmentation:    %9.1f%% of peak footprint not live\n",
+		peak_pages ? 100.0 * (1.0 - (double)live_at_peak / ((double)peak_pages * PAGE_SIZE)) : 0.0);
+	printf("trimmed:          %10u pages\n", hs.trimmed_pages);
+
+	return 0;
+}
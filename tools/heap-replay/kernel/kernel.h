@@ -0,0 +1,101 @@
+/*	tools/heap-replay/kernel/kernel.h
+
+	Stands in for "kernel/kernel.h" when "kernel/vmm/heap.c" is built
+	into the host side heap-replay tool.  Just enough of the kernel to
+	compile the heap: the heap range is an mmap()ed area (see
+	heap-replay.c), spinlocks do nothing, and kdebug() goes nowhere.
+*/
+
+#ifndef __HEAP_REPLAY_KERNEL_H__
+#define __HEAP_REPLAY_KERNEL_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+typedef unsigned int uint32;
+typedef unsigned short int uint16;
+typedef unsigned char uint8;
+typedef unsigned long long uint64;
+
+#include "kernel/kernel/config.h"
+
+#define T()
+#define ROUND_UP(x,y)	(((x) + (y) - 1) & ~((y) - 1))
+#define max(x,y)	((x) > (y) ? (x) : (y))
+#define min(x,y)	((x) < (y) ? (x) : (y))
+
+// Kernel panics become host aborts.
+#define ASSERT(x)	do { if (!(x)) { fprintf(stderr, "%s:%d: ASSERT(%s) failed\n", __FILE__, __LINE__, #x); abort(); } } while (0)
+#define PANIC1(f)	do { fprintf(stderr, f); abort(); } while (0)
+#define PANIC2(f,a)	do { fprintf(stderr, f, a); abort(); } while (0)
+#define PANIC3(f,a,b)	do { fprintf(stderr, f, a, b); abort(); } while (0)
+
+static const int DEBUG_FATAL = 0;
+static const int DEBUG_WARN  = 2;
+static const int DEBUG_INFO  = 3;
+static const int DEBUG_DEBUG = 4;
+static const int FAC_HEAP    = 1;
+
+#define kdebug(...)		do { } while (0)
+#define kdebug_mem_dump(...)	do { } while (0)
+static inline uint8 con_set_attr(uint8 attr) { return attr; }
+
+typedef struct spinlock { int lock; const char *name; } spinlock;
+#define INIT_SPINLOCK(n)	{0, n}
+#define spinlock_acquire(x)	((void)(x))
+#define spinlock_release(x)	((void)(x))
+#define spinlock_init(x,n)	((void)(x), (void)(n))
+
+struct regs { uint32 eip; };
+
+static inline uint32 bit_scan_forward(uint32 x) { return __builtin_ctz(x); }
+static inline uint32 bit_scan_reverse(uint32 x) { return 31 - __builtin_clz(x); }
+
+static inline uint32 atomic_cmpxchg(volatile uint32 *ptr, uint32 old, uint32 new) { return __sync_val_compare_and_swap(ptr, old, new); }
+static inline uint32 atomic_xchg(volatile uint32 *ptr, uint32 value) { return __sync_lock_test_and_set(ptr, value); }
+
+// No interrupts on the host.
+static volatile int irq_nesting = 0;
+static inline int in_irq(void) { return irq_nesting; }
+
+// vmm.h
+#define PAGE_BITS		12
+#define PAGE_SIZE		(1 << PAGE_BITS)
+#define PAGE_MASK		(~(PAGE_SIZE - 1))
+#define PAGE_BASE(x)		((uint32)(x) & PAGE_MASK)
+#define PHYS_TO_PFN(phys)	((uint32)(phys) >> PAGE_BITS)
+#define PDIR_SIZE		(1 << 22)
+typedef uint32		paddr_t;
+#define PTE_KDATA		0x003
+#define VMM_SKIP_MAPPED		0x20000000
+
+extern uint32	gp_total_free_4k_pages;
+
+// No 4M pages: heap_promote() never promotes, and there is nothing to demote.
+#define g_pse_enabled		0
+static inline int vmm_promote_4m(void *virtual, int may_copy) { return 0; }
+static inline int vmm_demote_4m(void *virtual) { return 1; }
+static inline uint32 timer_getcount(void) { return 0; }
+extern const unsigned long _kernel_heap_start, _kernel_heap_end;
+extern const unsigned long _kernel_heap_guard_start, _kernel_heap_guard_end;
+extern const unsigned long _kernel_vmalloc_start, _kernel_vmalloc_end;
+
+// Provided by heap-replay.c.  Pages are mprotect()ed in and out of the heap range.
+uint32	vmm_map_pages(void *virtual, paddr_t physical, uint32 count, uint32 flags);
+void	vmm_unmap_pages(void *virtual, uint32 count);
+paddr_t	vmm_lookup_phys(const void *virtual);
+void	pmm_free_page(uint32 pfn);
+
+// corehelp.h
+struct corehelp { uint32 heap_start, heap_end, heap_alloc_list_ptr, heap_sites_ptr, heap_sites_count; };
+extern struct corehelp corehelp;
+
+// Only the heap itself is replayed.  Slabs, guard slots and vmalloc are never used.
+static inline int is_slab_ptr(const void *x) { return 0; }
+
+#include "kernel/vmm/vmalloc.h"
+#include "kernel/vmm/heap.h"
+
+#endif	// __HEAP_REPLAY_KERNEL_H__